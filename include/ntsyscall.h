@@ -79,7 +79,7 @@
 #ifdef SYSCALL_WINXP
 	NUL( NtCreateProcessEx ),
 #endif
-	DEC( NtCreateProfile, 9 ),
+	IMP( NtCreateProfile, 9 ),
 	IMP( NtCreateSection, 7 ),
 	IMP( NtCreateSemaphore, 5 ),
 	IMP( NtCreateSymbolicLinkObject, 4 ),
@@ -221,7 +221,7 @@
 	IMP( NtQueryInformationThread, 5 ),
 	IMP( NtQueryInformationToken, 5 ),
 	IMP( NtQueryInstallUILanguage, 1 ),
-	DEC( NtQueryIntervalProfile, 2 ),
+	IMP( NtQueryIntervalProfile, 2 ),
 #ifdef SYSCALL_WINXP
 	DEC( NtQueryIoCompletion, 5 ),
 #endif
@@ -315,7 +315,7 @@
 	IMP( NtSetInformationProcess, 4 ),
 	IMP( NtSetInformationThread, 4 ),
 	DEC( NtSetInformationToken, 4 ),
-	DEC( NtSetIntervalProfile, 2 ),
+	IMP( NtSetIntervalProfile, 2 ),
 #ifdef SYSCALL_WINXP
 	IMP( NtSetIoCompletion, 5 ),
 #endif
@@ -339,8 +339,8 @@
 	DEC( NtSetVolumeInformationFile, 5 ),
 	IMP( NtShutdownSystem, 1 ),
 	DEC( NtSignalAndWaitForSingleObject, 4 ),
-	DEC( NtStartProfile, 1 ),
-	DEC( NtStopProfile, 1 ),
+	IMP( NtStartProfile, 1 ),
+	IMP( NtStopProfile, 1 ),
 #ifdef SYSCALL_WINXP
 	NUL( NtSuspendProcess ),
 #endif
@@ -1631,6 +1631,11 @@ typedef struct _ATOM_BASIC_INFORMATION {
    WCHAR        Name[1];
 } ATOM_BASIC_INFORMATION, *PATOM_BASIC_INFORMATION;
 
+typedef struct _ATOM_TABLE_INFORMATION {
+   ULONG        NumberOfAtoms;
+   USHORT       Atoms[1];
+} ATOM_TABLE_INFORMATION, *PATOM_TABLE_INFORMATION;
+
 /* FIXME: names probably not correct */
 typedef struct _RTL_HANDLE
 {
@@ -1678,6 +1683,10 @@ typedef struct _RTL_HANDLE_TABLE
 #define FILE_ATTRIBUTE_VALID_FLAGS      0x00007fb7
 #define FILE_ATTRIBUTE_VALID_SET_FLAGS  0x000031a7
 
+/* special ByteOffset values for NtReadFile and NtWriteFile */
+#define FILE_WRITE_TO_END_OF_FILE       0xffffffff
+#define FILE_USE_FILE_POINTER_POSITION  0xfffffffe
+
 /* status for NtCreateFile or NtOpenFile */
 #define FILE_SUPERSEDED                 0
 #define FILE_OPENED                     1
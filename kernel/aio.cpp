@@ -0,0 +1,216 @@
+/*
+ * asynchronous file I/O
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+
+#include "debug.h"
+#include "event_loop.h"
+#include "aio.h"
+
+static const int aio_max_workers = 4;
+
+static pthread_t workers[aio_max_workers];
+static int num_workers;
+static int done_fd = -1;
+
+// the lists are shared with the workers, and guarded by aio_lock
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cond = PTHREAD_COND_INITIALIZER;
+static aio_request_list_t submitted;
+static aio_request_list_t finished;
+static aio_wakeup_fn wakeup;
+
+// requests submitted but not yet completed, only used on the kernel thread
+static ULONG in_flight;
+
+class aio_watcher_t : public fd_watcher_t
+{
+public:
+	virtual void ready( ULONG events );
+};
+
+static aio_watcher_t aio_watcher;
+
+aio_request_t::aio_request_t( int _fd, bool _is_write, ULONG _length, LONGLONG _offset ) :
+	fd( _fd ),
+	is_write( _is_write ),
+	length( _length ),
+	offset( _offset ),
+	result( 0 )
+{
+	buffer = new (std::nothrow) unsigned char[length ? length : 1];
+}
+
+aio_request_t::~aio_request_t()
+{
+	delete[] buffer;
+}
+
+// runs on a worker thread
+void aio_request_t::run()
+{
+	ULONG done = 0;
+	int ret;
+
+	while (done < length)
+	{
+		if (is_write)
+			ret = ::pwrite64( fd, buffer + done, length - done, offset + done );
+		else
+			ret = ::pread64( fd, buffer + done, length - done, offset + done );
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+		{
+			result = -errno;
+			return;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	result = done;
+}
+
+static void *aio_worker( void *arg )
+{
+	aio_request_t *req;
+
+	pthread_mutex_lock( &aio_lock );
+	while (1)
+	{
+		req = submitted.head();
+		if (!req)
+		{
+			pthread_cond_wait( &aio_cond, &aio_lock );
+			continue;
+		}
+		submitted.unlink( req );
+		pthread_mutex_unlock( &aio_lock );
+
+		req->run();
+
+		pthread_mutex_lock( &aio_lock );
+		finished.append( req );
+
+		// wake the kernel thread
+		uint64_t one = 1;
+		if (0 > write( done_fd, &one, sizeof one ))
+			die("eventfd write failed (%d)\n", errno);
+		if (wakeup)
+			wakeup();
+	}
+	return 0;
+}
+
+static void start_workers()
+{
+	sigset_t all, old;
+
+	done_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if (done_fd < 0)
+		die("couldn't create eventfd (%d)\n", errno);
+	event_loop_add_fd( done_fd, EPOLLIN, &aio_watcher );
+
+	// signals are for the kernel thread, so workers block them all
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+	for (num_workers = 0; num_workers < aio_max_workers; num_workers++)
+		if (0 != pthread_create( &workers[num_workers], NULL, aio_worker, NULL ))
+			break;
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if (!num_workers)
+		die("couldn't start I/O workers\n");
+	dprintf("started %d I/O workers\n", num_workers);
+}
+
+void aio_submit( aio_request_t *req )
+{
+	if (!num_workers)
+		start_workers();
+
+	in_flight++;
+	pthread_mutex_lock( &aio_lock );
+	submitted.append( req );
+	pthread_cond_signal( &aio_cond );
+	pthread_mutex_unlock( &aio_lock );
+}
+
+void aio_set_wakeup( aio_wakeup_fn fn )
+{
+	pthread_mutex_lock( &aio_lock );
+	wakeup = fn;
+	pthread_mutex_unlock( &aio_lock );
+}
+
+bool async_io_pending()
+{
+	return in_flight != 0;
+}
+
+void check_async_io()
+{
+	aio_request_list_t done;
+	aio_request_t *req;
+
+	if (!in_flight)
+		return;
+
+	pthread_mutex_lock( &aio_lock );
+	while ((req = finished.head()))
+	{
+		finished.unlink( req );
+		done.append( req );
+	}
+	pthread_mutex_unlock( &aio_lock );
+
+	while ((req = done.head()))
+	{
+		done.unlink( req );
+		in_flight--;
+		req->complete();
+		delete req;
+	}
+}
+
+void aio_watcher_t::ready( ULONG events )
+{
+	uint64_t count;
+
+	// level triggered, so drain the count before looking at the list
+	while (read( done_fd, &count, sizeof count ) > 0)
+		;
+	check_async_io();
+}
@@ -0,0 +1,72 @@
+/*
+ * asynchronous file I/O
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __RING3K_AIO_H__
+#define __RING3K_AIO_H__
+
+#include "list.h"
+
+// Reads and writes that shouldn't stall the kernel are handed to a
+// small pool of worker threads.  Workers only do the pread or pwrite,
+// into a buffer owned by the request, and never touch kernel objects
+// or guest memory.  Finished requests come back through an eventfd in
+// the event loop, and complete() runs on the kernel thread.
+
+// larger transfers are done synchronously, rather than buffering them
+const ULONG aio_max_length = 0x100000;
+
+class aio_request_t;
+
+typedef list_anchor<aio_request_t,0> aio_request_list_t;
+typedef list_element<aio_request_t> aio_request_element_t;
+
+class aio_request_t
+{
+	friend class list_anchor<aio_request_t,0>;
+	friend class list_element<aio_request_t>;
+	aio_request_element_t entry[1];
+protected:
+	int fd;
+	bool is_write;
+	unsigned char *buffer;
+	ULONG length;
+	LONGLONG offset;
+	int result;		// bytes transferred, or -errno
+public:
+	aio_request_t( int fd, bool is_write, ULONG length, LONGLONG offset );
+	virtual ~aio_request_t();
+	bool valid() { return buffer != 0; }
+	void run();
+	virtual void complete() = 0;
+};
+
+// takes ownership of req, which is deleted after complete()
+void aio_submit( aio_request_t *req );
+
+// complete finished requests, cheap if there are none
+void check_async_io();
+bool async_io_pending();
+
+// Sleepers that don't wait in the event loop (SDL) set a hook to be
+// woken.  It runs on a worker thread, with the request lists locked.
+typedef void (*aio_wakeup_fn)();
+void aio_set_wakeup( aio_wakeup_fn fn );
+
+#endif // __RING3K_AIO_H__
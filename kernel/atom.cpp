@@ -20,6 +20,10 @@
 
 
 #include <stdarg.h>
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -27,14 +31,332 @@
 #include "winternl.h"
 
 #include "debug.h"
+#include "list.h"
+#include "unicode.h"
+#include "object.h"
+#include "ntcall.h"
+#include "process.h"
+#include "thread.h"
+
+// Integer atoms are below MAXINTATOM and never stored.
+// String atoms are MAXINTATOM plus an index into the table,
+// and are found by name through a case insensitive hash.
+static const USHORT MAXINTATOM = 0xc000;
+static const ULONG max_atoms = 0x10000 - MAXINTATOM;
+static const ULONG max_atom_length = 255;
+
+class atom_t;
+
+typedef list_anchor<atom_t, 0> atom_bucket_t;
+typedef list_element<atom_t> atom_entry_t;
+typedef list_iter<atom_t, 0> atom_iter_t;
+
+class atom_t
+{
+public:
+	atom_entry_t entry[1];
+	unicode_string_t name;
+	ULONG hash;
+	USHORT index;
+	USHORT refcount;
+	USHORT pinned;
+};
+
+class atom_table_t
+{
+	atom_bucket_t *buckets;
+	ULONG num_buckets;
+	ULONG num_atoms;
+	atom_t *atoms[max_atoms];
+	USHORT free_index[max_atoms];
+	ULONG num_free;
+	ULONG high_water;
+	static ULONG hash_name( const UNICODE_STRING& name );
+	void rehash( ULONG count );
+	atom_t *lookup( const UNICODE_STRING& name, ULONG hash );
+public:
+	atom_table_t();
+	NTSTATUS add( const UNICODE_STRING& name, USHORT& atom );
+	NTSTATUS find( const UNICODE_STRING& name, USHORT& atom );
+	NTSTATUS remove( USHORT atom );
+	atom_t *get( USHORT atom );
+	ULONG count() { return num_atoms; }
+	ULONG list( USHORT *out, ULONG max );
+};
+
+static atom_table_t global_atoms;
+
+atom_table_t::atom_table_t() :
+	buckets( 0 ),
+	num_buckets( 0 ),
+	num_atoms( 0 ),
+	num_free( 0 ),
+	high_water( 0 )
+{
+	memset( atoms, 0, sizeof atoms );
+}
+
+ULONG atom_table_t::hash_name( const UNICODE_STRING& name )
+{
+	ULONG hash = 0;
+	for (ULONG i = 0; i < name.Length/2; i++)
+		hash = hash * 31 + tolower( name.Buffer[i] );
+	return hash;
+}
+
+void atom_table_t::rehash( ULONG count )
+{
+	atom_bucket_t *old = buckets;
+	ULONG old_count = num_buckets;
+
+	buckets = new atom_bucket_t[count];
+	num_buckets = count;
+
+	for (ULONG i = 0; i < old_count; i++)
+	{
+		while (!old[i].empty())
+		{
+			atom_t *a = old[i].head();
+			old[i].unlink( a );
+			buckets[a->hash % num_buckets].append( a );
+		}
+	}
+	delete[] old;
+}
+
+atom_t *atom_table_t::lookup( const UNICODE_STRING& name, ULONG hash )
+{
+	if (!num_buckets)
+		return 0;
+	for (atom_iter_t i(buckets[hash % num_buckets]); i; i.next())
+	{
+		atom_t *a = i;
+		if (a->hash == hash && a->name.compare( const_cast<UNICODE_STRING*>( &name ), TRUE ))
+			return a;
+	}
+	return 0;
+}
+
+atom_t *atom_table_t::get( USHORT atom )
+{
+	if (atom < MAXINTATOM)
+		return 0;
+	return atoms[atom - MAXINTATOM];
+}
+
+NTSTATUS atom_table_t::find( const UNICODE_STRING& name, USHORT& atom )
+{
+	atom_t *a = lookup( name, hash_name( name ) );
+	if (!a)
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	atom = MAXINTATOM + a->index;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS atom_table_t::add( const UNICODE_STRING& name, USHORT& atom )
+{
+	ULONG hash = hash_name( name );
+	atom_t *a = lookup( name, hash );
+	if (a)
+	{
+		// an atom added too many times can never be deleted
+		if (a->refcount < 0xffff)
+			a->refcount++;
+		else
+			a->pinned = 1;
+		atom = MAXINTATOM + a->index;
+		return STATUS_SUCCESS;
+	}
+
+	ULONG index;
+	if (num_free)
+		index = free_index[--num_free];
+	else if (high_water < max_atoms)
+		index = high_water++;
+	else
+		return STATUS_NO_MEMORY;
+
+	a = new atom_t;
+	if (!a)
+		return STATUS_NO_MEMORY;
+	NTSTATUS r = a->name.copy( &name );
+	if (r < STATUS_SUCCESS)
+	{
+		delete a;
+		free_index[num_free++] = index;
+		return r;
+	}
+	a->hash = hash;
+	a->index = index;
+	a->refcount = 1;
+	a->pinned = 0;
+
+	if (num_atoms >= num_buckets * 2)
+		rehash( num_buckets ? num_buckets * 4 : 64 );
+	buckets[hash % num_buckets].append( a );
+	atoms[index] = a;
+	num_atoms++;
+
+	atom = MAXINTATOM + index;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS atom_table_t::remove( USHORT atom )
+{
+	atom_t *a = get( atom );
+	if (!a)
+		return STATUS_INVALID_HANDLE;
+
+	if (a->pinned)
+		return STATUS_SUCCESS;
+	if (--a->refcount)
+		return STATUS_SUCCESS;
+
+	buckets[a->hash % num_buckets].unlink( a );
+	atoms[a->index] = 0;
+	free_index[num_free++] = a->index;
+	num_atoms--;
+	delete a;
+
+	return STATUS_SUCCESS;
+}
+
+ULONG atom_table_t::list( USHORT *out, ULONG max )
+{
+	ULONG n = 0;
+	for (ULONG i = 0; i < high_water && n < max; i++)
+		if (atoms[i])
+			out[n++] = MAXINTATOM + i;
+	return n;
+}
+
+// "#123" names integer atom 123
+static bool is_integer_atom( const UNICODE_STRING& name, ULONG& value )
+{
+	ULONG n = name.Length/2;
+
+	if (n < 2 || name.Buffer[0] != '#')
+		return false;
+
+	value = 0;
+	for (ULONG i = 1; i < n; i++)
+	{
+		WCHAR ch = name.Buffer[i];
+		if (ch < '0' || ch > '9')
+			return false;
+		value = value * 10 + ch - '0';
+		if (value > 0xffff)
+			break;
+	}
+	return true;
+}
+
+static NTSTATUS integer_atom( ULONG value, USHORT& atom )
+{
+	if (value == 0 || value >= MAXINTATOM)
+		return STATUS_INVALID_PARAMETER;
+	atom = value;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS add_atom( const UNICODE_STRING& name, USHORT& atom )
+{
+	ULONG value;
+	if (is_integer_atom( name, value ))
+		return integer_atom( value, atom );
+	if (name.Length == 0)
+		return STATUS_OBJECT_NAME_INVALID;
+	if (name.Length/2 > max_atom_length)
+		return STATUS_INVALID_PARAMETER;
+	return global_atoms.add( name, atom );
+}
+
+NTSTATUS find_atom( const UNICODE_STRING& name, USHORT& atom )
+{
+	ULONG value;
+	if (is_integer_atom( name, value ))
+		return integer_atom( value, atom );
+	if (name.Length == 0)
+		return STATUS_OBJECT_NAME_INVALID;
+	if (name.Length/2 > max_atom_length)
+		return STATUS_INVALID_PARAMETER;
+	return global_atoms.find( name, atom );
+}
+
+NTSTATUS delete_atom( USHORT atom )
+{
+	if (atom == 0)
+		return STATUS_INVALID_HANDLE;
+	if (atom < MAXINTATOM)
+		return STATUS_SUCCESS;
+	return global_atoms.remove( atom );
+}
+
+// the atom table belongs to the window station,
+// so only processes connected to win32k may use it
+static NTSTATUS check_atom_access()
+{
+	if (!current->process->win32k_info)
+		return STATUS_ACCESS_DENIED;
+	return STATUS_SUCCESS;
+}
+
+// copy the name from user space, stopping at the first nul
+static NTSTATUS copy_atom_name( unicode_string_t& name, PWSTR String, ULONG StringLength )
+{
+	if (!String)
+		return STATUS_INVALID_PARAMETER;
+	if (StringLength > 0xfffe)
+		return STATUS_INVALID_PARAMETER;
+
+	NTSTATUS r = name.copy_wstr_from_user( String, StringLength & ~1 );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	for (ULONG i = 0; i < name.Length/2; i++)
+	{
+		if (!name.Buffer[i])
+		{
+			name.Length = i * 2;
+			break;
+		}
+	}
+	return STATUS_SUCCESS;
+}
 
 NTSTATUS NTAPI NtAddAtom(
 	PWSTR String,
 	ULONG StringLength,
 	PUSHORT Atom)
 {
+	unicode_string_t name;
+	USHORT atom = 0;
+	NTSTATUS r;
+
 	dprintf("%p %lu %p\n", String, StringLength, Atom);
-	return STATUS_NOT_IMPLEMENTED;
+
+	r = check_atom_access();
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	r = copy_atom_name( name, String, StringLength );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	dprintf("name = %pus\n", &name);
+
+	r = add_atom( name, atom );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	if (Atom)
+	{
+		r = copy_to_user( Atom, &atom, sizeof atom );
+		if (r < STATUS_SUCCESS)
+			delete_atom( atom );
+	}
+
+	return r;
 }
 
 NTSTATUS NTAPI NtFindAtom(
@@ -42,15 +364,143 @@ NTSTATUS NTAPI NtFindAtom(
 	ULONG StringLength,
 	PUSHORT Atom)
 {
+	unicode_string_t name;
+	USHORT atom = 0;
+	NTSTATUS r;
+
 	dprintf("%p %lu %p\n", String, StringLength, Atom);
-	return STATUS_NOT_IMPLEMENTED;
+
+	r = check_atom_access();
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	r = copy_atom_name( name, String, StringLength );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	r = find_atom( name, atom );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	if (Atom)
+		r = copy_to_user( Atom, &atom, sizeof atom );
+
+	return r;
 }
 
 NTSTATUS NTAPI NtDeleteAtom(
 	USHORT Atom)
 {
 	dprintf("%u\n", Atom);
-	return STATUS_NOT_IMPLEMENTED;
+
+	NTSTATUS r = check_atom_access();
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	return delete_atom( Atom );
+}
+
+static NTSTATUS query_atom_basic_information(
+	USHORT Atom,
+	PVOID AtomInformation,
+	ULONG AtomInformationLength,
+	ULONG& len )
+{
+	ATOM_BASIC_INFORMATION info;
+	const ULONG ofs = FIELD_OFFSET( ATOM_BASIC_INFORMATION, Name );
+	WCHAR intname[8];
+	UNICODE_STRING name;
+	NTSTATUS r;
+
+	if (AtomInformationLength < sizeof info)
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	memset( &info, 0, sizeof info );
+	if (Atom == 0)
+		return STATUS_INVALID_HANDLE;
+
+	if (Atom < MAXINTATOM)
+	{
+		char str[8];
+		int n = sprintf( str, "#%u", Atom );
+		for (int i = 0; i < n; i++)
+			intname[i] = str[i];
+		name.Buffer = intname;
+		name.Length = n * 2;
+		info.ReferenceCount = 1;
+		info.Pinned = 1;
+	}
+	else
+	{
+		atom_t *a = global_atoms.get( Atom );
+		if (!a)
+			return STATUS_INVALID_HANDLE;
+		name.Buffer = a->name.Buffer;
+		name.Length = a->name.Length;
+		info.ReferenceCount = a->refcount;
+		info.Pinned = a->pinned;
+	}
+
+	// truncate the name to fit, but return its full length if none fits
+	ULONG avail = AtomInformationLength - sizeof info;
+	if (avail < sizeof (WCHAR))
+	{
+		info.NameLength = name.Length;
+		r = copy_to_user( AtomInformation, &info, ofs );
+		if (r < STATUS_SUCCESS)
+			return r;
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	info.NameLength = name.Length;
+	if (info.NameLength > avail)
+		info.NameLength = avail & ~1;
+
+	r = copy_to_user( AtomInformation, &info, ofs );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	BYTE *user_name = (BYTE*) AtomInformation + ofs;
+	r = copy_to_user( user_name, name.Buffer, info.NameLength );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	WCHAR nul = 0;
+	r = copy_to_user( user_name + info.NameLength, &nul, sizeof nul );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	len = ofs + info.NameLength + sizeof nul;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS query_atom_table_information(
+	PVOID AtomInformation,
+	ULONG AtomInformationLength,
+	ULONG& len )
+{
+	const ULONG ofs = FIELD_OFFSET( ATOM_TABLE_INFORMATION, Atoms );
+	ULONG count = global_atoms.count();
+	NTSTATUS r;
+
+	if (AtomInformationLength < sizeof (ATOM_TABLE_INFORMATION))
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	len = ofs + count * sizeof (USHORT);
+	if (AtomInformationLength < len)
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	USHORT *atoms = new USHORT[count + 1];
+	if (!atoms)
+		return STATUS_NO_MEMORY;
+	count = global_atoms.list( atoms, count );
+
+	r = copy_to_user( AtomInformation, &count, sizeof count );
+	if (r == STATUS_SUCCESS)
+		r = copy_to_user( (BYTE*) AtomInformation + ofs, atoms, count * sizeof (USHORT) );
+	delete[] atoms;
+
+	return r;
 }
 
 NTSTATUS NTAPI NtQueryInformationAtom(
@@ -60,6 +510,30 @@ NTSTATUS NTAPI NtQueryInformationAtom(
 	ULONG AtomInformationLength,
 	PULONG ReturnLength)
 {
-	dprintf("%u\n", Atom);
-	return STATUS_NOT_IMPLEMENTED;
+	ULONG len = 0;
+	NTSTATUS r;
+
+	dprintf("%u %u %p %lu %p\n", Atom, AtomInformationClass,
+			AtomInformation, AtomInformationLength, ReturnLength);
+
+	r = check_atom_access();
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	switch (AtomInformationClass)
+	{
+	case AtomBasicInformation:
+		r = query_atom_basic_information( Atom, AtomInformation, AtomInformationLength, len );
+		break;
+	case AtomTableInformation:
+		r = query_atom_table_information( AtomInformation, AtomInformationLength, len );
+		break;
+	default:
+		return STATUS_INVALID_INFO_CLASS;
+	}
+
+	if (r == STATUS_SUCCESS && ReturnLength)
+		r = copy_to_user( ReturnLength, &len, sizeof len );
+
+	return r;
 }
@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -40,8 +41,7 @@
 #include "object.h"
 #include "mem.h"
 #include "ntcall.h"
-
-#define MAX_CORE_MEMORY 0x10000000
+#include "rbtree.h"
 
 static inline BOOLEAN mem_allocation_type_is_valid(ULONG state)
 {
@@ -77,29 +77,41 @@ static inline BOOLEAN mem_protection_is_valid(ULONG protect)
 
 class corepages : public mblock {
 public:
-	corepages( BYTE* address, size_t sz, backing_store_t* _backing );
+	enum page_kind {
+		fd_pages,		// part of a section
+		image_pages,	// part of a shared image, copied when written
+		core_pages,		// allocated from the core memory file
+	};
+	corepages( BYTE* address, size_t sz, backing_store_t* _backing, LONGLONG ofs, page_kind _kind );
 	//corepages( BYTE* address, size_t sz );
 	virtual int local_map( int prot );
 	virtual int remote_map( address_space *vm, ULONG prot );
 	virtual mblock *do_split( BYTE *address, size_t size );
+	virtual bool copy_on_write( address_space *vm );
+	virtual bool alloc_backing();
 	virtual ~corepages();
 private:
 	backing_store_t* backing;
-	int core_ofs;
+	LONGLONG core_ofs;	// -1 for core pages not yet committed
+	page_kind kind;
 };
 
-corepages::corepages( BYTE* address, size_t sz, backing_store_t* _backing ) :
+corepages::corepages( BYTE* address, size_t sz, backing_store_t* _backing, LONGLONG ofs, page_kind _kind ) :
 	mblock( address, sz ),
 	backing( _backing ),
-	core_ofs(0)
+	core_ofs( ofs ),
+	kind( _kind )
 {
 	backing->addref();
 }
 
 int corepages::local_map( int prot )
 {
+	assert( core_ofs >= 0 );
 	int fd = backing->get_fd();
-	kernel_address = (BYTE*) mmap( NULL, RegionSize, prot, MAP_SHARED, fd, core_ofs );
+	if (kind == image_pages)
+		prot &= ~PROT_WRITE;
+	kernel_address = (BYTE*) mmap64( NULL, RegionSize, prot, MAP_SHARED, fd, core_ofs );
 	if (kernel_address == (BYTE*) -1)
 		return -1;
 	return 0;
@@ -107,21 +119,37 @@ int corepages::local_map( int prot )
 
 int corepages::remote_map( address_space *vm, ULONG prot )
 {
+	// nothing to map until committed
+	if (core_ofs < 0)
+		return 0;
 	int fd = backing->get_fd();
 	int mmap_flags = mmap_flag_from_page_prot( prot );
+	if (kind == image_pages)
+		mmap_flags &= ~PROT_WRITE;
 	return vm->mmap( BaseAddress, RegionSize, mmap_flags, MAP_SHARED | MAP_FIXED, fd, core_ofs );
 }
 
 mblock *corepages::do_split( BYTE *address, size_t size )
 {
-	backing->addref();
-	corepages *rest = new corepages( address, size, backing );
-	rest->core_ofs = core_ofs + RegionSize - size;
-	return rest;
+	LONGLONG ofs = -1;
+	if (core_ofs >= 0)
+		ofs = core_ofs + RegionSize - size;
+	return new corepages( address, size, backing, ofs, kind );
+}
+
+// reserved memory only takes space in the core file once committed
+bool corepages::alloc_backing()
+{
+	if (kind != core_pages || core_ofs >= 0)
+		return true;
+	core_ofs = allocate_core_memory( RegionSize );
+	return core_ofs >= 0;
 }
 
 corepages::~corepages()
 {
+	if (kind == core_pages && core_ofs >= 0)
+		free_core_memory( core_ofs, RegionSize );
 	backing->release();
 }
 
@@ -168,14 +196,21 @@ mblock* alloc_guard_pages(BYTE* address, ULONG size)
 int create_mapping_fd( int sz )
 {
 	static int core_num = 0;
+	int fd = -1;
 
-	char name[0x40];
-	sprintf(name, "/tmp/win2k-%d", ++core_num);
-	int fd = open( name, O_CREAT | O_TRUNC | O_RDWR, 0600 );
+#ifdef __NR_memfd_create
+	fd = syscall( __NR_memfd_create, "win2k", 0 );
+#endif
 	if (fd < 0)
-		return -1;
+	{
+		char name[0x40];
+		sprintf(name, "/tmp/win2k-%d", ++core_num);
+		fd = open( name, O_CREAT | O_TRUNC | O_RDWR, 0600 );
+		if (fd < 0)
+			return -1;
 
-	unlink( name );
+		unlink( name );
+	}
 
 	int r = ftruncate( fd, sz );
 	if (r < 0)
@@ -186,34 +221,266 @@ int create_mapping_fd( int sz )
 	return fd;
 }
 
-class anonymous_pages_t: public backing_store_t
+class core_extent_t;
+
+// tracks the largest free extent in a subtree
+class core_extent_summary {
+public:
+	static void update( core_extent_t *x );
+};
+
+typedef rbtree<core_extent_t,0,core_extent_summary> core_extent_tree_t;
+
+class core_extent_t {
+public:
+	rbtree_element<core_extent_t> entry[1];
+	LONGLONG offset;
+	LONGLONG size;
+	LONGLONG max_size;
+	core_extent_t( LONGLONG ofs, ULONG sz ) : offset( ofs ), size( sz ), max_size( sz ) {}
+	LONGLONG end() { return offset + size; }
+};
+
+void core_extent_summary::update( core_extent_t *x )
 {
+	core_extent_t *left = x->entry[0].get_left();
+	core_extent_t *right = x->entry[0].get_right();
+
+	x->max_size = x->size;
+	if (left && left->max_size > x->max_size)
+		x->max_size = left->max_size;
+	if (right && right->max_size > x->max_size)
+		x->max_size = right->max_size;
+}
+
+// Committed memory comes from a single file that grows as needed.
+// Free extents of the file are kept in a tree ordered by offset,
+//  and are returned to the system by punching holes in the file.
+class core_arena_t: public backing_store_t
+{
+	static const ULONG grow_size = 0x1000000;
 	int fd;
-	int refcount;
+	LONGLONG arena_size;
+	core_extent_tree_t free_extents;
+protected:
+	core_extent_t *find_fit( ULONG size );
+	void find_neighbours( LONGLONG offset, core_extent_t *&prev, core_extent_t *&next );
+	void add_extent( LONGLONG offset, ULONG size );
+	bool grow( ULONG size );
+	void discard( LONGLONG offset, ULONG size );
 public:
-	anonymous_pages_t( int _fd ): fd(_fd), refcount(1) {}
+	core_arena_t(): fd(-1), arena_size(0) {}
 	virtual int get_fd() { return fd; }
-	virtual void addref() { refcount++; }
-	virtual void release() { if (!--refcount) delete this; }
+	virtual void addref() {}
+	virtual void release() {}
+	LONGLONG alloc( ULONG size );
+	void free( LONGLONG offset, ULONG size );
 };
 
-mblock* alloc_core_pages(BYTE* address, ULONG size)
+core_arena_t core_arena;
+
+// returns the lowest free extent that is big enough
+core_extent_t *core_arena_t::find_fit( ULONG size )
 {
-	int fd = create_mapping_fd( size );
-	if (fd < 0)
+	core_extent_t *x = free_extents.root();
+
+	if (!x || x->max_size < size)
 		return NULL;
-	backing_store_t* backing = new anonymous_pages_t( fd );
-	mblock *ret = new corepages( address, size, backing );
-	backing->release();
-	return ret;
+
+	while (1)
+	{
+		core_extent_t *left = x->entry[0].get_left();
+		if (left && left->max_size >= size)
+			x = left;
+		else if (x->size >= size)
+			return x;
+		else
+			x = x->entry[0].get_right();
+	}
+}
+
+void core_arena_t::find_neighbours( LONGLONG offset, core_extent_t *&prev, core_extent_t *&next )
+{
+	core_extent_t *x = free_extents.root();
+
+	prev = NULL;
+	next = NULL;
+	while (x)
+	{
+		if (offset < x->offset)
+		{
+			next = x;
+			x = x->entry[0].get_left();
+		}
+		else
+		{
+			prev = x;
+			x = x->entry[0].get_right();
+		}
+	}
+}
+
+// add a free extent, merging with its neighbours
+void core_arena_t::add_extent( LONGLONG offset, ULONG size )
+{
+	core_extent_t *prev, *next;
+
+	find_neighbours( offset, prev, next );
+	assert( !prev || prev->end() <= offset );
+	assert( !next || offset + size <= next->offset );
+
+	if (prev && prev->end() == offset)
+	{
+		prev->size += size;
+		if (next && prev->end() == next->offset)
+		{
+			prev->size += next->size;
+			free_extents.unlink( next );
+			delete next;
+		}
+		free_extents.update_path( prev );
+	}
+	else if (next && offset + size == next->offset)
+	{
+		next->offset = offset;
+		next->size += size;
+		free_extents.update_path( next );
+	}
+	else
+	{
+		core_extent_t *x = new core_extent_t( offset, size );
+		if (next && !next->entry[0].get_left())
+			free_extents.insert( next, false, x );
+		else if (prev)
+			free_extents.insert( prev, true, x );
+		else
+			free_extents.insert( next, false, x );
+	}
+}
+
+bool core_arena_t::grow( ULONG size )
+{
+	if (fd < 0)
+	{
+		fd = create_mapping_fd( 0 );
+		if (fd < 0)
+			return false;
+	}
+
+	LONGLONG new_size = (arena_size + size + grow_size - 1) & ~(LONGLONG)(grow_size - 1);
+	if (0 > ftruncate64( fd, new_size ))
+		return false;
+
+	add_extent( arena_size, new_size - arena_size );
+	arena_size = new_size;
+	return true;
+}
+
+// give the memory back to the system, making sure it reads as zero if reused
+void core_arena_t::discard( LONGLONG offset, ULONG size )
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (0 == fallocate64( fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size ))
+		return;
+#endif
+	void *p = mmap64( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset );
+	if (p == (void*) -1)
+		die("couldn't clear core memory %d\n", errno);
+	memset( p, 0, size );
+	munmap( p, size );
+}
+
+LONGLONG core_arena_t::alloc( ULONG size )
+{
+	assert( !(size & 0xfff) );
+
+	core_extent_t *x = find_fit( size );
+	if (!x)
+	{
+		if (!grow( size ))
+			return -1;
+		x = find_fit( size );
+		assert( x != NULL );
+	}
+
+	LONGLONG offset = x->offset;
+	x->offset += size;
+	x->size -= size;
+	if (x->size)
+		free_extents.update_path( x );
+	else
+	{
+		free_extents.unlink( x );
+		delete x;
+	}
+
+	return offset;
+}
+
+void core_arena_t::free( LONGLONG offset, ULONG size )
+{
+	assert( offset + size <= arena_size );
+	discard( offset, size );
+	add_extent( offset, size );
+}
+
+LONGLONG allocate_core_memory( ULONG size )
+{
+	return core_arena.alloc( size );
+}
+
+void free_core_memory( LONGLONG offset, ULONG size )
+{
+	core_arena.free( offset, size );
+}
+
+mblock* alloc_core_pages(BYTE* address, ULONG size)
+{
+	return new corepages( address, size, &core_arena, -1, corepages::core_pages );
 }
 
 mblock* alloc_fd_pages(BYTE* address, ULONG size, backing_store_t *backing )
 {
-	return new corepages( address, size, backing );
+	return new corepages( address, size, backing, 0, corepages::fd_pages );
+}
+
+mblock* alloc_image_pages(BYTE* address, ULONG size, backing_store_t *backing, ULONG offset )
+{
+	return new corepages( address, size, backing, offset, corepages::image_pages );
+}
+
+// give the block its own copy of the shared pages
+bool corepages::copy_on_write( address_space *vm )
+{
+	if (kind != image_pages || !is_committed())
+		return false;
+
+	LONGLONG ofs = allocate_core_memory( RegionSize );
+	if (ofs < 0)
+		return false;
+
+	if (RegionSize != (size_t) pwrite64( core_arena.get_fd(), kernel_address, RegionSize, ofs ))
+	{
+		free_core_memory( ofs, RegionSize );
+		return false;
+	}
+
+	backing->release();
+	backing = &core_arena;
+	core_ofs = ofs;
+	kind = core_pages;
+
+	local_unmap();
+	if (0 > local_map( PROT_READ | PROT_WRITE ))
+		die("couldn't map user memory into kernel %d\n", errno);
+	remote_remap( vm, tracer != 0 );
+
+	return true;
 }
 
 mblock::mblock( BYTE *address, size_t size ) :
+	free_below( 0 ),
+	max_free_below( 0 ),
 	BaseAddress( address ),
 	RegionSize( size ),
 	State( MEM_FREE ),
@@ -319,6 +586,16 @@ void mblock::set_prot( ULONG prot )
 	Protect = prot;
 }
 
+bool mblock::copy_on_write( address_space *vm )
+{
+	return false;
+}
+
+bool mblock::alloc_backing()
+{
+	return true;
+}
+
 void mblock::commit( address_space *vm )
 {
 	if (State != MEM_COMMIT)
@@ -338,7 +615,7 @@ void mblock::commit( address_space *vm )
 void mblock::remote_remap( address_space *vm, bool except )
 {
 	int r = remote_map( vm, except ? PAGE_NOACCESS : Protect );
-	if (0 < r )
+	if (r < 0)
 		die("remote_map failed\n");
 }
 
@@ -35,10 +35,13 @@
 #include "ntwin32.h"
 
 #include "cairo_display.h"
+#include "event_loop.h"
+#include "aio.h"
 
 #ifdef HAVE_CAIRO
 
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <X11/Xutil.h>
 #include <X11/Xlib.h>
 #include <cairo.h>
@@ -63,7 +66,7 @@ public:
   virtual void repaint( void );
 };
 
-class win32k_cairo_t : public win32k_manager_t, public sleeper_t
+class win32k_cairo_t : public win32k_manager_t, public sleeper_t, public fd_watcher_t
 {
 public:
   virtual BOOL init();
@@ -82,6 +85,7 @@ public:
 
 protected:
   virtual bool check_events( bool wait );
+  virtual void ready( ULONG events );
   virtual int getcaps( int index );
   void handle_events();
 
@@ -138,6 +142,8 @@ BOOL win32k_cairo_t::init()
   cairo_fill(c);
   cairo_destroy(c);
 
+  // wait for X events in the event loop, with timers and file I/O
+  event_loop_add_fd(ConnectionNumber(disp), EPOLLIN, this);
   sleeper = this;
 
   return TRUE;
@@ -147,6 +153,7 @@ void win32k_cairo_t::fini()
 {
   cairo_destroy(cr);
   cairo_surface_destroy(cs);
+  event_loop_remove_fd(ConnectionNumber(disp));
   XDestroyWindow(disp, win);
   XCloseDisplay(disp);
 }
@@ -222,17 +229,27 @@ bool win32k_cairo_t::check_events( bool wait )
     handle_events();
   }
 
-  if (!timers_left && !active_window && wait && fiber_t::last_fiber())
+  if (!timers_left && !async_io_pending() && !active_window && wait && fiber_t::last_fiber())
     return true;
 
   if (!wait)
     return false;
 
-  handle_events();
+  if (XPending(disp) == 0)
+    event_loop_sleep(timers_left ? &timeout : NULL);
+
+  while (XPending(disp) != 0) {
+    handle_events();
+  }
 
   return FALSE;
 }
 
+// the X connection is readable, events are read in check_events
+void win32k_cairo_t::ready( ULONG events )
+{
+}
+
 BOOL win32k_cairo_t::set_pixel( INT x, INT y, COLORREF color )
 {
   unsigned int *buf = (unsigned int *) cairo_image_surface_get_data(buffer);
@@ -74,9 +74,11 @@ static int sys_exit( int ret )
 	return r;
 }
 
-static void *sys_mmap( void *start, size_t len, int prot, int flags, int fd, off_t offset )
+/* mmap2 takes the offset in pages, so the core file can pass 4G */
+static void *sys_mmap2( void *start, size_t len, int prot, int flags, int fd, unsigned int pgofs )
 {
     void *r;
+    int dummy;
 
     struct
     {
@@ -85,7 +87,7 @@ static void *sys_mmap( void *start, size_t len, int prot, int flags, int fd, off
         unsigned int prot;
         unsigned int flags;
         unsigned int fd;
-        unsigned int offset;
+        unsigned int pgofs;
     } args;
 
     args.addr   = start;
@@ -93,9 +95,16 @@ static void *sys_mmap( void *start, size_t len, int prot, int flags, int fd, off
     args.prot   = prot;
     args.flags  = flags;
     args.fd     = fd;
-    args.offset = offset;
-    __asm__ __volatile__( "pushl %%ebx; movl %2,%%ebx; int $0x80; popl %%ebx"
-                          : "=a" (r) : "0" (SYS_mmap), "q" (&args) : "memory" );
+    args.pgofs  = pgofs;
+
+    /* six arguments, so %ebp is used too */
+    __asm__ __volatile__( "pushl %%ebp; pushl %%ebx\n\t"
+                          "movl 0(%%ecx), %%ebx; movl 8(%%ecx), %%edx\n\t"
+                          "movl 12(%%ecx), %%esi; movl 16(%%ecx), %%edi\n\t"
+                          "movl 20(%%ecx), %%ebp; movl 4(%%ecx), %%ecx\n\t"
+                          "int $0x80; popl %%ebx; popl %%ebp"
+                          : "=a" (r), "=c" (dummy) : "0" (SYS_mmap2), "1" (&args)
+                          : "edx", "esi", "edi", "memory" );
     return r;
 }
 
@@ -292,7 +301,7 @@ static int do_mmap( struct tt_req_map *req )
 		dprintf("sys_open failed\n");
 		return fd;
 	}
-	p = sys_mmap( (void*) req->addr, req->len, req->prot, MAP_SHARED | MAP_FIXED, fd, req->ofs );
+	p = sys_mmap2( (void*) req->addr, req->len, req->prot, MAP_SHARED | MAP_FIXED, fd, req->pgofs );
 	r = (p == (void*) req->addr) ? 0 : -1;
 	sys_close( fd );
 	return r;
@@ -308,9 +317,41 @@ static int do_prot( struct tt_req_prot *req )
 	return sys_mprotect( (void*) req->addr, req->len, req->prot );
 }
 
+static int do_req( struct tt_req *req )
+{
+	switch (req->type)
+	{
+	case tt_req_map:
+		return do_mmap( &req->u.map );
+	case tt_req_umap:
+		return do_umap( &req->u.umap );
+	case tt_req_prot:
+		return do_prot( &req->u.prot );
+	default:
+		dprintf("protocol error\n");
+		sys_exit(1);
+	}
+	return -1;
+}
+
+static int do_batch( struct tt_mailbox *mailbox )
+{
+	unsigned int i;
+	int failed = 0;
+
+	for (i=0; i<mailbox->count; i++)
+	{
+		mailbox->r[i] = do_req( &mailbox->batch[i] );
+		if (mailbox->r[i] < 0)
+			failed++;
+	}
+	return failed;
+}
+
 void client_main( void )
 {
-	struct tt_req req;
+	struct tt_mailbox *mailbox = (struct tt_mailbox*) TT_MAILBOX_ADDRESS;
+	struct tt_req stack_req, *req = &stack_req;
 	int r = 0, finished = 0;
 
 	init_fs();
@@ -321,18 +362,23 @@ void client_main( void )
 		// the trace client will trap and fill req
 		__asm__ __volatile__(
                           "int $3\n\t"
-                          : : "a"(r), "b"(&req) : "memory" );
+                          : : "a"(r), "b"(req) : "memory" );
 
-		switch (req.type)
+		switch (req->type)
 		{
 		case tt_req_map:
-			r = do_mmap( &req.u.map );
-			break;
 		case tt_req_umap:
-			r = do_umap( &req.u.umap );
-			break;
 		case tt_req_prot:
-			r = do_prot( &req.u.prot );
+			r = do_req( req );
+			break;
+		case tt_req_mailbox:
+			// take further requests from the shared mailbox
+			r = do_mmap( &req->u.map );
+			if (r == 0)
+				req = &mailbox->req;
+			break;
+		case tt_req_batch:
+			r = do_batch( mailbox );
 			break;
 		case tt_req_exit:
 			r = 0;
@@ -343,7 +389,7 @@ void client_main( void )
 		}
 
 		// exit on the next iteration if something goes wrong
-		req.type = tt_req_exit;
+		req->type = tt_req_exit;
 	}
 
 	dprintf("exit!\n");
@@ -26,6 +26,8 @@ enum tt_req_type {
 	tt_req_map,
 	tt_req_umap,
 	tt_req_prot,
+	tt_req_mailbox,
+	tt_req_batch,
 };
 
 struct tt_req_map {
@@ -33,7 +35,7 @@ struct tt_req_map {
 	unsigned int fd;
 	unsigned int addr;
 	unsigned int len;
-	unsigned int ofs;
+	unsigned int pgofs;	// offset in pages
 	unsigned int prot;
 };
 
@@ -61,5 +63,22 @@ struct tt_reply {
 	int r;
 };
 
+// Once the stub has mapped the mailbox (tt_req_mailbox, using the
+// fields of tt_req_map), requests are read from the mailbox rather
+// than poked into the stub's stack one word at a time.
+// tt_req_batch applies count requests from batch[] in one round trip,
+// leaving each result in r[] and returning the number that failed.
+
+#define TT_MAILBOX_ADDRESS 0xa0800000
+#define TT_MAILBOX_SIZE 0x1000
+#define TT_BATCH_MAX 100
+
+struct tt_mailbox {
+	struct tt_req req;
+	unsigned int count;
+	struct tt_req batch[TT_BATCH_MAX];
+	int r[TT_BATCH_MAX];
+};
+
 #endif // __NTNATIVE_CLIENT_H__
 
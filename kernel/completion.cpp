@@ -32,16 +32,21 @@
 #include "file.h"
 #include "debug.h"
 #include "object.inl"
+#include "slab.h"
 
 // completion_packet_t holds the data for one I/O completion
 class completion_packet_t;
 
+static slab_t completion_packet_slab( "completion_packet_t" );
+
 typedef list_anchor<completion_packet_t,0> completion_list_t;
 typedef list_element<completion_packet_t> completion_list_element_t;
 
 class completion_packet_t
 {
 public:
+	void *operator new(size_t sz) { return completion_packet_slab.alloc( sz ); }
+	void operator delete(void *ptr) { completion_packet_slab.free( ptr ); }
 	completion_list_element_t entry[1];
 	ULONG key;
 	ULONG value;
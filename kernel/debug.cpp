@@ -34,6 +34,7 @@
 #include "ntcall.h"
 #include "thread.h"
 #include "debug.h"
+#include "trace_ring.h"
 
 #include "types.h"
 #include "extern.h"
@@ -68,12 +69,76 @@ int sprint_unicode_string( char *output, int len, UNICODE_STRING *us )
 	return n;
 }
 
+// record the format and the first two arguments, and let tracedump format them
+// %ll arguments are fetched whole, so the next argument is right, but
+// only their low 32 bits are kept.  Strings are copied to the string table.
+static void trace_ring_printf( const char *func, int line, const char *fmt, va_list va )
+{
+	char str[TRACE_RING_ARG_STRING + 1];
+	ULONG arg[2] = {0, 0};
+	int n = 0;
+
+	for (const char *p = fmt; *p && n < 2; p++)
+	{
+		if (*p != '%')
+			continue;
+		if (p[1] == '%')
+		{
+			p++;
+			continue;
+		}
+
+		// skip flags and width, as debugprintf does
+		p++;
+		if (*p == '-')
+			p++;
+		while (*p >= '0' && *p <= '9')
+			p++;
+		int longs = 0;
+		while (*p == 'l')
+		{
+			p++;
+			longs++;
+		}
+		if (!*p)
+			break;
+
+		if (*p == 's')
+			arg[n++] = trace_ring_copy_string( va_arg( va, char* ) );
+		else if (*p == 'S' || (p[0] == 'p' && p[1] == 'w' && p[2] == 's'))
+		{
+			sprint_wide_string( str, sizeof str - 1, va_arg( va, unsigned short* ) );
+			arg[n++] = trace_ring_copy_string( str );
+		}
+		else if (p[0] == 'p' && p[1] == 'u' && p[2] == 's')
+		{
+			sprint_unicode_string( str, sizeof str - 1, va_arg( va, UNICODE_STRING* ) );
+			arg[n++] = trace_ring_copy_string( str );
+		}
+		else if (longs >= 2)
+			arg[n++] = (ULONG) va_arg( va, long long );
+		else
+			arg[n++] = va_arg( va, ULONG );
+	}
+
+	trace_ring_event( trace_printf_event, current ? current->trace_id() : 0,
+		trace_ring_string( fmt ), trace_ring_string( func ), line, arg[0], arg[1] );
+}
+
 void debugprintf(const char *file, const char *func, int line, const char *fmt, ...)
 {
 	char buffer[0x100], fstr[16], *p;
 	int sz, n, i, is_longlong;
 	va_list va;
 
+	if (trace_ring_enabled)
+	{
+		va_start( va, fmt );
+		trace_ring_printf( func, line, fmt, va );
+		va_end( va );
+		return;
+	}
+
 	if (!option_trace)
 		return;
 
@@ -0,0 +1,173 @@
+/*
+ * event loop
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+
+#include "debug.h"
+#include "event_loop.h"
+
+// run_fd waits for children and the time slice, sleep_fd for everything else
+static int run_fd = -1;
+static int sleep_fd = -1;
+static int sigchld_fd = -1;
+static int slice_fd = -1;
+static int timeout_fd = -1;
+
+static void epoll_add( int epfd, int fd, ULONG events, void *ptr )
+{
+	struct epoll_event ev;
+
+	memset( &ev, 0, sizeof ev );
+	ev.events = events;
+	ev.data.ptr = ptr;
+	if (0 > epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev ))
+		die("epoll_ctl failed (%d)\n", errno);
+}
+
+static void set_timer( int fd, LONGLONG length )
+{
+	struct itimerspec its;
+
+	memset( &its, 0, sizeof its );
+	if (length > 0)
+	{
+		its.it_value.tv_sec = length / 10000000LL;
+		its.it_value.tv_nsec = (length % 10000000LL) * 100;
+	}
+	else if (length == 0)
+	{
+		// a zero it_value disarms the timer, so expire immediately
+		its.it_value.tv_nsec = 1;
+	}
+	// negative length disarms
+	if (0 > timerfd_settime( fd, 0, &its, NULL ))
+		die("timerfd_settime failed (%d)\n", errno);
+}
+
+// read and discard whatever is pending on a timerfd or signalfd
+static void drain( int fd )
+{
+	char buffer[sizeof (struct signalfd_siginfo) * 4];
+	while (read( fd, buffer, sizeof buffer ) > 0)
+		;
+}
+
+void init_event_loop()
+{
+	sigset_t sigset;
+
+	// SIGCHLD is only seen through the signalfd
+	sigemptyset( &sigset );
+	sigaddset( &sigset, SIGCHLD );
+	if (0 > sigprocmask( SIG_BLOCK, &sigset, NULL ))
+		die("unable to block SIGCHLD\n");
+
+	sigchld_fd = signalfd( -1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC );
+	slice_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	timeout_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+	run_fd = epoll_create( 2 );
+	sleep_fd = epoll_create( 8 );
+	if (sigchld_fd < 0 || slice_fd < 0 || timeout_fd < 0 || run_fd < 0 || sleep_fd < 0)
+		die("couldn't create event loop (%d)\n", errno);
+
+	epoll_add( run_fd, sigchld_fd, EPOLLIN, &sigchld_fd );
+	epoll_add( run_fd, slice_fd, EPOLLIN, &slice_fd );
+	epoll_add( sleep_fd, timeout_fd, EPOLLIN, &timeout_fd );
+}
+
+void event_loop_add_fd( int fd, ULONG events, fd_watcher_t *watcher )
+{
+	epoll_add( sleep_fd, fd, events, watcher );
+}
+
+void event_loop_remove_fd( int fd )
+{
+	struct epoll_event ev;
+	epoll_ctl( sleep_fd, EPOLL_CTL_DEL, fd, &ev );
+}
+
+void event_loop_sleep( LARGE_INTEGER *timeout )
+{
+	const int max_events = 8;
+	struct epoll_event ev[max_events];
+
+	set_timer( timeout_fd, timeout ? timeout->QuadPart : -1LL );
+
+	int n = epoll_wait( sleep_fd, ev, max_events, -1 );
+	if (n < 0 && errno != EINTR)
+		die("epoll_wait failed (%d)\n", errno);
+
+	for (int i=0; i<n; i++)
+	{
+		if (ev[i].data.ptr == &timeout_fd)
+		{
+			drain( timeout_fd );
+			continue;
+		}
+		fd_watcher_t *watcher = (fd_watcher_t*) ev[i].data.ptr;
+		watcher->ready( ev[i].events );
+	}
+}
+
+void event_loop_start_slice( LONGLONG length )
+{
+	drain( slice_fd );
+	set_timer( slice_fd, length );
+}
+
+void event_loop_end_slice()
+{
+	set_timer( slice_fd, -1LL );
+}
+
+bool event_loop_wait_child()
+{
+	struct epoll_event ev[2];
+	bool slice_ended = false;
+
+	int n = epoll_wait( run_fd, ev, 2, -1 );
+	if (n < 0 && errno != EINTR)
+		die("epoll_wait failed (%d)\n", errno);
+
+	for (int i=0; i<n; i++)
+	{
+		if (ev[i].data.ptr == &slice_fd)
+		{
+			drain( slice_fd );
+			slice_ended = true;
+		}
+		else
+			drain( sigchld_fd );
+	}
+	return slice_ended;
+}
@@ -0,0 +1,53 @@
+/*
+ * event loop
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __RING3K_EVENT_LOOP_H__
+#define __RING3K_EVENT_LOOP_H__
+
+// All waiting in the kernel goes through one epoll set.
+// Timeouts and time slices are timerfds, and traced children stopping
+// are seen through a signalfd for SIGCHLD, so nothing relies on
+// signal handlers interrupting a system call.
+
+class fd_watcher_t
+{
+public:
+	// called from the scheduler's sleep when fd is ready
+	virtual void ready( ULONG events ) = 0;
+	virtual ~fd_watcher_t() {}
+};
+
+void init_event_loop();
+void event_loop_add_fd( int fd, ULONG events, fd_watcher_t *watcher );
+void event_loop_remove_fd( int fd );
+
+// sleep until a watched fd is ready or the timeout (relative, in 100ns units) passes
+// with no timeout, sleep until an fd is ready
+void event_loop_sleep( LARGE_INTEGER *timeout );
+
+// time slices for traced children, in 100ns units
+void event_loop_start_slice( LONGLONG length );
+void event_loop_end_slice();
+
+// wait for a child to change state or the time slice to end
+// returns true if the time slice ended
+bool event_loop_wait_child();
+
+#endif // __RING3K_EVENT_LOOP_H__
@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
 #include <linux/types.h>
@@ -47,6 +48,8 @@
 #include "ntcall.h"
 #include "file.h"
 #include "symlink.h"
+#include "event.h"
+#include "aio.h"
 
 // FIXME: use unicode tables
 WCHAR lowercase(const WCHAR ch)
@@ -62,6 +65,12 @@ io_object_t::io_object_t() :
 {
 }
 
+io_object_t::~io_object_t()
+{
+	if (completion_port)
+		release( completion_port );
+}
+
 void io_object_t::set_completion_port( completion_port_t *port, ULONG key )
 {
 	if (completion_port)
@@ -69,8 +78,10 @@ void io_object_t::set_completion_port( completion_port_t *port, ULONG key )
 		release( completion_port );
 		completion_port = 0;
 	}
+	if (port)
+		addref( port );
 	completion_port = port;
-	completion_key = 0;
+	completion_key = key;
 }
 
 NTSTATUS io_object_t::set_position( LARGE_INTEGER& ofs )
@@ -95,7 +106,9 @@ file_t::~file_t()
 }
 
 file_t::file_t( int f ) :
-	fd( f )
+	fd( f ),
+	overlapped( false ),
+	position( 0 )
 {
 }
 
@@ -127,72 +140,92 @@ NTSTATUS file_create_info_t::on_open( object_dir_t* dir, object_t*& obj, open_in
 	return STATUS_SUCCESS;
 }
 
-NTSTATUS file_t::read( PVOID Buffer, ULONG Length, ULONG *bytes_read )
+// Read or write at offset, straight between the file and guest memory.
+// The buffer is split into the pieces that are contiguous in the kernel's
+// view of the address space, and transferred with one preadv/pwritev.
+NTSTATUS file_t::transfer( bool is_write, PVOID Buffer, ULONG Length, LONGLONG offset, ULONG *transferred )
 {
+	const int max_iov = 64;
+	struct iovec iov[max_iov];
 	NTSTATUS r = STATUS_SUCCESS;
-	ULONG ofs = 0;
-	while (ofs < Length)
+	ULONG done = 0;
+
+	while (done < Length && r == STATUS_SUCCESS)
 	{
-		BYTE *p = (BYTE*)Buffer+ofs;
-		size_t len = Length - ofs;
+		ULONG mapped = 0;
+		int n = 0;
 
-		r = current->process->vm->get_kernel_address( &p, &len );
-		if (r < STATUS_SUCCESS)
+		while (n < max_iov && done + mapped < Length)
+		{
+			BYTE *p = (BYTE*)Buffer + done + mapped;
+			size_t len = Length - done - mapped;
+
+			if (!is_write)
+				current->process->vm->copy_on_write( p );
+			r = current->process->vm->get_kernel_address( &p, &len );
+			if (r < STATUS_SUCCESS)
+				break;
+
+			iov[n].iov_base = p;
+			iov[n].iov_len = len;
+			mapped += len;
+			n++;
+		}
+
+		if (!n)
 			break;
 
-		int ret = ::read( fd, p, len );
+		int ret;
+		do {
+			if (is_write)
+				ret = ::pwritev64( fd, iov, n, offset + done );
+			else
+				ret = ::preadv64( fd, iov, n, offset + done );
+		} while (ret < 0 && errno == EINTR);
+
 		if (ret < 0)
 		{
 			r = STATUS_IO_DEVICE_ERROR;
 			break;
 		}
 
-		ofs += len;
+		done += ret;
+
+		// end of file, or a full disk
+		if ((ULONG) ret < mapped)
+			break;
 	}
 
-	*bytes_read = ofs;
+	*transferred = done;
 
 	return r;
 }
 
-NTSTATUS file_t::write( PVOID Buffer, ULONG Length, ULONG *written )
+NTSTATUS file_t::read( PVOID Buffer, ULONG Length, ULONG *bytes_read )
 {
-	NTSTATUS r = STATUS_SUCCESS;
-	ULONG ofs = 0;
-	while (ofs< Length)
-	{
-		BYTE *p = (BYTE*)Buffer+ofs;
-		size_t len = Length - ofs;
-
-		NTSTATUS r = current->process->vm->get_kernel_address( &p, &len );
-		if (r < STATUS_SUCCESS)
-			break;
-
-		int ret = ::write( fd, p, len );
-		if (ret < 0)
-		{
-			r = STATUS_IO_DEVICE_ERROR;
-			break;
-		}
-
-		ofs += len;
-	}
-
-	*written = ofs;
+	NTSTATUS r = transfer( false, Buffer, Length, position, bytes_read );
+	position += *bytes_read;
+	return r;
+}
 
+NTSTATUS file_t::write( PVOID Buffer, ULONG Length, ULONG *written )
+{
+	NTSTATUS r = transfer( true, Buffer, Length, position, written );
+	position += *written;
 	return r;
 }
 
 NTSTATUS file_t::set_position( LARGE_INTEGER& ofs )
 {
-	int ret;
+	if (ofs.QuadPart < 0)
+		return STATUS_INVALID_PARAMETER;
+	position = ofs.QuadPart;
+	return STATUS_SUCCESS;
+}
 
-	ret = lseek( fd, ofs.QuadPart, SEEK_SET );
-	if (ret < 0)
-	{
-		dprintf("seek failed\n");
-		return STATUS_UNSUCCESSFUL;
-	}
+NTSTATUS file_t::query_information( FILE_POSITION_INFORMATION& info )
+{
+	info.CurrentByteOffset.QuadPart = position;
 	return STATUS_SUCCESS;
 }
 
@@ -752,6 +785,7 @@ NTSTATUS directory_t::open_file(
 			::close( file_fd );
 			return STATUS_NO_MEMORY;
 		}
+		file->set_overlapped( !(Options & (FILE_SYNCHRONOUS_IO_ALERT | FILE_SYNCHRONOUS_IO_NONALERT)) );
 	}
 
 	return STATUS_SUCCESS;
@@ -953,6 +987,203 @@ NTSTATUS NTAPI NtDeviceIoControlFile(
 	return STATUS_SUCCESS;
 }
 
+// an overlapped read or write, completed on the kernel thread
+class file_io_request_t : public aio_request_t
+{
+	file_t *file;
+	thread_t *thread;
+	event_t *event;
+	PIO_APC_ROUTINE ApcRoutine;
+	PVOID ApcContext;
+	PIO_STATUS_BLOCK IoStatusBlock;
+	PVOID Buffer;
+public:
+	file_io_request_t( file_t *_file, bool _is_write, event_t *_event,
+		PIO_APC_ROUTINE _ApcRoutine, PVOID _ApcContext, PIO_STATUS_BLOCK _IoStatusBlock,
+		PVOID _Buffer, ULONG _Length, LONGLONG _offset );
+	virtual ~file_io_request_t();
+	NTSTATUS capture( PVOID Buffer );
+	virtual void complete();
+};
+
+file_io_request_t::file_io_request_t( file_t *_file, bool _is_write, event_t *_event,
+	PIO_APC_ROUTINE _ApcRoutine, PVOID _ApcContext, PIO_STATUS_BLOCK _IoStatusBlock,
+	PVOID _Buffer, ULONG _Length, LONGLONG _offset ) :
+	aio_request_t( _file->get_fd(), _is_write, _Length, _offset ),
+	file( _file ),
+	thread( current ),
+	event( _event ),
+	ApcRoutine( _ApcRoutine ),
+	ApcContext( _ApcContext ),
+	IoStatusBlock( _IoStatusBlock ),
+	Buffer( _Buffer )
+{
+	// keep the fd open and the thread around until the I/O is complete
+	addref( file );
+	addref( thread );
+	if (event)
+		addref( event );
+}
+
+file_io_request_t::~file_io_request_t()
+{
+	if (event)
+		release( event );
+	release( thread );
+	release( file );
+}
+
+NTSTATUS file_io_request_t::capture( PVOID Buffer )
+{
+	return copy_from_user( buffer, Buffer, length );
+}
+
+void file_io_request_t::complete()
+{
+	IO_STATUS_BLOCK iosb;
+
+	iosb.Information = 0;
+	if (result < 0)
+		iosb.Status = STATUS_IO_DEVICE_ERROR;
+	else if (!is_write && result == 0 && length)
+		iosb.Status = STATUS_END_OF_FILE;
+	else
+	{
+		iosb.Status = STATUS_SUCCESS;
+		iosb.Information = result;
+	}
+
+	// a thread that has gone away gets no results or APC
+	if (!thread->is_terminated())
+	{
+		if (!is_write && iosb.Information)
+		{
+			NTSTATUS r = thread->copy_to_user( Buffer, buffer, iosb.Information );
+			if (r < STATUS_SUCCESS)
+			{
+				iosb.Status = r;
+				iosb.Information = 0;
+			}
+		}
+		thread->copy_to_user( IoStatusBlock, &iosb, sizeof iosb );
+		if (ApcRoutine)
+			thread->queue_apc_thread( (PKNORMAL_ROUTINE) ApcRoutine, ApcContext, IoStatusBlock, 0 );
+	}
+
+	if (event)
+		event->set( 0 );
+
+	completion_port_t *port = file->get_completion_port();
+	if (port && !ApcRoutine)
+		port->set( file->get_completion_key(), (ULONG) ApcContext, iosb.Status, iosb.Information );
+}
+
+// An explicit byte offset on a synchronous read or write moves the file
+// position first.  FILE_USE_FILE_POINTER_POSITION keeps the current
+// position, and FILE_WRITE_TO_END_OF_FILE appends.
+static NTSTATUS seek_to_byte_offset( io_object_t *io, PLARGE_INTEGER ByteOffset, bool is_write )
+{
+	LARGE_INTEGER ofs;
+	NTSTATUS r;
+
+	file_t *file = dynamic_cast<file_t*>( io );
+	if (!file || !ByteOffset)
+		return STATUS_SUCCESS;
+
+	r = copy_from_user( &ofs, ByteOffset, sizeof ofs );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	if (ofs.HighPart == -1 && ofs.LowPart == FILE_USE_FILE_POINTER_POSITION)
+		return STATUS_SUCCESS;
+
+	if (is_write && ofs.HighPart == -1 && ofs.LowPart == FILE_WRITE_TO_END_OF_FILE)
+	{
+		FILE_STANDARD_INFORMATION info;
+		r = file->query_information( info );
+		if (r < STATUS_SUCCESS)
+			return r;
+		ofs = info.EndOfFile;
+	}
+
+	return file->set_position( ofs );
+}
+
+// Start an overlapped read or write.
+// Only asynchronous handles with an explicit offset, something to
+// complete to and at most aio_max_length bytes go through here.  Anything
+// else returns STATUS_NOT_SUPPORTED and is done synchronously, as before.
+static NTSTATUS start_overlapped_io(
+	io_object_t *io,
+	bool is_write,
+	HANDLE EventHandle,
+	PIO_APC_ROUTINE ApcRoutine,
+	PVOID ApcContext,
+	PIO_STATUS_BLOCK IoStatusBlock,
+	PVOID Buffer,
+	ULONG Length,
+	PLARGE_INTEGER ByteOffset )
+{
+	LARGE_INTEGER offset;
+	event_t *event = 0;
+	NTSTATUS r;
+
+	file_t *file = dynamic_cast<file_t*>( io );
+	if (!file || !file->is_overlapped() || !ByteOffset)
+		return STATUS_NOT_SUPPORTED;
+	if (!EventHandle && !ApcRoutine && !file->get_completion_port())
+		return STATUS_NOT_SUPPORTED;
+	if (Length > aio_max_length)
+		return STATUS_NOT_SUPPORTED;
+
+	// check where the data will go before buffering anything
+	if (!is_write)
+	{
+		r = verify_for_write( Buffer, Length );
+		if (r < STATUS_SUCCESS)
+			return r;
+	}
+
+	r = copy_from_user( &offset, ByteOffset, sizeof offset );
+	if (r < STATUS_SUCCESS)
+		return r;
+	// special offsets use the file position
+	if (offset.QuadPart < 0)
+		return STATUS_NOT_SUPPORTED;
+
+	if (EventHandle)
+	{
+		r = object_from_handle( event, EventHandle, EVENT_MODIFY_STATE );
+		if (r < STATUS_SUCCESS)
+			return r;
+	}
+
+	file_io_request_t *req = new file_io_request_t( file, is_write, event,
+		ApcRoutine, ApcContext, IoStatusBlock, Buffer, Length, offset.QuadPart );
+	if (!req->valid())
+	{
+		delete req;
+		return STATUS_NO_MEMORY;
+	}
+
+	// the data to write is captured now, the caller may reuse the buffer
+	if (is_write)
+	{
+		r = req->capture( Buffer );
+		if (r < STATUS_SUCCESS)
+		{
+			delete req;
+			return r;
+		}
+	}
+
+	if (event)
+		event->reset( 0 );
+
+	aio_submit( req );
+	return STATUS_PENDING;
+}
+
 NTSTATUS NTAPI NtWriteFile(
 	HANDLE FileHandle,
 	HANDLE Event,
@@ -979,6 +1210,15 @@ NTSTATUS NTAPI NtWriteFile(
 	if (r < STATUS_SUCCESS)
 		return r;
 
+	r = start_overlapped_io( io, true, Event, ApcRoutine, ApcContext,
+			IoStatusBlock, Buffer, Length, ByteOffset );
+	if (r != STATUS_NOT_SUPPORTED)
+		return r;
+
+	r = seek_to_byte_offset( io, ByteOffset, true );
+	if (r < STATUS_SUCCESS)
+		return r;
+
 	ULONG ofs = 0;
 	r = io->write( Buffer, Length, &ofs );
 	if (r < STATUS_SUCCESS)
@@ -1074,18 +1314,29 @@ NTSTATUS NTAPI NtReadFile(
 	if (r < STATUS_SUCCESS)
 		return r;
 
+	r = start_overlapped_io( io, false, EventHandle, ApcRoutine, ApcContext,
+			IoStatusBlock, Buffer, Length, ByteOffset );
+	if (r != STATUS_NOT_SUPPORTED)
+		return r;
+
+	r = seek_to_byte_offset( io, ByteOffset, false );
+	if (r < STATUS_SUCCESS)
+		return r;
+
 	ULONG ofs = 0;
 	r = io->read( Buffer, Length, &ofs );
-	if (r < STATUS_SUCCESS)
+
+	// a partial message read still reports how much was read
+	if (r < STATUS_SUCCESS && r != STATUS_BUFFER_OVERFLOW)
 		return r;
 
 	IO_STATUS_BLOCK iosb;
 	iosb.Status = r;
 	iosb.Information = ofs;
 
-	r = copy_to_user( IoStatusBlock, &iosb, sizeof iosb );
+	copy_to_user( IoStatusBlock, &iosb, sizeof iosb );
 
-	return STATUS_SUCCESS;
+	return iosb.Status;
 }
 
 NTSTATUS NTAPI NtDeleteFile(
@@ -1231,6 +1482,7 @@ NTSTATUS NTAPI NtQueryInformationFile(
 		FILE_BASIC_INFORMATION basic_info;
 		FILE_STANDARD_INFORMATION std_info;
 		FILE_ATTRIBUTE_TAG_INFORMATION attrib_info;
+		FILE_POSITION_INFORMATION position_info;
 	} info;
 	ULONG len;
 	memset( &info, 0, sizeof info );
@@ -1249,6 +1501,10 @@ NTSTATUS NTAPI NtQueryInformationFile(
 		len = sizeof info.attrib_info;
 		r = file->query_information( info.attrib_info );
 		break;
+	case FilePositionInformation:
+		len = sizeof info.position_info;
+		r = file->query_information( info.position_info );
+		break;
 	default:
 		dprintf("Unknown information class %d\n", FileInformationClass );
 		r = STATUS_INVALID_PARAMETER;
@@ -46,9 +46,12 @@ class io_object_t : virtual public object_t {
 	ULONG completion_key;
 public:
 	io_object_t();
+	virtual ~io_object_t();
 	virtual NTSTATUS read( PVOID buffer, ULONG length, ULONG *read ) = 0;
 	virtual NTSTATUS write( PVOID buffer, ULONG length, ULONG *written ) = 0;
 	void set_completion_port( completion_port_t *port, ULONG key );
+	completion_port_t *get_completion_port() { return completion_port; }
+	ULONG get_completion_key() { return completion_key; }
 	virtual NTSTATUS set_position( LARGE_INTEGER& ofs );
 	virtual NTSTATUS fs_control( event_t* event, IO_STATUS_BLOCK iosb, ULONG FsControlCode,
 		 PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength );
@@ -57,6 +60,10 @@ public:
 
 class file_t : public io_object_t {
 	int fd;
+	bool overlapped;	// opened without FILE_SYNCHRONOUS_IO_*
+	LONGLONG position;	// NT current byte offset, the fd's offset isn't used
+protected:
+	NTSTATUS transfer( bool is_write, PVOID Buffer, ULONG Length, LONGLONG offset, ULONG *transferred );
 public:
 	file_t( int fd );
 	~file_t();
@@ -65,9 +72,12 @@ public:
 	virtual NTSTATUS write( PVOID Buffer, ULONG Length, ULONG *written );
 	virtual NTSTATUS query_information( FILE_BASIC_INFORMATION& info );
 	virtual NTSTATUS query_information( FILE_ATTRIBUTE_TAG_INFORMATION& info );
+	virtual NTSTATUS query_information( FILE_POSITION_INFORMATION& info );
 	virtual NTSTATUS set_position( LARGE_INTEGER& ofs );
 	virtual NTSTATUS remove();
 	int get_fd();
+	void set_overlapped( bool ov ) { overlapped = ov; }
+	bool is_overlapped() { return overlapped; }
 };
 
 NTSTATUS open_file( file_t *&file, UNICODE_STRING& us );
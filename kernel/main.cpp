@@ -28,7 +28,6 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/time.h>
-#include <poll.h>
 #include <signal.h>
 #include <execinfo.h>
 #include <getopt.h>
@@ -48,15 +47,20 @@
 #include "unicode.h"
 #include "fiber.h"
 #include "file.h"
+#include "event_loop.h"
+#include "aio.h"
 #include "event.h"
 #include "symlink.h"
 #include "alloc_bitmap.h"
+#include "trace_ring.h"
+#include "syscall_log.h"
 
 process_list_t processes;
 thread_t *current;
 object_t *ntdll_section;
 int option_debug = 0;
 ULONG KiIntSystemCall = 0;
+bool use_sysemu = false;
 bool forced_quit;
 
 class default_sleeper_t : public sleeper_t
@@ -84,18 +88,13 @@ bool default_sleeper_t::check_events( bool wait )
 
 	// Check for a deadlock and quit.
 	//  This happens if we're the only active thread,
-	//  there's no more timers, and we're asked to wait.
-	if (!timers_left && wait && fiber_t::last_fiber())
+	//  there's no more timers or I/O, and we're asked to wait.
+	if (!timers_left && !async_io_pending() && wait && fiber_t::last_fiber())
 		return true;
 	if (!wait)
 		return false;
 
-	int t = get_int_timeout( timeout );
-	int r = poll( 0, 0, t );
-	if (r >= 0)
-		return false;
-	if (errno != EINTR)
-		die("poll failed %d\n", errno);
+	event_loop_sleep( timers_left ? &timeout : NULL );
 	return false;
 }
 
@@ -109,6 +108,8 @@ int schedule(void)
 	{
 		// check if any thing interesting has happened
 		sleeper->check_events( false );
+		check_async_io();
+		check_syscall_stats();
 
 		// other fibers are active... schedule run them
 		if (!fiber_t::last_fiber())
@@ -296,6 +297,8 @@ trace_option trace_option_list[] = {
 	{ "csrdebug", false },
 	{ "ldrsnaps", false },
 	{ "core", false },
+	{ "stats", false },
+	{ "ring", false },
 	{ 0, false },
 };
 
@@ -310,6 +313,8 @@ void usage( void )
 		"  -g,--graphics select screen driver\n"
 		"  -h,--help     print this message\n"
 		"  -q,--quiet    quiet, suppress debug messages\n"
+		"  --record=<file>  record system calls to a file\n"
+		"  --replay=<file>  replay recorded system calls instead of running\n"
 		"  -t,--trace=<options>    enable tracing\n"
 		"  -v,--version  print version\n\n"
 		"  smss.exe is started by default\n\n";
@@ -405,6 +410,8 @@ void parse_options(int argc, char **argv)
 			{"debug", no_argument, NULL, 'd' },
 			{"graphics", required_argument, NULL, 'g' },
 			{"help", no_argument, NULL, 'h' },
+			{"record", required_argument, NULL, 'r' },
+			{"replay", required_argument, NULL, 'R' },
 			{"trace", optional_argument, NULL, 't' },
 			{"version", no_argument, NULL, 'v' },
 			{NULL, 0, 0, 0 },
@@ -430,6 +437,12 @@ void parse_options(int argc, char **argv)
 		case 'h':
 			usage();
 			break;
+		case 'r':
+			syscall_log_record( optarg );
+			break;
+		case 'R':
+			syscall_log_replay( optarg );
+			break;
 		case 't':
 			parse_trace_options( optarg );
 			break;
@@ -460,6 +473,12 @@ int main(int argc, char **argv)
 	// the skas3 patch is deprecated...
 	if (0) init_skas();
 
+	// record traces in a binary file rather than printing them
+	if (trace_is_enabled("ring"))
+		init_trace_ring();
+
+	init_event_loop();
+
 	// pass our path so thread tracing can find the client stub
 	init_tt( argv[0] );
 	if (!pcreate_address_space)
@@ -513,6 +532,10 @@ int main(int argc, char **argv)
 	// run the main loop
 	schedule();
 
+	if (trace_is_enabled("stats"))
+		dump_syscall_stats();
+	syscall_log_finish();
+
 	ntgdi_fini();
 	r = initial_thread->process->ExitStatus;
 	//fprintf(stderr, "process exited (%08x)\n", r);
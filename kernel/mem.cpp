@@ -41,9 +41,6 @@
 #include "mem.h"
 #include "ntcall.h"
 #include "list.h"
-#include "platform.h"
-
-#define MAX_CORE_MEMORY 0x10000000
 
 static inline BOOLEAN mem_allocation_type_is_valid(ULONG state)
 {
@@ -77,10 +74,20 @@ static inline BOOLEAN mem_protection_is_valid(ULONG protect)
 	return 1;
 }
 
+// the part of the free area between start and end that
+// a 64k aligned allocation can use
+static inline ULONG usable_free_area( BYTE *start, BYTE *end )
+{
+	BYTE *aligned = (BYTE*)(((ULONG)start + 0xffff)&~0xffff);
+	return aligned < end ? end - aligned : 0;
+}
+
+// checks the whole address space, so only use it on init and destroy
 void address_space_impl::verify()
 {
 	ULONG total = 0, count = 0;
-	BOOLEAN free_blocks = 0, bad_xlate = 0;
+	ULONG free_blocks = 0, bad_blocks = 0;
+	BYTE *end = lowest_address;
 
 	for ( mblock_iter_t i(blocks); i; i.next() )
 	{
@@ -88,19 +95,21 @@ void address_space_impl::verify()
 
 		if ( mb->is_free() )
 			free_blocks++;
-		// check xlate entries
-		for ( ULONG i=0; i<mb->get_region_size(); i+=0x1000 )
-			if ( xlate_entry(mb->get_base_address() + i ) != mb )
-				bad_xlate++;
+		// blocks should be sorted, not overlap and know the gap below
+		if ( mb->get_base_address() < end )
+			bad_blocks++;
+		if ( mb->free_below != usable_free_area( end, mb->get_base_address() ) )
+			bad_blocks++;
+		end = mb->get_end_address();
 		total += mb->get_region_size();
 		count++;
 	}
 
 	ULONG sz = (size_t) highest_address;
-	if (free_blocks || bad_xlate)
+	if (free_blocks || bad_blocks)
 	{
-		dprintf("invalid VM... %d free blocks %d bad xlate entries\n",
-				free_blocks, bad_xlate);
+		dprintf("invalid VM... %ld free blocks %ld bad blocks\n",
+				free_blocks, bad_blocks);
 		for ( mblock_iter_t i(blocks); i; i.next() )
 		{
 			mblock *mb = i;
@@ -110,13 +119,28 @@ void address_space_impl::verify()
 	}
 
 	assert( free_blocks == 0 );
-	assert( bad_xlate == 0 );
+	assert( bad_blocks == 0 );
 	assert( total < sz );
 }
 
+// check a changed block against its neighbours
+void address_space_impl::verify_block( mblock *mb )
+{
+	mblock *prev = blocks.prev( mb );
+	mblock *next = blocks.next( mb );
+
+	assert( mb->is_linked() );
+	assert( !mb->is_free() );
+	assert( mb->get_end_address() <= highest_address );
+	assert( !prev || prev->get_end_address() <= mb->get_base_address() );
+	assert( !next || mb->get_end_address() <= next->get_base_address() );
+	assert( !next || next->free_below == usable_free_area( mb->get_end_address(), next->get_base_address() ) );
+}
+
 address_space_impl::address_space_impl() :
 	lowest_address(0),
-	highest_address(0)
+	highest_address(0),
+	last_block(0)
 {
 }
 
@@ -133,10 +157,8 @@ void address_space_impl::destroy()
 	verify();
 
 	// free all the non-free allocations
-	while (blocks.head())
-		free_shared( blocks.head() );
-
-	::munmap( xlate, num_pages * sizeof (mblock*) );
+	while (blocks.root())
+		free_shared( blocks.root() );
 }
 
 mblock* address_space_impl::alloc_guard_block(BYTE *address, ULONG size)
@@ -145,7 +167,6 @@ mblock* address_space_impl::alloc_guard_block(BYTE *address, ULONG size)
 	if (!mb)
 		return NULL;
 	mb->reserve( this );
-	update_page_translation( mb );
 	insert_block( mb );
 	return mb;
 }
@@ -175,11 +196,6 @@ bool address_space_impl::init(BYTE *high)
 	highest_address = high;
 	assert( high > (lowest_address + guard_size) );
 
-	num_pages = ((unsigned long)high)>>12;
-	xlate = (mblock**) ::mmap_anon( 0, num_pages * sizeof (mblock*), PROT_READ | PROT_WRITE );
-	if (xlate == (mblock**) -1)
-		die("failed to allocate page translation table\n");
-
 	// make sure there's 0x10000 bytes of reserved memory at 0x00000000
 	if (!alloc_guard_block( NULL, guard_size ))
 		return false;
@@ -200,54 +216,78 @@ void address_space_impl::dump()
 	}
 }
 
-NTSTATUS address_space_impl::find_free_area( int zero_bits, size_t length, int top_down, BYTE *&base )
+void mblock_free_summary::update( mblock *mb )
+{
+	mblock *left = mb->entry[0].get_left();
+	mblock *right = mb->entry[0].get_right();
+
+	mb->max_free_below = mb->free_below;
+	if (left && left->max_free_below > mb->max_free_below)
+		mb->max_free_below = left->max_free_below;
+	if (right && right->max_free_below > mb->max_free_below)
+		mb->max_free_below = right->max_free_below;
+}
+
+void address_space_impl::set_free_below( mblock *mb, mblock *prev )
+{
+	BYTE *end = prev ? prev->get_end_address() : lowest_address;
+	mb->free_below = usable_free_area( end, mb->get_base_address() );
+	blocks.update_path( mb );
+}
+
+// returns a 64k aligned address that fits in a free area
+static bool fit_free_area( BYTE *start, BYTE *end, size_t length, int top_down, BYTE *&base )
 {
-	ULONG free_size;
+	if ((ULONG)(end - start) < length)
+		return false;
+	if (top_down)
+		base = (BYTE*)(((ULONG)end - length)&~0xffff);
+	else
+		base = (BYTE*)(((ULONG)start + 0xffff)&~0xffff);
+	return base >= start && base <= end && (ULONG)(end - base) >= length;
+}
+
+// Find the lowest (or highest) block in the subtree at mb with
+// a free area below it that fits.  Subtrees without a big enough
+// free area are skipped, so this takes O(log n).
+mblock *address_space_impl::find_free_below( mblock *mb, size_t length, int top_down, BYTE *&base )
+{
+	if (!mb || mb->max_free_below < length)
+		return NULL;
+
+	mblock *first = top_down ? mb->entry[0].get_right() : mb->entry[0].get_left();
+	mblock *second = top_down ? mb->entry[0].get_left() : mb->entry[0].get_right();
+
+	mblock *found = find_free_below( first, length, top_down, base );
+	if (found)
+		return found;
 
+	BYTE *end = mb->get_base_address();
+	if (fit_free_area( end - mb->free_below, end, length, top_down, base ))
+		return mb;
+
+	return find_free_below( second, length, top_down, base );
+}
+
+NTSTATUS address_space_impl::find_free_area( int zero_bits, size_t length, int top_down, BYTE *&base )
+{
 	//dprintf("%08x\n", length);
 	length = (length + 0xfff) & ~0xfff;
 
-	free_size = 0;
-	if (!top_down)
-	{
-		base = lowest_address;
-		while (free_size < length)
-		{
-			if ((base+free_size) >= highest_address)
-				return STATUS_NO_MEMORY;
-
-			if (xlate_entry( base+free_size ))
-			{
-				mblock *mb = xlate_entry( base+free_size );
-				base = mb->get_base_address() + mb->get_region_size();
-				free_size = 0;
-			}
-			else if (((ULONG)base)&0xffff)
-				base += 0x1000;
-			else
-				free_size += 0x1000;
-		}
-	}
-	else
-	{
-		base = (BYTE*)(((ULONG)highest_address - length)&~0xffff);
-		while (free_size < length)
-		{
-			if ((base+free_size) <= lowest_address)
-				return STATUS_NO_MEMORY;
-			if (xlate_entry( base+free_size ))
-			{
-				mblock *mb = xlate_entry( base+free_size );
-				base = mb->get_base_address() - length;
-				free_size = 0;
-			}
-			else if (((ULONG)base)&0xffff)
-				base -= 0x1000;
-			else
-				free_size += 0x1000;
-		}
-	}
-	return STATUS_SUCCESS;
+	// the area above the last block isn't tracked in the tree
+	mblock *last = blocks.last();
+	BYTE *end = last ? last->get_end_address() : lowest_address;
+
+	if (top_down && fit_free_area( end, highest_address, length, top_down, base ))
+		return STATUS_SUCCESS;
+
+	if (find_free_below( blocks.root(), length, top_down, base ))
+		return STATUS_SUCCESS;
+
+	if (!top_down && fit_free_area( end, highest_address, length, top_down, base ))
+		return STATUS_SUCCESS;
+
+	return STATUS_NO_MEMORY;
 }
 
 mblock *address_space_impl::get_mblock( BYTE *address )
@@ -256,8 +296,42 @@ mblock *address_space_impl::get_mblock( BYTE *address )
 	if (address >= highest_address)
 		return NULL;
 
-	// try using the address translation table
-	return xlate_entry( address );
+	// consecutive lookups usually hit the same block
+	if (last_block && last_block->contains( address ))
+		return last_block;
+
+	mblock *mb = blocks.root();
+	while (mb)
+	{
+		if (address < mb->get_base_address())
+			mb = mb->entry[0].get_left();
+		else if (address >= mb->get_end_address())
+			mb = mb->entry[0].get_right();
+		else
+		{
+			last_block = mb;
+			break;
+		}
+	}
+	return mb;
+}
+
+// returns the first block starting above address
+mblock *address_space_impl::next_mblock( BYTE *address )
+{
+	mblock *mb = blocks.root(), *next = NULL;
+
+	while (mb)
+	{
+		if (address < mb->get_base_address())
+		{
+			next = mb;
+			mb = mb->entry[0].get_left();
+		}
+		else
+			mb = mb->entry[0].get_right();
+	}
+	return next;
 }
 
 // bitmask returned by check_area
@@ -279,28 +353,55 @@ ULONG address_space_impl::check_area( BYTE *address, size_t length )
 
 	flags |= AREA_VALID;
 
-	mblock *mb = xlate_entry(address);
-
-	if (!mb)
-		flags |= AREA_FREE;
-
-	flags |= AREA_CONTIGUOUS;
-	for (ULONG i=0; i<length && (flags & AREA_CONTIGUOUS); i+=0x1000)
-		if (mb != xlate_entry(address + i))
-			flags &= ~(AREA_CONTIGUOUS | AREA_FREE);
+	mblock *mb = get_mblock( address );
+	if (mb)
+	{
+		// the area must be within a single block
+		if (address + length <= mb->get_end_address())
+			flags |= AREA_CONTIGUOUS;
+	}
+	else
+	{
+		// no block may start inside the area
+		mblock *next = next_mblock( address );
+		if (!next || address + length <= next->get_base_address())
+			flags |= AREA_CONTIGUOUS | AREA_FREE;
+	}
 
 	return flags;
 }
 
 void address_space_impl::insert_block( mblock *mb )
 {
-	blocks.append( mb );
+	mblock *x = blocks.root(), *point = NULL;
+	bool to_right = false;
+
+	while (x)
+	{
+		point = x;
+		to_right = (mb->get_base_address() > x->get_base_address());
+		x = to_right ? x->entry[0].get_right() : x->entry[0].get_left();
+	}
+	blocks.insert( point, to_right, mb );
+
+	// the free area below the next block is now below this one
+	set_free_below( mb, blocks.prev( mb ) );
+	mblock *next = blocks.next( mb );
+	if (next)
+		set_free_below( next, mb );
 }
 
 void address_space_impl::remove_block( mblock *mb )
 {
 	assert( mb->is_free() );
+	if (last_block == mb)
+		last_block = NULL;
+
+	mblock *prev = blocks.prev( mb );
+	mblock *next = blocks.next( mb );
 	blocks.unlink( mb );
+	if (next)
+		set_free_below( next, prev );
 }
 
 // splits one block into three parts (before, middle, after)
@@ -319,7 +420,6 @@ mblock *address_space_impl::split_area( mblock *mb, BYTE *address, size_t length
 	if (mb->get_base_address() != address)
 	{
 		ret = mb->split( address - mb->get_base_address() );
-		update_page_translation( ret );
 		insert_block( ret );
 	}
 	else
@@ -328,30 +428,14 @@ mblock *address_space_impl::split_area( mblock *mb, BYTE *address, size_t length
 	if (ret->get_region_size() != length)
 	{
 		mblock *extra = ret->split( length );
-		update_page_translation( extra );
 		insert_block( extra );
 	}
 
 	return ret;
 }
 
-void address_space_impl::update_page_translation( mblock *mb )
-{
-	ULONG i;
-
-	for ( i = 0; i<mb->get_region_size(); i += 0x1000 )
-	{
-		if (!mb->is_free())
-			xlate_entry( mb->get_base_address() + i ) = mb;
-		else
-			xlate_entry( mb->get_base_address() + i ) = NULL;
-	}
-}
-
 NTSTATUS address_space_impl::get_mem_region( BYTE *start, size_t length, int state )
 {
-	verify();
-
 	ULONG flags = check_area( start, length );
 
 	if (!(flags & AREA_VALID))
@@ -392,12 +476,13 @@ NTSTATUS address_space_impl::allocate_virtual_memory( BYTE **start, int zero_bit
 	if (r < STATUS_SUCCESS)
 		return r;
 
-	mblock *mb = xlate_entry( *start );
+	// core pages are backed when committed, so reserving can't fail
+	mblock *mb = get_mblock( *start );
+	bool created = !mb;
 	if (!mb)
 	{
 		mb = alloc_core_pages( *start, length );
 		insert_block( mb );
-		//xlate_entry( start ) = mb;
 	}
 	else
 	{
@@ -409,10 +494,25 @@ NTSTATUS address_space_impl::allocate_virtual_memory( BYTE **start, int zero_bit
 	assert( *start == mb->get_base_address());
 	assert( length == mb->get_region_size());
 
-	return set_block_state( mb, state, prot );
+	r = set_block_state( mb, state, prot );
+	if (r < STATUS_SUCCESS && created)
+		free_shared( mb );
+	return r;
 }
 
 NTSTATUS address_space_impl::map_fd( BYTE **start, int zero_bits, size_t length, int state, int prot, backing_store_t *backing )
+{
+	return map_block( start, zero_bits, length, state, prot, backing, 0, false );
+}
+
+// map part of a shared image, private copies are made when written
+NTSTATUS address_space_impl::map_image( BYTE **start, size_t length, int prot, backing_store_t *backing, ULONG offset )
+{
+	return map_block( start, 0, length, MEM_COMMIT, prot, backing, offset, true );
+}
+
+NTSTATUS address_space_impl::map_block( BYTE **start, int zero_bits, size_t length, int state, int prot,
+		backing_store_t *backing, ULONG offset, bool cow )
 {
 	NTSTATUS r;
 
@@ -431,11 +531,14 @@ NTSTATUS address_space_impl::map_fd( BYTE **start, int zero_bits, size_t length,
 	if (r < STATUS_SUCCESS)
 		return r;
 
-	mblock *mb = xlate_entry( *start );
+	mblock *mb = get_mblock( *start );
 	if (mb)
 		return STATUS_CONFLICTING_ADDRESSES;
 
-	mb = alloc_fd_pages( *start, length, backing );
+	if (cow)
+		mb = alloc_image_pages( *start, length, backing, offset );
+	else
+		mb = alloc_fd_pages( *start, length, backing );
 	insert_block( mb );
 	assert( mb->is_linked() );
 
@@ -474,19 +577,18 @@ NTSTATUS address_space_impl::check_params( BYTE *start, int zero_bits, size_t le
 NTSTATUS address_space_impl::set_block_state( mblock *mb, int state, int prot )
 {
 	if (mb->is_free())
-	{
 		mb->reserve( this );
-		update_page_translation( mb );
-	}
 
 	if (state & MEM_COMMIT)
 	{
+		if (!mb->alloc_backing())
+			return STATUS_NO_MEMORY;
 		mb->set_prot( prot );
 		mb->commit( this );
 	}
 
 	assert( !mb->is_free() );
-	verify();
+	verify_block( mb );
 	//mb->dump();
 
 	return STATUS_SUCCESS;
@@ -499,7 +601,6 @@ void address_space_impl::free_shared( mblock *mb )
 		mb->uncommit( this );
 
 	mb->unreserve( this );
-	update_page_translation( mb );
 	remove_block( mb );
 	delete mb;
 }
@@ -527,8 +628,6 @@ NTSTATUS address_space_impl::free_virtual_memory( void *start, size_t length, UL
 	if (addr > highest_address)
 		return STATUS_INVALID_PARAMETER_2;
 
-	verify();
-
 	mb = get_mblock( addr );
 	if (!mb)
 	{
@@ -548,8 +647,6 @@ NTSTATUS address_space_impl::free_virtual_memory( void *start, size_t length, UL
 
 	free_shared( mb );
 
-	verify();
-
 	return STATUS_SUCCESS;
 }
 
@@ -600,7 +697,7 @@ NTSTATUS address_space_impl::get_kernel_address( BYTE **address, size_t *len )
 	if ((*address + *len) > highest_address)
 		return STATUS_ACCESS_VIOLATION;
 
-	mb = xlate_entry( *address );
+	mb = get_mblock( *address );
 	if (!mb)
 		return STATUS_ACCESS_VIOLATION;
 
@@ -640,53 +737,80 @@ const char *address_space_impl::get_symbol( BYTE *address )
 	return get_section_symbol( mb->get_section(), (ULONG) address );
 }
 
-NTSTATUS address_space_impl::copy_from_user( void *dest, const void *src, size_t len )
+// Copy between user memory and kernel buffers, following adjacent
+// blocks in the tree rather than looking up each one from the root.
+// Like a chunk by chunk copy, stops at the first inaccessible address,
+// leaving what came before it copied.
+NTSTATUS address_space_impl::copy_user( user_iovec_t *iov, ULONG count, user_copy_op op )
 {
-	NTSTATUS r = STATUS_SUCCESS;
-	size_t n;
-	BYTE *x;
-
-	while (len)
+	for (ULONG i=0; i<count; i++)
 	{
-		n = len;
-		x = (BYTE*) src;
-		r = get_kernel_address( &x, &n );
-		if (r < STATUS_SUCCESS)
-			break;
-		memcpy( dest, x, n );
-		assert( len >= n );
-		len -= n;
-		src = (BYTE*)src + n;
-		dest = (BYTE*)dest + n;
+		BYTE *user = (BYTE*) iov[i].user;
+		BYTE *kernel = (BYTE*) iov[i].kernel;
+		size_t len = iov[i].len;
+
+		if (!len)
+			continue;
+
+		if (user >= highest_address ||
+			len > (size_t) highest_address ||
+			(user + len) > highest_address)
+			return STATUS_ACCESS_VIOLATION;
+
+		mblock *mb = get_mblock( user );
+		while (1)
+		{
+			if (!mb || user < mb->get_base_address() || !mb->is_committed())
+				return STATUS_ACCESS_VIOLATION;
+
+			if (op == user_write)
+				mb->copy_on_write( this );
+
+			assert( mb->get_kernel_address() != NULL );
+			size_t ofs = user - mb->get_base_address();
+			size_t n = mb->get_region_size() - ofs;
+			if (n > len)
+				n = len;
+
+			if (op == user_read)
+				memcpy( kernel, mb->get_kernel_address() + ofs, n );
+			else if (op == user_write)
+				memcpy( mb->get_kernel_address() + ofs, kernel, n );
+
+			len -= n;
+			if (!len)
+				break;
+			user += n;
+			if (kernel)
+				kernel += n;
+			mb = blocks.next( mb );
+		}
 	}
 
-	return r;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS address_space_impl::copy_from_user( void *dest, const void *src, size_t len )
+{
+	user_iovec_t iov;
+
+	iov.user = const_cast<void*>( src );
+	iov.kernel = dest;
+	iov.len = len;
+	return copy_user( &iov, 1, user_read );
 }
 
 NTSTATUS address_space_impl::copy_to_user( void *dest, const void *src, size_t len )
 {
-	NTSTATUS r = STATUS_SUCCESS;
-	size_t n;
-	BYTE *x;
+	user_iovec_t iov;
 
 	//dprintf("%p %p %04x\n", dest, src, len);
 
-	while (len)
-	{
-		n = len;
-		x = (BYTE*)dest;
-		r = get_kernel_address( &x, &n );
-		if (r < STATUS_SUCCESS)
-			break;
-		//dprintf("%p %p %u\n", x, src, n);
-		memcpy( x, src, n );
-		assert( len >= n );
-		len -= n;
-		src = (BYTE*)src + n;
-		dest = (BYTE*)dest + n;
-	}
-
-	if (len)
+	iov.user = dest;
+	iov.kernel = const_cast<void*>( src );
+	iov.len = len;
+	NTSTATUS r = copy_user( &iov, 1, user_write );
+	if (r < STATUS_SUCCESS)
 		dprintf("status %08lx copying to %p\n", r, dest );
 
 	return r;
@@ -694,22 +818,22 @@ NTSTATUS address_space_impl::copy_to_user( void *dest, const void *src, size_t l
 
 NTSTATUS address_space_impl::verify_for_write( void *dest, size_t len )
 {
-	NTSTATUS r = STATUS_SUCCESS;
-	size_t n;
-	BYTE *x;
+	user_iovec_t iov;
 
-	while (len)
-	{
-		n = len;
-		x = (BYTE*) dest;
-		r = get_kernel_address( &x, &n );
-		if (r < STATUS_SUCCESS)
-			break;
-		len -= n;
-		dest = (BYTE*)dest + n;
-	}
+	iov.user = dest;
+	iov.kernel = NULL;
+	iov.len = len;
+	return copy_user( &iov, 1, user_verify );
+}
 
-	return r;
+NTSTATUS address_space_impl::copy_from_user_v( user_iovec_t *iov, ULONG count )
+{
+	return copy_user( iov, count, user_read );
+}
+
+NTSTATUS address_space_impl::copy_to_user_v( user_iovec_t *iov, ULONG count )
+{
+	return copy_user( iov, count, user_write );
 }
 
 mblock* address_space_impl::find_block( BYTE *addr )
@@ -717,6 +841,14 @@ mblock* address_space_impl::find_block( BYTE *addr )
 	return get_mblock( addr );
 }
 
+bool address_space_impl::copy_on_write( void* addr )
+{
+	mblock* mb = get_mblock( (BYTE*) addr );
+	if (!mb)
+		return false;
+	return mb->copy_on_write( this );
+}
+
 bool address_space_impl::traced_access( void* addr, ULONG Eip )
 {
 	BYTE* address = (BYTE*) addr;
@@ -927,6 +1059,7 @@ NTSTATUS NTAPI NtWriteVirtualMemory(
 		if (r < STATUS_SUCCESS)
 			break;
 
+		p->vm->copy_on_write( dest );
 		r = p->vm->get_kernel_address( &dest, &len );
 		if (r < STATUS_SUCCESS)
 			break;
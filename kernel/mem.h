@@ -23,6 +23,7 @@
 
 #include <unistd.h>
 #include "list.h"
+#include "rbtree.h"
 #include "object.h"
 
 class mblock;
@@ -32,6 +33,8 @@ class execution_context_t {
 public:
 	virtual void handle_fault() = 0;
 	virtual void handle_breakpoint() = 0;
+	virtual void handle_syscall() = 0;
+	virtual void handle_timeout() = 0;
 	virtual ~execution_context_t() {};
 };
 
@@ -51,6 +54,13 @@ public:
 	virtual ~block_tracer();
 };
 
+// one buffer in a scatter-gather copy between kernel and user memory
+struct user_iovec_t {
+	void *user;
+	void *kernel;
+	size_t len;
+};
+
 class address_space {
 public:
 	virtual ~address_space();
@@ -59,12 +69,16 @@ public:
 	virtual NTSTATUS copy_to_user( void *dest, const void *src, size_t len ) = 0;
 	virtual NTSTATUS copy_from_user( void *dest, const void *src, size_t len ) = 0;
 	virtual NTSTATUS verify_for_write( void *dest, size_t len ) = 0;
+	virtual NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count ) = 0;
+	virtual NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count ) = 0;
 	virtual NTSTATUS allocate_virtual_memory( BYTE **start, int zero_bits, size_t length, int state, int prot ) = 0;
 	virtual NTSTATUS map_fd( BYTE **start, int zero_bits, size_t length, int state, int prot, backing_store_t *backing ) = 0;
+	virtual NTSTATUS map_image( BYTE **start, size_t length, int prot, backing_store_t *backing, ULONG offset ) = 0;
+	virtual bool copy_on_write( void *address ) = 0;
 	virtual NTSTATUS free_virtual_memory( void *start, size_t length, ULONG state ) = 0;
 	virtual NTSTATUS unmap_view( void *start ) = 0;
 	virtual void dump() = 0;
-	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset ) = 0;
+	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset ) = 0;
 	virtual int munmap( BYTE *address, size_t length ) = 0;
 	virtual mblock* find_block( BYTE *addr ) = 0;
 	virtual const char *get_symbol( BYTE *address ) = 0;
@@ -76,17 +90,26 @@ public:
 	virtual bool set_tracer( BYTE* address, block_tracer& tracer) = 0;
 };
 
-unsigned int allocate_core_memory(unsigned int size);
-int free_core_memory( unsigned int offset, unsigned int size );
+LONGLONG allocate_core_memory( ULONG size );
+void free_core_memory( LONGLONG offset, ULONG size );
 struct address_space *create_address_space( BYTE *high );
 
-typedef list_anchor<mblock,0> mblock_list_t;
-typedef list_iter<mblock,0> mblock_iter_t;
-typedef list_element<mblock> mblock_element_t;
+// tracks the largest free area below any block in a subtree
+class mblock_free_summary {
+public:
+	static void update( mblock *mb );
+};
+
+typedef rbtree<mblock,0,mblock_free_summary> mblock_tree_t;
+typedef rbtree_iter<mblock,0,mblock_free_summary> mblock_iter_t;
+typedef rbtree_element<mblock> mblock_element_t;
 
 class mblock {
 public:
 	mblock_element_t entry[1];
+	// 64k aligned free space between this block and the previous one
+	ULONG free_below;
+	ULONG max_free_below;
 
 protected:
 	// windows-ish stuff
@@ -128,6 +151,8 @@ public:
 	int is_linked() { return entry[0].is_linked(); }
 	BYTE *get_kernel_address() { return kernel_address; };
 	BYTE *get_base_address() { return BaseAddress; };
+	BYTE *get_end_address() { return BaseAddress + RegionSize; };
+	bool contains( BYTE *address ) { return BaseAddress <= address && address < BaseAddress + RegionSize; }
 	ULONG get_region_size() { return RegionSize; };
 	ULONG get_prot() { return Protect; };
 	object_t* get_section() { return section; };
@@ -138,11 +163,14 @@ public:
 	bool set_traced( address_space *vm, bool traced );
 	void set_section( object_t *section );
 	void set_prot( ULONG prot );
+	virtual bool copy_on_write( address_space *vm );
+	virtual bool alloc_backing();
 };
 
 mblock* alloc_guard_pages(BYTE* address, ULONG size);
 mblock* alloc_core_pages(BYTE* address, ULONG size);
 mblock* alloc_fd_pages(BYTE* address, ULONG size, backing_store_t* backing);
+mblock* alloc_image_pages(BYTE* address, ULONG size, backing_store_t* backing, ULONG offset);
 
 int create_mapping_fd( int sz );
 
@@ -150,19 +178,17 @@ class address_space_impl : public address_space {
 private:
 	BYTE *const lowest_address;
 	BYTE *highest_address;
-	mblock_list_t blocks;
-	int num_pages;
-	mblock **xlate;
+	mblock_tree_t blocks;
+	mblock *last_block;
 
 protected:
-	mblock *&xlate_entry( BYTE *address )
-	{
-		return xlate[ ((unsigned int)address)>>12 ];
-	}
 	address_space_impl();
 	bool init( BYTE *high );
 	void destroy();
 	mblock *get_mblock( BYTE *address );
+	mblock *next_mblock( BYTE *address );
+	void set_free_below( mblock *mb, mblock *prev );
+	mblock *find_free_below( mblock *mb, size_t length, int top_down, BYTE *&address );
 	NTSTATUS find_free_area( int zero_bits, size_t length, int top_down, BYTE *&address );
 	NTSTATUS check_params( BYTE *start, int zero_bits, size_t length, int state, int prot );
 	NTSTATUS set_block_state( mblock *mb, int state, int prot );
@@ -171,8 +197,12 @@ protected:
 	NTSTATUS get_mem_region( BYTE *start, size_t length, int state );
 	void insert_block( mblock *x );
 	void remove_block( mblock *x );
+	void verify_block( mblock *x );
 	ULONG check_area( BYTE *address, size_t length );
+	NTSTATUS map_block( BYTE **start, int zero_bits, size_t length, int state, int prot, backing_store_t *backing, ULONG offset, bool cow );
 	mblock* alloc_guard_block(BYTE *address, ULONG size);
+	enum user_copy_op { user_read, user_write, user_verify };
+	NTSTATUS copy_user( user_iovec_t *iov, ULONG count, user_copy_op op );
 
 public:
 	// a constructor that can fail...
@@ -187,14 +217,17 @@ public:
 	virtual NTSTATUS copy_from_user( void *dest, const void *src, size_t len );
 	virtual NTSTATUS copy_to_user( void *dest, const void *src, size_t len );
 	virtual NTSTATUS verify_for_write( void *dest, size_t len );
+	virtual NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count );
+	virtual NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count );
 	virtual NTSTATUS allocate_virtual_memory( BYTE **start, int zero_bits, size_t length, int state, int prot );
 	virtual NTSTATUS map_fd( BYTE **start, int zero_bits, size_t length, int state, int prot, backing_store_t *backing );
+	virtual NTSTATUS map_image( BYTE **start, size_t length, int prot, backing_store_t *backing, ULONG offset );
+	virtual bool copy_on_write( void *address );
 	virtual NTSTATUS free_virtual_memory( void *start, size_t length, ULONG state );
 	virtual NTSTATUS unmap_view( void *start );
 	virtual void dump();
-	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset ) = 0;
+	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset ) = 0;
 	virtual int munmap( BYTE *address, size_t length ) = 0;
-	virtual void update_page_translation( mblock *mb );
 	virtual mblock* find_block( BYTE *addr );
 	virtual const char *get_symbol( BYTE *address );
 	virtual void run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec ) = 0;
@@ -36,13 +36,18 @@
 class pipe_server_t;
 class pipe_client_t;
 class pipe_container_t;
+class pipe_channel_t;
+class pipe_waiter_t;
 
 typedef list_anchor<pipe_server_t,0> pipe_server_list_t;
+typedef list_anchor<pipe_server_t,1> pipe_idle_server_list_t;
 typedef list_element<pipe_server_t> pipe_server_element_t;
 typedef list_iter<pipe_server_t,0> pipe_server_iter_t;
 typedef list_anchor<pipe_client_t,0> pipe_client_list_t;
 typedef list_element<pipe_client_t> pipe_client_element_t;
 typedef list_iter<pipe_client_t,0> pipe_client_iter_t;
+typedef list_anchor<pipe_waiter_t,0> pipe_waiter_list_t;
+typedef list_element<pipe_waiter_t> pipe_waiter_element_t;
 
 // the pipe device \Device\NamedPipe, contains pipes of different names
 class pipe_device_t : public object_dir_impl_t, public io_object_t
@@ -67,36 +72,72 @@ public:
 class pipe_container_t : virtual public object_t
 {
 	pipe_server_list_t servers;
-	pipe_client_list_t clients;
+	pipe_idle_server_list_t idle_servers;	// servers waiting for a client
+	pipe_client_list_t clients;		// clients waiting for a server
 	ULONG num_instances;
 	ULONG max_instances;
+	bool message_type;
 public:
-	pipe_container_t( ULONG max );
-	NTSTATUS create_server( pipe_server_t*& pipe, ULONG max_inst );
+	pipe_container_t( ULONG max, bool message_type );
+	NTSTATUS create_server( pipe_server_t*& pipe, ULONG max_inst,
+		ULONG in_quota, ULONG out_quota, bool read_mode_message );
 	NTSTATUS create_client( pipe_client_t*& pipe );
 	void unlink( pipe_server_t *pipe );
+	void add_idle_server( pipe_server_t *pipe );
+	void remove_idle_server( pipe_server_t *pipe );
+	void remove_client( pipe_client_t *pipe );
 	pipe_server_list_t& get_servers() {return servers;}
 	pipe_client_list_t& get_clients() {return clients;}
+	bool is_message_type() {return message_type;}
 	virtual NTSTATUS open( object_t *&out, open_info_t& info );
 	pipe_server_t* find_idle_server();
 };
 
-class pipe_message_t;
-
-typedef list_anchor<pipe_message_t,0> pipe_message_list_t;
-typedef list_element<pipe_message_t> pipe_message_element_t;
-typedef list_iter<pipe_message_t,0> pipe_message_iter_t;
+// a thread blocked on a pipe channel, lives on the waiting thread's stack
+class pipe_waiter_t
+{
+public:
+	pipe_waiter_element_t entry[1];
+	pipe_channel_t *channel;	// cleared if the channel goes away
+	thread_t *thread;
+	bool running;
+public:
+	pipe_waiter_t( pipe_channel_t *_channel );
+	void wake();
+};
 
-class pipe_message_t
+// One direction of a pipe instance.
+// Data is held in a ring sized from the quota given at creation.
+// On message type pipes, each message is preceded by its length.
+// Only the thread at the head of the reader or writer queue touches
+// the ring, so writes are never interleaved, and writers block while
+// the ring is full.
+class pipe_channel_t
 {
+	unsigned char *ring;
+	ULONG size;
+	ULONG head;
+	ULONG used;
+	ULONG msg_left;		// unread bytes of the message at the head
+	bool message_type;
+	bool broken;
+	pipe_waiter_list_t readers;
+	pipe_waiter_list_t writers;
 protected:
-	void *operator new(unsigned int count, void*&ptr) { assert( count == sizeof (pipe_message_t)); return ptr; }
-	pipe_message_t(ULONG _Length);
+	void put( const void *data, ULONG len );
+	void get( void *data, ULONG len );
+	NTSTATUS put_user( PVOID buffer, ULONG len );
+	NTSTATUS get_user( PVOID buffer, ULONG len );
+	NTSTATUS wait_for( pipe_waiter_list_t& list, pipe_waiter_t& w, ULONG need, bool for_write );
+	NTSTATUS abort_write( pipe_waiter_t& w, NTSTATUS r );
+	void kick();
 public:
-	pipe_message_element_t entry[1];
-	ULONG Length;
-	static pipe_message_t* alloc_pipe_message( ULONG _Length );
-	unsigned char *data_ptr();
+	pipe_channel_t();
+	~pipe_channel_t();
+	bool init( ULONG quota, bool message_type );
+	NTSTATUS read( PVOID buffer, ULONG length, ULONG *read, bool message_mode );
+	NTSTATUS write( PVOID buffer, ULONG length, ULONG *written );
+	void set_broken();
 };
 
 // a single server instance
@@ -115,11 +156,12 @@ public:
 	pipe_state state;
 	pipe_client_t *client;
 	thread_t *thread;
-	pipe_server_element_t entry[1];
-	pipe_message_list_t received_messages;
-	pipe_message_list_t sent_messages;
+	pipe_server_element_t entry[2];
+	pipe_channel_t inbound;		// client to server
+	pipe_channel_t outbound;	// server to client
+	bool read_mode_message;
 public:
-	pipe_server_t( pipe_container_t *container );
+	pipe_server_t( pipe_container_t *container, bool read_mode_message );
 	~pipe_server_t();
 	virtual NTSTATUS read( PVOID buffer, ULONG length, ULONG *read );
 	virtual NTSTATUS write( PVOID buffer, ULONG length, ULONG *written );
@@ -133,8 +175,7 @@ public:
 	NTSTATUS connect();
 	NTSTATUS disconnect();
 	void set_client( pipe_client_t* pipe_client );
-	void queue_message_from_client( pipe_message_t *msg );
-	void queue_message_to_client( pipe_message_t *msg );
+	void client_closed();
 };
 
 // a single client instance
@@ -143,10 +184,12 @@ class pipe_client_t : public io_object_t
 	friend class pipe_container_t;
 public:
 	pipe_client_element_t entry[1];
+	pipe_container_t *container;
 	pipe_server_t *server;
-	thread_t *thread;
+	bool read_mode_message;
 public:
 	pipe_client_t( pipe_container_t *container );
+	~pipe_client_t();
 	virtual NTSTATUS read( PVOID buffer, ULONG length, ULONG *read );
 	virtual NTSTATUS write( PVOID buffer, ULONG length, ULONG *written );
 	NTSTATUS set_pipe_info( FILE_PIPE_INFORMATION& pipe_info );
@@ -160,8 +203,13 @@ public:
 class pipe_factory : public object_factory
 {
 	ULONG MaxInstances;
+	ULONG InBufferSize;
+	ULONG OutBufferSize;
+	bool TypeMessage;
+	bool ReadModeMessage;
 public:
-	pipe_factory( ULONG _MaxInstances );
+	pipe_factory( ULONG _MaxInstances, ULONG _InBufferSize, ULONG _OutBufferSize,
+		bool _TypeMessage, bool _ReadModeMessage );
 	NTSTATUS alloc_object(object_t** obj);
 	NTSTATUS on_open( object_dir_t* dir, object_t*& obj, open_info_t& info );
 };
@@ -224,23 +272,6 @@ NTSTATUS pipe_device_t::write( PVOID buffer, ULONG length, ULONG *written )
 	return STATUS_ACCESS_DENIED;
 }
 
-pipe_message_t::pipe_message_t( ULONG _Length ) :
-	Length( _Length )
-{
-}
-
-pipe_message_t *pipe_message_t::alloc_pipe_message( ULONG _Length )
-{
-	ULONG sz = _Length + sizeof (pipe_message_t);
-	void *mem = (void*) new unsigned char[sz];
-	return new(mem) pipe_message_t(_Length);
-}
-
-unsigned char *pipe_message_t::data_ptr()
-{
-	return (unsigned char *) (this+1);
-}
-
 class wait_server_info_t
 {
 	FILE_PIPE_WAIT_FOR_BUFFER info;
@@ -324,19 +355,326 @@ NTSTATUS pipe_device_t::fs_control( event_t* event, IO_STATUS_BLOCK iosb, ULONG
 	return STATUS_NOT_IMPLEMENTED;
 }
 
-pipe_container_t::pipe_container_t( ULONG max ) :
+// quota used when NtCreateNamedPipeFile passes zero
+static const ULONG pipe_default_quota = 0x1000;
+static const ULONG pipe_max_quota = 0x1000000;
+
+pipe_waiter_t::pipe_waiter_t( pipe_channel_t *_channel ) :
+	channel( _channel ),
+	thread( current ),
+	running( true )
+{
+}
+
+void pipe_waiter_t::wake()
+{
+	if (running)
+		return;
+	running = true;
+	thread->start();
+}
+
+pipe_channel_t::pipe_channel_t() :
+	ring( 0 ),
+	size( 0 ),
+	head( 0 ),
+	used( 0 ),
+	msg_left( 0 ),
+	message_type( false ),
+	broken( false )
+{
+}
+
+pipe_channel_t::~pipe_channel_t()
+{
+	pipe_waiter_t *w;
+
+	// the waiters can't touch the channel once it's gone
+	while ((w = readers.head()))
+	{
+		readers.unlink( w );
+		w->channel = 0;
+		w->wake();
+	}
+	while ((w = writers.head()))
+	{
+		writers.unlink( w );
+		w->channel = 0;
+		w->wake();
+	}
+	delete[] ring;
+}
+
+bool pipe_channel_t::init( ULONG quota, bool _message_type )
+{
+	if (!quota)
+		quota = pipe_default_quota;
+	if (quota > pipe_max_quota)
+		quota = pipe_max_quota;
+
+	// make room for one message header, so a message the size of the quota fits
+	message_type = _message_type;
+	size = quota;
+	if (message_type)
+		size += sizeof (ULONG);
+	ring = new unsigned char[size];
+	return ring != 0;
+}
+
+void pipe_channel_t::put( const void *data, ULONG len )
+{
+	ULONG tail = (head + used) % size;
+	ULONG n = min( len, size - tail );
+	memcpy( ring + tail, data, n );
+	memcpy( ring, (const unsigned char*) data + n, len - n );
+	used += len;
+}
+
+void pipe_channel_t::get( void *data, ULONG len )
+{
+	ULONG n = min( len, size - head );
+	memcpy( data, ring + head, n );
+	memcpy( (unsigned char*) data + n, ring, len - n );
+	head = (head + len) % size;
+	used -= len;
+}
+
+NTSTATUS pipe_channel_t::put_user( PVOID buffer, ULONG len )
+{
+	ULONG tail = (head + used) % size;
+	ULONG n = min( len, size - tail );
+	user_iovec_t iov[2];
+	NTSTATUS r;
+
+	// the free space may wrap around the end of the ring
+	iov[0].user = buffer;
+	iov[0].kernel = ring + tail;
+	iov[0].len = n;
+	iov[1].user = (unsigned char*) buffer + n;
+	iov[1].kernel = ring;
+	iov[1].len = len - n;
+	r = copy_from_user_v( iov, 2 );
+	if (r < STATUS_SUCCESS)
+		return r;
+	used += len;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS pipe_channel_t::get_user( PVOID buffer, ULONG len )
+{
+	ULONG n = min( len, size - head );
+	user_iovec_t iov[2];
+	NTSTATUS r;
+
+	iov[0].user = buffer;
+	iov[0].kernel = ring + head;
+	iov[0].len = n;
+	iov[1].user = (unsigned char*) buffer + n;
+	iov[1].kernel = ring;
+	iov[1].len = len - n;
+	r = copy_to_user_v( iov, 2 );
+	if (r < STATUS_SUCCESS)
+		return r;
+	head = (head + len) % size;
+	used -= len;
+	return STATUS_SUCCESS;
+}
+
+// wake the threads that can make progress
+void pipe_channel_t::kick()
+{
+	pipe_waiter_t *w;
+
+	if (broken)
+	{
+		for (w = readers.head(); w; w = w->entry[0].get_next())
+			w->wake();
+		for (w = writers.head(); w; w = w->entry[0].get_next())
+			w->wake();
+		return;
+	}
+
+	w = readers.head();
+	if (w && used)
+		w->wake();
+	w = writers.head();
+	if (w && used < size)
+		w->wake();
+}
+
+// Wait until w is at the head of the list and need bytes of data (or
+// space, for a writer) are in the ring.  On failure, w is off the list.
+NTSTATUS pipe_channel_t::wait_for( pipe_waiter_list_t& list, pipe_waiter_t& w, ULONG need, bool for_write )
+{
+	while (1)
+	{
+		ULONG avail = for_write ? (size - used) : used;
+		if (list.head() == &w && avail >= need)
+			return STATUS_SUCCESS;
+
+		// readers may drain what's left after the other end goes away
+		if (broken && (for_write || !used))
+		{
+			list.unlink( &w );
+			kick();
+			return STATUS_PIPE_BROKEN;
+		}
+
+		w.running = false;
+		current->wait();
+		w.running = true;
+
+		// don't touch this if the channel was freed while we slept
+		if (!w.channel)
+			return current->is_terminated() ? STATUS_THREAD_IS_TERMINATING : STATUS_PIPE_BROKEN;
+
+		if (current->is_terminated())
+		{
+			list.unlink( &w );
+			kick();
+			return STATUS_THREAD_IS_TERMINATING;
+		}
+	}
+}
+
+// a message cut short can't be framed, so give up on the pipe
+NTSTATUS pipe_channel_t::abort_write( pipe_waiter_t& w, NTSTATUS r )
+{
+	if (message_type)
+		broken = true;
+	writers.unlink( &w );
+	kick();
+	return r;
+}
+
+void pipe_channel_t::set_broken()
+{
+	broken = true;
+	kick();
+}
+
+NTSTATUS pipe_channel_t::read( PVOID buffer, ULONG length, ULONG *read, bool message_mode )
+{
+	pipe_waiter_t w( this );
+	unsigned char *p = (unsigned char*) buffer;
+	ULONG len = 0, n;
+	NTSTATUS r;
+
+	readers.append( &w );
+	r = wait_for( readers, w, 1, false );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	if (message_type && message_mode)
+	{
+		// start a new message, unless a byte mode read left part of one
+		if (!msg_left)
+			get( &msg_left, sizeof msg_left );
+
+		// the rest of the message may still be on its way
+		ULONG want = min( length, msg_left );
+		while (len < want)
+		{
+			r = wait_for( readers, w, 1, false );
+			if (r < STATUS_SUCCESS)
+				return r;
+			n = min( want - len, used );
+			r = get_user( p + len, n );
+			if (r < STATUS_SUCCESS)
+				break;
+			len += n;
+			msg_left -= n;
+			kick();
+		}
+		if (r == STATUS_SUCCESS && msg_left)
+			r = STATUS_BUFFER_OVERFLOW;
+	}
+	else
+	{
+		// take whatever is there, ignoring message boundaries
+		while (len < length && used)
+		{
+			if (message_type && !msg_left)
+			{
+				get( &msg_left, sizeof msg_left );
+				continue;
+			}
+			n = min( length - len, used );
+			if (message_type)
+				n = min( n, msg_left );
+			r = get_user( p + len, n );
+			if (r < STATUS_SUCCESS)
+				break;
+			len += n;
+			if (message_type)
+				msg_left -= n;
+		}
+	}
+
+	readers.unlink( &w );
+	kick();
+	*read = len;
+	return r;
+}
+
+NTSTATUS pipe_channel_t::write( PVOID buffer, ULONG length, ULONG *written )
+{
+	pipe_waiter_t w( this );
+	unsigned char *p = (unsigned char*) buffer;
+	ULONG len = 0, n;
+	NTSTATUS r;
+
+	writers.append( &w );
+	if (message_type)
+	{
+		r = wait_for( writers, w, sizeof length, true );
+		if (r < STATUS_SUCCESS)
+			return r;
+		put( &length, sizeof length );
+		kick();
+	}
+
+	// stream the data through the ring, blocking while it's full
+	while (len < length)
+	{
+		r = wait_for( writers, w, 1, true );
+		if (r < STATUS_SUCCESS)
+		{
+			if (w.channel && message_type)
+				set_broken();
+			return r;
+		}
+		n = min( length - len, size - used );
+		r = put_user( p + len, n );
+		if (r < STATUS_SUCCESS)
+			return abort_write( w, r );
+		len += n;
+		kick();
+	}
+
+	writers.unlink( &w );
+	kick();
+	*written = len;
+	return STATUS_SUCCESS;
+}
+
+pipe_container_t::pipe_container_t( ULONG max, bool _message_type ) :
 	num_instances(0),
-	max_instances(max)
+	max_instances(max),
+	message_type(_message_type)
 {
 }
 
 void pipe_container_t::unlink( pipe_server_t *pipe )
 {
+	if (pipe->entry[1].is_linked())
+		idle_servers.unlink( pipe );
 	servers.unlink( pipe );
 	num_instances--;
 }
 
-NTSTATUS pipe_container_t::create_server( pipe_server_t *& pipe, ULONG max_inst )
+NTSTATUS pipe_container_t::create_server( pipe_server_t *& pipe, ULONG max_inst,
+	ULONG in_quota, ULONG out_quota, bool read_mode_message )
 {
 	dprintf("creating pipe server\n");
 	if (max_inst != max_instances)
@@ -346,11 +684,19 @@ NTSTATUS pipe_container_t::create_server( pipe_server_t *& pipe, ULONG max_inst
 		return STATUS_ACCESS_DENIED;
 	num_instances++;
 
-	pipe = new pipe_server_t( this );
+	pipe = new pipe_server_t( this, read_mode_message );
 
 	servers.append( pipe );
 	addref( this );
 
+	if (!pipe->inbound.init( in_quota, message_type ) ||
+		!pipe->outbound.init( out_quota, message_type ))
+	{
+		release( pipe );
+		pipe = 0;
+		return STATUS_NO_MEMORY;
+	}
+
 	return STATUS_SUCCESS;
 }
 
@@ -368,47 +714,57 @@ NTSTATUS pipe_container_t::create_client( pipe_client_t*& client )
 		server->thread = NULL;
 		t->start();
 	}
+	else
+		clients.append( client );
 
 	return STATUS_SUCCESS;
 }
 
+void pipe_container_t::add_idle_server( pipe_server_t *pipe )
+{
+	idle_servers.append( pipe );
+}
+
+void pipe_container_t::remove_idle_server( pipe_server_t *pipe )
+{
+	if (pipe->entry[1].is_linked())
+		idle_servers.unlink( pipe );
+}
+
+void pipe_container_t::remove_client( pipe_client_t *pipe )
+{
+	clients.unlink( pipe );
+}
+
 void pipe_server_t::set_client( pipe_client_t* pipe_client )
 {
 	assert( pipe_client );
 	client = pipe_client;
 	client->server = this;
 	state = pipe_connected;
+	container->remove_idle_server( this );
 	dprintf("connect server %p to client %p\n", this, client );
 }
 
+// servers listening for a connection are kept on their own list
 pipe_server_t* pipe_container_t::find_idle_server()
 {
-	// search for an idle server
-	for (pipe_server_iter_t i(servers); i; i.next())
-	{
-		pipe_server_t *ps = i;
-		if (ps->is_awaiting_connect())
-			return ps;
-	}
-	return NULL;
+	return idle_servers.head();
 }
 
-pipe_server_t::pipe_server_t( pipe_container_t *_container ) :
+pipe_server_t::pipe_server_t( pipe_container_t *_container, bool _read_mode_message ) :
 	container( _container ),
 	state( pipe_idle ),
 	client( NULL ),
-	thread( NULL )
+	thread( NULL ),
+	read_mode_message( _read_mode_message )
 {
 }
 
 pipe_server_t::~pipe_server_t()
 {
-	pipe_message_t *msg;
-	while ((msg = received_messages.head()))
-	{
-		received_messages.unlink( msg );
-		delete msg;
-	}
+	if (client)
+		client->server = NULL;
 	container->unlink( this );
 	release( container );
 }
@@ -422,72 +778,30 @@ NTSTATUS pipe_server_t::open( object_t *&out, open_info_t& info )
 
 NTSTATUS pipe_server_t::read( PVOID buffer, ULONG length, ULONG *read )
 {
-	pipe_message_t *msg;
-
 	// only allow reading in the correct state
 	if (state != pipe_connected)
 		return STATUS_PIPE_BROKEN;
 
-	// only allow one reader at a time
-	if (thread)
-		return STATUS_PIPE_BUSY;
-
-	// get a message
-	msg = received_messages.head();
-	if (!msg)
-	{
-		// wait for a message
-		thread = current;
-		current->wait();
-		if (current->is_terminated())
-			return STATUS_THREAD_IS_TERMINATING;
-		assert( thread == NULL );
-		msg = received_messages.head();
-	}
-
-	ULONG len = 0;
-	if (msg)
-	{
-		len = min( length, msg->Length );
-		NTSTATUS r = copy_to_user( buffer, msg->data_ptr(), len );
-		if (r < STATUS_SUCCESS)
-			return r;
-		received_messages.unlink( msg );
-		delete msg;
-	}
-	*read = len;
-	return STATUS_SUCCESS;
+	return inbound.read( buffer, length, read, read_mode_message );
 }
 
 NTSTATUS pipe_server_t::write( PVOID buffer, ULONG length, ULONG *written )
 {
-	pipe_message_t *msg = pipe_message_t::alloc_pipe_message( length );
-
-	NTSTATUS r;
-	r = copy_from_user( msg->data_ptr(), buffer, length );
-	if (r < STATUS_SUCCESS)
-	{
-		delete msg;
-		return r;
-	}
+	if (state != pipe_connected)
+		return STATUS_PIPE_BROKEN;
 
-	queue_message_to_client( msg );
-	*written = length;
-	return STATUS_SUCCESS;
+	return outbound.write( buffer, length, written );
 }
 
 bool pipe_server_t::do_connect()
 {
-	for (pipe_client_iter_t i( container->get_clients() ); i; i.next())
-	{
-		pipe_client_t *pipe_client = i;
+	pipe_client_t *pipe_client = container->get_clients().head();
+	if (!pipe_client)
+		return false;
 
-		if (pipe_client->server)
-			continue;
-		set_client( pipe_client );
-		return true;
-	}
-	return false;
+	container->remove_client( pipe_client );
+	set_client( pipe_client );
+	return true;
 }
 
 NTSTATUS pipe_server_t::connect()
@@ -500,9 +814,18 @@ NTSTATUS pipe_server_t::connect()
 	if (!is_connected())
 	{
 		thread = current;
+		container->add_idle_server( this );
 		current->wait();
 		if (current->is_terminated())
+		{
+			if (thread == current)
+			{
+				thread = NULL;
+				container->remove_idle_server( this );
+				state = pipe_idle;
+			}
 			return STATUS_THREAD_IS_TERMINATING;
+		}
 		assert( thread == NULL );
 		assert( is_connected() );
 	}
@@ -515,13 +838,24 @@ NTSTATUS pipe_server_t::disconnect()
 	if (state != pipe_connected)
 		return STATUS_PIPE_BROKEN;
 
-	client->server = 0;
+	if (client)
+		client->server = 0;
 	client = 0;
 	state = pipe_disconnected;
+	inbound.set_broken();
+	outbound.set_broken();
 
 	return STATUS_SUCCESS;
 }
 
+// the client end was closed, let the server drain what was sent
+void pipe_server_t::client_closed()
+{
+	client = 0;
+	inbound.set_broken();
+	outbound.set_broken();
+}
+
 NTSTATUS pipe_server_t::fs_control( event_t* event, IO_STATUS_BLOCK iosb, ULONG FsControlCode,
 		 PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength )
 {
@@ -536,96 +870,38 @@ NTSTATUS pipe_server_t::fs_control( event_t* event, IO_STATUS_BLOCK iosb, ULONG
 	return STATUS_NOT_IMPLEMENTED;
 }
 
-void pipe_server_t::queue_message_from_client( pipe_message_t *msg )
-{
-	received_messages.append( msg );
-
-	// wakeup readers
-	assert( state == pipe_connected );
-	if (thread)
-	{
-		thread_t *t = thread;
-		thread = 0;
-		t->start();
-	}
-}
-
-void pipe_server_t::queue_message_to_client( pipe_message_t *msg )
+pipe_client_t::pipe_client_t( pipe_container_t *_container ) :
+	container( _container ),
+	server( NULL ),
+	read_mode_message( false )
 {
-	sent_messages.append( msg );
-	// wakeup readers
-	assert( state == pipe_connected );
-	if (client->thread)
-	{
-		thread_t *t = client->thread;
-		client->thread = 0;
-		t->start();
-	}
+	addref( container );
 }
 
-pipe_client_t::pipe_client_t( pipe_container_t *container ) :
-	server( NULL ),
-	thread( NULL )
+pipe_client_t::~pipe_client_t()
 {
+	if (server)
+		server->client_closed();
+	else if (entry[0].is_linked())
+		container->remove_client( this );
+	release( container );
 }
 
 NTSTATUS pipe_client_t::read( PVOID buffer, ULONG length, ULONG *read )
 {
-	pipe_message_t *msg;
-
 	// only allow reading in the correct state
 	if (server == NULL || server->state != pipe_server_t::pipe_connected)
 		return STATUS_PIPE_BROKEN;
 
-	// only allow one reader at a time
-	if (thread)
-		return STATUS_PIPE_BUSY;
-
-	// get a message
-	msg = server->sent_messages.head();
-	if (!msg)
-	{
-		// wait for a message
-		thread = current;
-		current->wait();
-		if (current->is_terminated())
-			return STATUS_THREAD_IS_TERMINATING;
-		assert( thread == NULL );
-		msg = server->sent_messages.head();
-	}
-
-	ULONG len = 0;
-	if (msg)
-	{
-		len = min( length, msg->Length );
-		NTSTATUS r = copy_to_user( buffer, msg->data_ptr(), len );
-		if (r < STATUS_SUCCESS)
-			return r;
-		server->sent_messages.unlink( msg );
-		delete msg;
-	}
-	*read = len;
-	return STATUS_SUCCESS;
+	return server->outbound.read( buffer, length, read, read_mode_message );
 }
 
 NTSTATUS pipe_client_t::write( PVOID buffer, ULONG length, ULONG *written )
 {
-	pipe_message_t *msg = pipe_message_t::alloc_pipe_message( length );
-
 	if (server == NULL || server->state != pipe_server_t::pipe_connected)
 		return STATUS_PIPE_BROKEN;
 
-	NTSTATUS r;
-	r = copy_from_user( msg->data_ptr(), buffer, length );
-	if (r < STATUS_SUCCESS)
-	{
-		delete msg;
-		return r;
-	}
-
-	server->queue_message_from_client( msg );
-	*written = length;
-	return STATUS_SUCCESS;
+	return server->inbound.write( buffer, length, written );
 }
 
 NTSTATUS pipe_client_t::fs_control( event_t* event, IO_STATUS_BLOCK iosb, ULONG FsControlCode,
@@ -659,11 +935,19 @@ NTSTATUS pipe_client_t::transceive(
 NTSTATUS pipe_client_t::set_pipe_info( FILE_PIPE_INFORMATION& pipe_info )
 {
 	dprintf("%ld %ld\n", pipe_info.ReadModeMessage, pipe_info.WaitModeBlocking);
+	if (pipe_info.ReadModeMessage && !container->is_message_type())
+		return STATUS_INVALID_PARAMETER;
+	read_mode_message = pipe_info.ReadModeMessage;
 	return STATUS_SUCCESS;
 }
 
-pipe_factory::pipe_factory( ULONG _MaxInstances ) :
-	MaxInstances( _MaxInstances )
+pipe_factory::pipe_factory( ULONG _MaxInstances, ULONG _InBufferSize, ULONG _OutBufferSize,
+	bool _TypeMessage, bool _ReadModeMessage ) :
+	MaxInstances( _MaxInstances ),
+	InBufferSize( _InBufferSize ),
+	OutBufferSize( _OutBufferSize ),
+	TypeMessage( _TypeMessage ),
+	ReadModeMessage( _ReadModeMessage )
 {
 }
 
@@ -681,7 +965,7 @@ NTSTATUS pipe_factory::on_open( object_dir_t* dir, object_t*& obj, open_info_t&
 	pipe_container_t *container = 0;
 	if (!obj)
 	{
-		container = new pipe_container_t( MaxInstances );
+		container = new pipe_container_t( MaxInstances, TypeMessage );
 		if (!container)
 			return STATUS_NO_MEMORY;
 
@@ -701,7 +985,8 @@ NTSTATUS pipe_factory::on_open( object_dir_t* dir, object_t*& obj, open_info_t&
 	assert( container );
 
 	pipe_server_t *pipe = 0;
-	r = container->create_server( pipe, MaxInstances );
+	r = container->create_server( pipe, MaxInstances,
+		InBufferSize, OutBufferSize, ReadModeMessage );
 	if (r == STATUS_SUCCESS)
 		obj = pipe;
 
@@ -757,7 +1042,8 @@ NTSTATUS NTAPI NtCreateNamedPipeFile(
 	if (r < STATUS_SUCCESS)
 		return r;
 
-	pipe_factory factory( MaxInstances );
+	pipe_factory factory( MaxInstances, InBufferSize, OutBufferSize,
+		TypeMessage, ReadModeMessage );
 
 	return factory.create( PipeHandle, AccessMask, ObjectAttributes );
 }
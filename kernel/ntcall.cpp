@@ -33,15 +33,40 @@
 #include "mem.h"
 #include "ntcall.h"
 #include "timer.h"
+#include "syscall_log.h"
 
 NTSTATUS copy_to_user( void *dest, const void *src, size_t len )
 {
-	return current->copy_to_user( dest, src, len );
+	NTSTATUS r = current->copy_to_user( dest, src, len );
+	if (syscall_recording && r == STATUS_SUCCESS)
+		syscall_log_copy( syscall_copy_write, dest, src, len );
+	return r;
 }
 
 NTSTATUS copy_from_user( void *dest, const void *src, size_t len )
 {
-	return current->copy_from_user( dest, src, len );
+	NTSTATUS r = current->copy_from_user( dest, src, len );
+	if (syscall_recording && r == STATUS_SUCCESS)
+		syscall_log_copy( syscall_copy_read, src, dest, len );
+	return r;
+}
+
+NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count )
+{
+	NTSTATUS r = current->copy_to_user_v( iov, count );
+	if (syscall_recording && r == STATUS_SUCCESS)
+		for (ULONG i=0; i<count; i++)
+			syscall_log_copy( syscall_copy_write, iov[i].user, iov[i].kernel, iov[i].len );
+	return r;
+}
+
+NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count )
+{
+	NTSTATUS r = current->copy_from_user_v( iov, count );
+	if (syscall_recording && r == STATUS_SUCCESS)
+		for (ULONG i=0; i<count; i++)
+			syscall_log_copy( syscall_copy_read, iov[i].user, iov[i].kernel, iov[i].len );
+	return r;
 }
 
 NTSTATUS verify_for_write( void *dest, size_t len )
@@ -310,7 +335,8 @@ NTSTATUS NTAPI NtQueryPerformanceCounter(
 	LARGE_INTEGER now = timeout_t::current_time();
 	LARGE_INTEGER freq;
 	NTSTATUS r;
-	freq.QuadPart = 1000LL;
+	// the count is in 100ns units
+	freq.QuadPart = 10000000LL;
 	r = copy_to_user( PerformanceCount, &now, sizeof now );
 	if (r < STATUS_SUCCESS)
 		return r;
@@ -25,6 +25,11 @@
 
 void init_syscalls(bool xp);
 NTSTATUS do_nt_syscall(ULONG id, ULONG func, ULONG *uargs, ULONG retaddr);
+ULONGLONG stats_clock();
+void syscall_stats_stop( ULONGLONG ns );
+void syscall_stats_resume( ULONGLONG ns );
+void dump_syscall_stats();
+void check_syscall_stats();
 NTSTATUS copy_to_user( void *dest, const void *src, size_t len );
 NTSTATUS copy_from_user( void *dest, const void *src, size_t len );
 NTSTATUS verify_for_write( void *dest, size_t len );
@@ -59,6 +64,10 @@ extern process_list_t processes;
 ULONG allocate_id();
 extern object_t *ntdll_section;
 
+// copy several buffers to or from the current thread in one pass
+NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count );
+NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count );
+
 NTSTATUS copy_oa_from_user( OBJECT_ATTRIBUTES *koa, UNICODE_STRING *kus, const OBJECT_ATTRIBUTES *uoa );
 void free_oa( OBJECT_ATTRIBUTES *oa );
 void free_us( UNICODE_STRING *us );
@@ -88,6 +97,7 @@ extern int& option_trace;
 bool trace_is_enabled( const char *name );
 
 extern ULONG KiIntSystemCall;
+extern bool use_sysemu;
 
 class sleeper_t
 {
@@ -103,6 +113,15 @@ extern sleeper_t* sleeper;
 // from section.cpp
 const char *get_section_symbol( object_t *section, ULONG address );
 
+// from profile.cpp
+void profile_sample( process_t *process, ULONG eip );
+void profile_limit_slice( LARGE_INTEGER& timeout );
+
+// from atom.cpp
+NTSTATUS add_atom( const UNICODE_STRING& name, USHORT& atom );
+NTSTATUS find_atom( const UNICODE_STRING& name, USHORT& atom );
+NTSTATUS delete_atom( USHORT atom );
+
 // from random.cpp
 void init_random();
 
@@ -878,10 +878,18 @@ ATOM NTAPI NtUserRegisterClassExWOW(
 
 	dprintf("window class = %pus  menu = %pus\n", &clsstr, &menuname);
 
-	static ATOM atom = 0xc001;
+	// class names share the global atom table
+	USHORT atom = 0;
+	r = add_atom( clsstr, atom );
+	if (r < STATUS_SUCCESS)
+		return 0;
+
 	wndcls_tt* cls = new wndcls_tt( clsinfo, clsstr, menuname, atom );
 	if (!cls)
+	{
+		delete_atom( atom );
 		return 0;
+	}
 
 	wndcls_list.append( cls );
 
@@ -21,6 +21,8 @@
 
 #include <stdarg.h>
 #include <assert.h>
+#include <ctype.h>
+#include <typeinfo>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -49,13 +51,178 @@ void object_dir_t::set_obj_parent( object_t *child, object_dir_t *dir )
 	child->parent = dir;
 }
 
-object_dir_impl_t::object_dir_impl_t()
+// case insensitive, so names that compare equal either way hash the same
+static ULONG hash_name( const UNICODE_STRING& name )
+{
+	ULONG hash = 0;
+	for (ULONG i = 0; i < name.Length/2; i++)
+		hash = hash * 31 + tolower( name.Buffer[i] );
+	return hash;
+}
+
+// Caches the directories leading up to the last segment of absolute
+// paths, so repeated opens of \BaseNamedObjects\foo don't walk from
+// the root.  Only the leading run of plain directories is skipped, so
+// symlinks and devices further along are still opened normally.  The
+// whole cache is dropped when any directory is unlinked or destroyed.
+class path_cache_entry_t;
+
+typedef list_anchor<path_cache_entry_t, 0> path_cache_list_t;
+typedef list_element<path_cache_entry_t> path_cache_element_t;
+typedef list_iter<path_cache_entry_t, 0> path_cache_iter_t;
+
+class path_cache_entry_t
+{
+public:
+	path_cache_element_t entry[1];
+	unicode_string_t path;
+	bool ignore_case;
+	ULONG skip;
+	object_dir_impl_t *dir;
+};
+
+class path_cache_t
+{
+	static const ULONG num_buckets = 64;
+	static const ULONG max_entries = 256;
+	path_cache_list_t buckets[num_buckets];
+	ULONG num_entries;
+	object_dir_impl_t *resolve( UNICODE_STRING& prefix, bool ignore_case, ULONG& skip );
+public:
+	path_cache_t();
+	object_dir_impl_t *lookup( UNICODE_STRING& path, bool ignore_case );
+	void flush();
+};
+
+static path_cache_t path_cache;
+
+path_cache_t::path_cache_t() :
+	num_entries( 0 )
+{
+}
+
+void path_cache_t::flush()
+{
+	if (!num_entries)
+		return;
+	for (ULONG i = 0; i < num_buckets; i++)
+	{
+		while (!buckets[i].empty())
+		{
+			path_cache_entry_t *ent = buckets[i].head();
+			buckets[i].unlink( ent );
+			delete ent;
+		}
+	}
+	num_entries = 0;
+}
+
+// walk the prefix from the root through plain directories,
+// returning the last one reached and how many characters lead to it
+object_dir_impl_t *path_cache_t::resolve( UNICODE_STRING& prefix, bool ignore_case, ULONG& skip )
+{
+	object_dir_impl_t *dir = root;
+	ULONG n = 0;
+
+	skip = 0;
+	while (n < prefix.Length/2)
+	{
+		UNICODE_STRING segment;
+		segment.Buffer = prefix.Buffer + n;
+		segment.Length = 0;
+		segment.MaximumLength = 0;
+		while (n < prefix.Length/2 && prefix.Buffer[n] != '\\')
+		{
+			segment.Length += 2;
+			n++;
+		}
+		n++;
+
+		if (!segment.Length)
+			return 0;
+
+		object_t *obj = dir->lookup( segment, ignore_case );
+		if (!obj)
+			return 0;
+		if (typeid(*obj) != typeid(object_dir_impl_t))
+			break;
+		dir = dynamic_cast<object_dir_impl_t*>( obj );
+		skip = n;
+	}
+	return skip ? dir : 0;
+}
+
+// on success, strips the cached leading directories from path
+object_dir_impl_t *path_cache_t::lookup( UNICODE_STRING& path, bool ignore_case )
+{
+	ULONG n = path.Length/2;
+	while (n > 0 && path.Buffer[n - 1] != '\\')
+		n--;
+	if (n < 2)
+		return 0;
+
+	UNICODE_STRING prefix;
+	prefix.Buffer = path.Buffer;
+	prefix.Length = (n - 1) * 2;
+	prefix.MaximumLength = 0;
+
+	path_cache_list_t& bucket = buckets[hash_name( prefix ) % num_buckets];
+	path_cache_entry_t *ent = 0;
+	for (path_cache_iter_t i(bucket); i; i.next())
+	{
+		path_cache_entry_t *e = i;
+		if (e->ignore_case == ignore_case && e->path.compare( &prefix, ignore_case ))
+		{
+			ent = e;
+			break;
+		}
+	}
+
+	if (!ent)
+	{
+		ULONG skip;
+		object_dir_impl_t *dir = resolve( prefix, ignore_case, skip );
+		if (!dir)
+			return 0;
+
+		if (num_entries >= max_entries)
+			flush();
+
+		ent = new path_cache_entry_t;
+		if (!ent)
+			return 0;
+		if (ent->path.copy( &prefix ) < STATUS_SUCCESS)
+		{
+			delete ent;
+			return 0;
+		}
+		ent->ignore_case = ignore_case;
+		ent->skip = skip;
+		ent->dir = dir;
+		bucket.append( ent );
+		num_entries++;
+	}
+
+	n = ent->skip;
+	path.Buffer += n;
+	path.Length -= n * 2;
+	if (path.MaximumLength >= n * 2)
+		path.MaximumLength -= n * 2;
+
+	return ent->dir;
+}
+
+object_dir_impl_t::object_dir_impl_t() :
+	buckets( 0 ),
+	num_buckets( 0 ),
+	num_objects( 0 )
 {
 }
 
 object_dir_impl_t::~object_dir_impl_t()
 {
 	//dprintf("destroying directory %pus\n", &name );
+	path_cache.flush();
 	object_iter_t i(object_list);
 	while( i )
 	{
@@ -63,12 +230,42 @@ object_dir_impl_t::~object_dir_impl_t()
 		i.next();
 		unlink( obj );
 	}
+	delete[] buckets;
+}
+
+object_bucket_t& object_dir_impl_t::bucket_for( UNICODE_STRING& name )
+{
+	return buckets[hash_name( name ) % num_buckets];
+}
+
+void object_dir_impl_t::rehash( ULONG count )
+{
+	object_bucket_t *old = buckets;
+	ULONG old_count = num_buckets;
+
+	buckets = new object_bucket_t[count];
+	num_buckets = count;
+
+	// relink in list order, so the first of any duplicates is still found first
+	for (object_iter_t i(object_list); i; i.next())
+	{
+		object_t *obj = i;
+		if (old)
+			old[hash_name( obj->get_name() ) % old_count].unlink( obj );
+		bucket_for( obj->get_name() ).append( obj );
+	}
+	delete[] old;
 }
 
 void object_dir_impl_t::unlink( object_t *obj )
 {
 	assert( obj );
+	// a directory going away invalidates any cached path through it
+	if (dynamic_cast<object_dir_t*>( obj ))
+		path_cache.flush();
+	bucket_for( obj->get_name() ).unlink( obj );
 	object_list.unlink( obj );
+	num_objects--;
 	set_obj_parent( obj, 0 );
 }
 
@@ -76,6 +273,11 @@ void object_dir_impl_t::append( object_t *obj )
 {
 	assert( obj );
 	object_list.append( obj );
+	num_objects++;
+	if (num_objects > num_buckets * 2)
+		rehash( num_buckets ? num_buckets * 4 : 16 );
+	else
+		bucket_for( obj->get_name() ).append( obj );
 	set_obj_parent( obj, this );
 }
 
@@ -90,7 +292,9 @@ bool object_dir_impl_t::access_allowed( ACCESS_MASK required, ACCESS_MASK handle
 object_t *object_dir_impl_t::lookup( UNICODE_STRING& name, bool ignore_case )
 {
 	//dprintf("searching for %pus\n", &name );
-	for( object_iter_t i(object_list); i; i.next() )
+	if (!num_buckets)
+		return 0;
+	for( object_bucket_iter_t i(bucket_for( name )); i; i.next() )
 	{
 		object_t *obj = i;
 		unicode_string_t& entry_name  = obj->get_name();
@@ -171,6 +375,10 @@ NTSTATUS open_root( object_t*& obj, open_info_t& info )
 		dir = root;
 		info.path.Buffer++;
 		info.path.Length -= 2;
+
+		object_dir_impl_t *cached = path_cache.lookup( info.path, info.case_insensitive() );
+		if (cached)
+			dir = cached;
 	}
 
 	if (info.path.Length == 0)
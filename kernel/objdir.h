@@ -39,6 +39,11 @@ public:
 class object_dir_impl_t : public object_dir_t
 {
 	object_list_t object_list;
+	object_bucket_t *buckets;
+	ULONG num_buckets;
+	ULONG num_objects;
+	object_bucket_t& bucket_for( UNICODE_STRING& name );
+	void rehash( ULONG count );
 public:
 	object_dir_impl_t();
 	virtual ~object_dir_impl_t();
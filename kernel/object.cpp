@@ -26,6 +26,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -77,55 +78,122 @@ NTSTATUS object_t::open( object_t *&out, open_info_t& info )
 	return STATUS_SUCCESS;
 }
 
+handle_table_t::handle_table_t() :
+	blocks(0),
+	num_blocks(0),
+	free_list(0),
+	num_handles(0)
+{
+}
+
+// NT handles are the index shifted left by two.
+// The low two bits are tag bits available to the application.
 HANDLE handle_table_t::index_to_handle( ULONG index )
 {
-	return (HANDLE)((index+1)*4);
+	return (HANDLE)(index << 2);
 }
 
 ULONG handle_table_t::handle_to_index( HANDLE handle )
 {
-	return ((ULONG)handle)/4 - 1;
+	return ((ULONG)handle) >> 2;
 }
 
-HANDLE handle_table_t::alloc_handle( object_t *obj, ACCESS_MASK access )
+object_info_t *handle_table_t::get_entry( ULONG index )
+{
+	ULONG n = index / entries_per_block;
+	if (!index || n >= num_blocks || !blocks[n])
+		return NULL;
+	return &blocks[n][index % entries_per_block];
+}
+
+// add a block of entries to the end of the table
+bool handle_table_t::grow()
 {
-	ULONG i;
+	ULONG n = 0;
+	while (n < num_blocks && blocks[n])
+		n++;
 
-	for (i=0; i<max_handles; i++)
+	if (n == num_blocks)
 	{
-		if (!info[i].object)
+		if (num_blocks == max_blocks)
+			return false;
+		ULONG count = num_blocks ? num_blocks*2 : 1;
+		object_info_t **b = new object_info_t*[count];
+		if (!b)
+			return false;
+		memset( b, 0, count * sizeof b[0] );
+		if (blocks)
 		{
-			info[i].object = obj;
-			info[i].access = access;
-			addref( obj );
-			return index_to_handle( i );
+			memcpy( b, blocks, num_blocks * sizeof b[0] );
+			delete[] blocks;
 		}
+		blocks = b;
+		num_blocks = count;
 	}
-	return 0;
+
+	object_info_t *block = new object_info_t[entries_per_block];
+	if (!block)
+		return false;
+	memset( block, 0, entries_per_block * sizeof block[0] );
+	blocks[n] = block;
+	chain_block( n );
+	return true;
+}
+
+// push a block's entries onto the free list,
+// in reverse so the lowest handles are handed out first
+void handle_table_t::chain_block( ULONG n )
+{
+	object_info_t *block = blocks[n];
+	for (ULONG i = entries_per_block; i > 0; i--)
+	{
+		ULONG index = n * entries_per_block + i - 1;
+		if (!index)
+			continue;
+		block[i - 1].next_free = free_list;
+		free_list = index;
+	}
+}
+
+HANDLE handle_table_t::alloc_handle( object_t *obj, ACCESS_MASK access )
+{
+	if (!free_list && !grow())
+		return 0;
+
+	ULONG index = free_list;
+	object_info_t *entry = get_entry( index );
+	assert( entry && !entry->object );
+	free_list = entry->next_free;
+
+	entry->object = obj;
+	entry->access = access;
+	addref( obj );
+	num_handles++;
+	return index_to_handle( index );
 }
 
 NTSTATUS handle_table_t::free_handle( HANDLE handle )
 {
+	object_info_t *entry;
 	object_t *obj;
 	ULONG n;
 
-	n = (ULONG) handle;
-	if (!n)
-		return STATUS_INVALID_HANDLE;
-	if (n&3)
-		return STATUS_INVALID_HANDLE;
-
 	n = handle_to_index( handle );
-	if (n >= max_handles)
+	entry = get_entry( n );
+	if (!entry)
 		return STATUS_INVALID_HANDLE;
 
-	obj = info[n].object;
+	obj = entry->object;
 	if (!obj)
 		return STATUS_INVALID_HANDLE;
 
+	// the most recently closed handle is the next to be reused
+	entry->object = NULL;
+	entry->next_free = free_list;
+	free_list = n;
+	num_handles--;
+
 	release( obj );
-	info[n].object = NULL;
-	info[n].access = 0;
 
 	return STATUS_SUCCESS;
 }
@@ -142,41 +210,46 @@ NTSTATUS handle_table_t::object_from_handle( object_t*& obj, HANDLE handle, ACCE
 		obj = current->process;
 		return STATUS_SUCCESS;
 	}
-	ULONG n = (ULONG) handle;
-	if (!n)
-		return STATUS_INVALID_HANDLE;
-	if (n&3)
-		return STATUS_INVALID_HANDLE;
-	n = handle_to_index( handle );
-	if (n >= max_handles)
-		return STATUS_INVALID_HANDLE;
-	if (!info[n].object)
+	object_info_t *entry = get_entry( handle_to_index( handle ) );
+	if (!entry || !entry->object)
 		return STATUS_INVALID_HANDLE;
-	if (!info[n].object->access_allowed( access, info[n].access ))
+	if (!entry->object->access_allowed( access, entry->access ))
 		return STATUS_ACCESS_DENIED;
-	obj = info[n].object;
+	obj = entry->object;
 	return STATUS_SUCCESS;
 }
 
 handle_table_t::~handle_table_t()
 {
 	free_all_handles();
+	for (ULONG i = 0; i < num_blocks; i++)
+		delete[] blocks[i];
+	delete[] blocks;
 }
 
 void handle_table_t::free_all_handles()
 {
-	object_t *obj;
-	ULONG i;
-
-	for ( i=0; i<max_handles; i++ )
+	for (ULONG n = 0; n < num_blocks; n++)
 	{
-		obj = info[i].object;
-		if (!obj)
+		object_info_t *block = blocks[n];
+		if (!block)
 			continue;
-
-		release( obj );
-		info[i].object = NULL;
+		for (ULONG i = 0; i < entries_per_block; i++)
+		{
+			object_t *obj = block[i].object;
+			if (!obj)
+				continue;
+			block[i].object = NULL;
+			release( obj );
+		}
 	}
+
+	// rebuild the free list so handles start from the bottom again
+	free_list = 0;
+	num_handles = 0;
+	for (ULONG n = num_blocks; n > 0; n--)
+		if (blocks[n - 1])
+			chain_block( n - 1 );
 }
 
 NTSTATUS object_factory::on_open( object_dir_t* dir, object_t*& obj, open_info_t& info )
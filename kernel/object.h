@@ -30,6 +30,8 @@ class object_dir_t;
 typedef list_anchor<object_t, 0> object_list_t;
 typedef list_element<object_t> object_entry_t;
 typedef list_iter<object_t, 0> object_iter_t;
+typedef list_anchor<object_t, 1> object_bucket_t;
+typedef list_iter<object_t, 1> object_bucket_iter_t;
 
 class object_factory;
 class open_info_t;
@@ -50,7 +52,9 @@ class object_t {
 	friend class list_anchor<object_t, 0>;
 	friend class list_element<object_t>;
 	friend class list_iter<object_t, 0>;
-	object_entry_t entry[1];
+	friend class list_anchor<object_t, 1>;
+	friend class list_iter<object_t, 1>;
+	object_entry_t entry[2];
 	ULONG refcount;
 public:
 	ULONG attr;
@@ -112,23 +116,38 @@ public:
 class object_info_t {
 public:
 	object_t *object;
-	ACCESS_MASK access;
+	union {
+		ACCESS_MASK access;	// when object is set
+		ULONG next_free;	// index of the next free entry otherwise
+	};
 };
 
+// Handles are kept in blocks of entries_per_block, found through a
+// directory of blocks that doubles as it fills.  Free entries are
+// chained through next_free, so allocating and freeing are O(1).
+// Entry 0 is never used, so a handle value of zero is always invalid.
 class handle_table_t {
-	static const unsigned int max_handles = 0x100;
+	static const ULONG entries_per_block = 0x100;
+	static const ULONG max_blocks = 0x10000;
 
-	//int num_objects;
-	object_info_t info[max_handles];
+	object_info_t **blocks;
+	ULONG num_blocks;
+	ULONG free_list;
+	ULONG num_handles;
 protected:
 	static HANDLE index_to_handle( ULONG index );
 	static ULONG handle_to_index( HANDLE handle );
+	object_info_t *get_entry( ULONG index );
+	bool grow();
+	void chain_block( ULONG n );
 public:
+	handle_table_t();
 	~handle_table_t();
 	void free_all_handles();
 	HANDLE alloc_handle( object_t *obj, ACCESS_MASK access );
 	NTSTATUS free_handle( HANDLE handle );
 	NTSTATUS object_from_handle( object_t*& obj, HANDLE handle, ACCESS_MASK access );
+	ULONG count() { return num_handles; }
 };
 
 static inline void addref( object_t *obj )
@@ -33,28 +33,38 @@
 #include "ntcall.h"
 #include "section.h"
 #include "object.inl"
+#include "slab.h"
 
 class message_t;
 
+static slab_t message_slab( "message_t" );
+
 typedef list_anchor<message_t, 0> message_list_t;
 typedef list_element<message_t> message_entry_t;
 typedef list_iter<message_t, 0> message_iter_t;
+typedef list_anchor<message_t, 1> connect_request_list_t;
 
 class message_t {
 public:
 	ULONG destination_id;
+	// when set, the data is in this section rather than in req.Data
+	section_t *payload_section;
+	ULONG payload_offset;
 protected:
 	friend class list_anchor<message_t, 0>;
 	friend class list_iter<message_t, 0>;
-	message_entry_t entry[1];
+	friend class list_anchor<message_t, 1>;
+	message_entry_t entry[2];
 public:
 	void *operator new(size_t n, size_t len);
 	void operator delete(void* ptr);
 	explicit message_t();
 	bool is_linked() { return entry[0].is_linked(); }
+	bool is_connect_request_linked() { return entry[1].is_linked(); }
 	~message_t();
 	void dump();
 	const char* msg_type();
+	BYTE *data();
 public:
 	LPC_MESSAGE req;
 };
@@ -79,15 +89,24 @@ public:
 };
 
 struct port_queue_t : public object_t {
+	static const ULONG num_reply_buckets = 32;
 	ULONG refs;
 	ULONG max_connect;
 	ULONG max_data;
 	message_list_t messages;
+	connect_request_list_t connect_requests;
 	listener_list_t listeners;
+	// threads waiting for a reply, hashed by message id
+	listener_list_t reply_listeners[num_reply_buckets];
 public:
 	explicit port_queue_t( ULONG max_connect, ULONG max_data );
 	~port_queue_t();
 	message_t *find_connection_request();
+	void append_message( message_t *msg );
+	void unlink_message( message_t *msg );
+	void add_listener( listener_t *l );
+	void remove_listener( listener_t *l );
+	listener_t *find_reply_listener( ULONG message_id );
 };
 
 struct port_t : public object_t {
@@ -124,16 +143,18 @@ static int unique_message_id = 0x101;
 
 void *message_t::operator new(size_t msg_size, size_t extra)
 {
-	return new unsigned char[msg_size + extra];
+	return message_slab.alloc( msg_size + extra );
 }
 
 void message_t::operator delete(void* ptr)
 {
-	delete[] (unsigned char*) ptr;
+	message_slab.free( ptr );
 }
 
 message_t::message_t() :
-	destination_id(0)
+	destination_id(0),
+	payload_section(0),
+	payload_offset(0)
 {
 	memset( &req, 0, sizeof req );
 }
@@ -141,13 +162,16 @@ message_t::message_t() :
 message_t::~message_t()
 {
 	assert( !is_linked() );
+	assert( !is_connect_request_linked() );
+	if (payload_section)
+		release( payload_section );
 }
 
-void unlink_and_free_message( message_list_t *list, message_t *msg )
+BYTE *message_t::data()
 {
-	assert( msg->is_linked() );
-	list->unlink( msg );
-	delete msg;
+	if (payload_section)
+		return (BYTE*) payload_section->get_kernel_address() + payload_offset;
+	return req.Data;
 }
 
 void msg_free_unlinked( message_t *msg )
@@ -192,7 +216,7 @@ void message_t::dump()
 			 (int)req.ClientId.UniqueProcess, (int)req.ClientId.UniqueThread);
 	dprintf("MessageId   = %ld\n", req.MessageId);
 	dprintf("SectionSize = %08lx\n", req.SectionSize);
-	dump_mem(&req.Data, req.DataSize);
+	dump_mem(data(), req.DataSize);
 }
 
 port_t *port_from_obj( object_t *obj )
@@ -305,17 +329,63 @@ listener_t::listener_t(port_t *p, thread_t *t, BOOLEAN connect, ULONG id) :
 	message_id(id)
 {
 	addref( t );
-	port->queue->listeners.append( this );
+	port->queue->add_listener( this );
 }
 
 listener_t::~listener_t()
 {
 	// maybe still linked if the thread was terminated
 	if (is_linked())
-		port->queue->listeners.unlink( this );
+		port->queue->remove_listener( this );
 	release( thread );
 }
 
+static inline ULONG reply_bucket( ULONG message_id )
+{
+	return message_id % port_queue_t::num_reply_buckets;
+}
+
+void port_queue_t::add_listener( listener_t *l )
+{
+	if (l->message_id)
+		reply_listeners[reply_bucket( l->message_id )].append( l );
+	else
+		listeners.append( l );
+}
+
+void port_queue_t::remove_listener( listener_t *l )
+{
+	if (l->message_id)
+		reply_listeners[reply_bucket( l->message_id )].unlink( l );
+	else
+		listeners.unlink( l );
+}
+
+listener_t *port_queue_t::find_reply_listener( ULONG message_id )
+{
+	for (listener_iter_t i(reply_listeners[reply_bucket( message_id )]); i; i.next())
+	{
+		listener_t *l = i;
+		if (l->message_id == message_id)
+			return l;
+	}
+	return 0;
+}
+
+void port_queue_t::append_message( message_t *msg )
+{
+	messages.append( msg );
+	if (msg->req.MessageType == LPC_CONNECTION_REQUEST)
+		connect_requests.append( msg );
+}
+
+void port_queue_t::unlink_message( message_t *msg )
+{
+	messages.unlink( msg );
+	if (msg->is_connect_request_linked())
+		connect_requests.unlink( msg );
+}
+
 static inline ULONG round_up( ULONG len )
 {
 	return (len + 3) & ~3;
@@ -352,9 +422,69 @@ NTSTATUS copy_msg_from_user( message_t **message, LPC_MESSAGE *Reply, ULONG max_
 	return r;
 }
 
+// Large requests already sitting in the sender's view of its port
+// section are not copied into the message.  The message carries the
+// section and offset instead, and the receiver copies straight out
+// of the section.  Only used when the sender blocks for the reply,
+// so the sender can't reuse the buffer before it is read.  Clients like
+// csrss's that keep only a capture buffer in the section and the
+// message itself elsewhere don't take this path; their capture
+// buffer is already shared through the view.
+static const ULONG section_payload_threshold = 0x80;
+
+NTSTATUS port_msg_from_section( port_t *port, message_t **message, LPC_MESSAGE *Request )
+{
+	LPC_MESSAGE hdr;
+	NTSTATUS r;
+
+	if (!port->section || !port->our_section_base)
+		return STATUS_UNSUCCESSFUL;
+
+	BYTE *start = (BYTE*) Request;
+	if (start < port->our_section_base)
+		return STATUS_UNSUCCESSFUL;
+	ULONG ofs = start - port->our_section_base;
+	if (ofs >= port->view_size || ofs >= port->section->len)
+		return STATUS_UNSUCCESSFUL;
+
+	r = copy_from_user( &hdr, Request, sizeof hdr );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	if (hdr.DataSize < section_payload_threshold)
+		return STATUS_UNSUCCESSFUL;
+	if (hdr.DataSize > port->queue->max_data)
+		return STATUS_INVALID_PARAMETER;
+	if (hdr.MessageSize > port->queue->max_data)
+		return STATUS_PORT_MESSAGE_TOO_LONG;
+
+	ULONG data_ofs = ofs + FIELD_OFFSET( LPC_MESSAGE, Data );
+	ULONG end = data_ofs + round_up( hdr.DataSize );
+	if (end > port->view_size || end > port->section->len)
+		return STATUS_UNSUCCESSFUL;
+
+	message_t *msg = new(0) message_t;
+	if (!msg)
+		return STATUS_NO_MEMORY;
+
+	memcpy( &msg->req, &hdr, FIELD_OFFSET( LPC_MESSAGE, Data ) );
+	addref( port->section );
+	msg->payload_section = port->section;
+	msg->payload_offset = data_ofs;
+	*message = msg;
+
+	return STATUS_SUCCESS;
+}
+
 NTSTATUS copy_msg_to_user( LPC_MESSAGE *addr, message_t *msg )
 {
-	return copy_to_user( addr, &msg->req, round_up(msg->req.MessageSize) );
+	if (!msg->payload_section)
+		return copy_to_user( addr, &msg->req, round_up(msg->req.MessageSize) );
+
+	NTSTATUS r = copy_to_user( addr, &msg->req, FIELD_OFFSET( LPC_MESSAGE, Data ) );
+	if (r < STATUS_SUCCESS)
+		return r;
+	return copy_to_user( &addr->Data[0], msg->data(), round_up(msg->req.DataSize) );
 }
 
 port_queue_t::~port_queue_t()
@@ -364,7 +494,10 @@ port_queue_t::~port_queue_t()
 	//dprintf("%p\n", this);
 
 	while ((m = messages.head() ))
-		unlink_and_free_message( &messages, m );
+	{
+		unlink_message( m );
+		delete m;
+	}
 
 	assert( listeners.empty() );
 }
@@ -474,14 +607,7 @@ NTSTATUS create_named_port(
 
 message_t *port_queue_t::find_connection_request()
 {
-	// check for existing connect requests
-	for ( message_iter_t i(messages); i ; i.next() )
-	{
-		message_t *msg = i;
-		if (msg->req.MessageType == LPC_CONNECTION_REQUEST)
-			return msg;
-	}
-	return 0;
+	return connect_requests.head();
 }
 
 NTSTATUS port_t::send_reply( message_t *reply )
@@ -491,22 +617,14 @@ NTSTATUS port_t::send_reply( message_t *reply )
 
 	reply->dump();
 
-	for (listener_iter_t i(queue->listeners); i; i.next())
-	{
-		listener_t *l = i;
-
-		if (l->want_connect)
-			continue;
+	listener_t *l = queue->find_reply_listener( reply->req.MessageId );
+	if (!l)
+		return STATUS_REPLY_MESSAGE_MISMATCH;
 
-		if (l->message_id == reply->req.MessageId)
-		{
-			l->port->received_msg = reply;
-			queue->listeners.unlink( l );
-			l->thread->start();
-			return STATUS_SUCCESS;
-		}
-	}
-	return STATUS_REPLY_MESSAGE_MISMATCH;
+	l->port->received_msg = reply;
+	queue->remove_listener( l );
+	l->thread->start();
+	return STATUS_SUCCESS;
 }
 
 // Wake a thread that called NtListenPort or NtReplyWaitReceive
@@ -515,13 +633,11 @@ void port_t::send_message( message_t *msg )
 	msg->dump();
 
 	msg->destination_id = identifier;
-	queue->messages.append( msg );
+	queue->append_message( msg );
 
 	for (listener_iter_t i(queue->listeners); i; i.next())
 	{
 		listener_t *l = i;
-		if (l->message_id)
-			continue;
 		if (!l->want_connect || msg->req.MessageType == LPC_CONNECTION_REQUEST)
 		{
 			//dprintf("queue %p has listener %p\n", queue, l->thread);
@@ -547,7 +663,7 @@ void port_t::listen( message_t *&msg )
 		msg = queue->find_connection_request();
 		assert(msg);
 	}
-	queue->messages.unlink(msg);
+	queue->unlink_message(msg);
 }
 
 NTSTATUS connect_port(
@@ -799,7 +915,7 @@ NTSTATUS port_t::reply_wait_receive( message_t *reply, message_t *& received )
 		return STATUS_THREAD_IS_TERMINATING;
 	if (current->is_terminated())
 		return STATUS_THREAD_IS_TERMINATING;
-	queue->messages.unlink(received);
+	queue->unlink_message(received);
 	assert( !received->is_linked() );
 
 	return STATUS_SUCCESS;
@@ -1085,7 +1201,10 @@ NTSTATUS NTAPI NtRequestWaitReplyPort(
 	if (r < STATUS_SUCCESS)
 		return r;
 
-	r = copy_msg_from_user( &msg, Request, port->queue->max_data );
+	// we block until the reply, so large requests can stay in our section
+	r = port_msg_from_section( port, &msg, Request );
+	if (r == STATUS_UNSUCCESSFUL)
+		r = copy_msg_from_user( &msg, Request, port->queue->max_data );
 	if (r < STATUS_SUCCESS)
 		return r;
 
@@ -190,17 +190,29 @@ void kshm_tracer::on_access( mblock *mb, BYTE *address, ULONG eip )
 
 kshm_tracer kshm_trace;
 
+// KiIntSystemCall, but with a Linux system call that PTRACE_SYSEMU stops on
+static const BYTE sysemu_syscall_stub[] = {
+	0x8d, 0x54, 0x24, 0x08,	// lea 8(%esp), %edx
+	0xcd, 0x80,		// int $0x80
+	0xc3,			// ret
+};
+static const ULONG sysemu_syscall_stub_offset = 0x1000;
+
 NTSTATUS get_shared_memory_block( process_t *p )
 {
 	BYTE *shm = NULL;
 	NTSTATUS r;
 	WCHAR ntdir[] = { 'C',':','\\','W','I','N','N','T',0 };
 
+	// only executable if it holds the PTRACE_SYSEMU system call stub
+	bool exec = KiIntSystemCall && use_sysemu;
+
 	if (!shared_section)
 	{
 		LARGE_INTEGER sz;
 		sz.QuadPart = 0x10000;
-		r = create_section( &shared_section, NULL, &sz, SEC_COMMIT, PAGE_READWRITE );
+		r = create_section( &shared_section, NULL, &sz, SEC_COMMIT,
+				exec ? PAGE_EXECUTE_READWRITE : PAGE_READWRITE );
 		if (r < STATUS_SUCCESS)
 			return r;
 
@@ -220,9 +232,18 @@ NTSTATUS get_shared_memory_block( process_t *p )
 		ULONG kisc = (ULONG) p->pntdll + KiIntSystemCall;
 		if (KiIntSystemCall)
 			shared_memory_address->SystemCall = kisc;
+
+		// trap system calls without the SIGSEGV and instruction decoding of int $0x2e
+		if (exec)
+		{
+			BYTE *stub = (BYTE*) shared_memory_address + sysemu_syscall_stub_offset;
+			memcpy( stub, sysemu_syscall_stub, sizeof sysemu_syscall_stub );
+			shared_memory_address->SystemCall = 0x7ffe0000 + sysemu_syscall_stub_offset;
+		}
 	}
 
-	r = shared_section->mapit( p->vm, shm, 0, MEM_COMMIT | MEM_TOP_DOWN, PAGE_READONLY );
+	ULONG prot = exec ? PAGE_EXECUTE_READ : PAGE_READONLY;
+	r = shared_section->mapit( p->vm, shm, 0, MEM_COMMIT | MEM_TOP_DOWN, prot );
 	if (r < STATUS_SUCCESS)
 		return r;
 
@@ -355,7 +376,6 @@ process_t::process_t() :
 {
 	ExitStatus = STATUS_PENDING;
 	id = allocate_id();
-	memset( &handle_table, 0, sizeof handle_table );
 	processes.append( this );
 }
 
@@ -770,6 +790,7 @@ NTSTATUS NTAPI NtQueryInformationProcess(
 		PROCESS_SESSION_INFORMATION session;
 		ULONG hard_error_mode;
 		ULONG execute_flags;
+		ULONG handle_count;
 	} info;
 	ULONG len, sz = 0;
 	NTSTATUS r;
@@ -800,6 +821,10 @@ NTSTATUS NTAPI NtQueryInformationProcess(
 		sz = sizeof info.execute_flags;
 		break;
 
+	case ProcessHandleCount:
+		sz = sizeof info.handle_count;
+		break;
+
 	case ProcessExceptionPort:
 		return STATUS_INVALID_INFO_CLASS;
 
@@ -842,6 +867,10 @@ NTSTATUS NTAPI NtQueryInformationProcess(
 		info.execute_flags = p->execute_flags;
 		break;
 
+	case ProcessHandleCount:
+		info.handle_count = p->handle_table.count();
+		break;
+
 	default:
 		assert(0);
 	}
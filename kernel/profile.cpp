@@ -27,6 +27,130 @@
 #include "winternl.h"
 
 #include "debug.h"
+#include "object.h"
+#include "mem.h"
+#include "ntcall.h"
+#include "process.h"
+#include "object.inl"
+
+// A profile counts how often the program counter of threads in a process
+// (or any process) is seen in each bucket of an address range.
+// Samples are taken when a thread's time slice ends, and the slice is
+// shortened to the profile interval while any profile is running.
+// The counts go straight into the buffer of the process that created it.
+
+#define PROFILE_CONTROL 1
+
+class profile_t;
+
+typedef list_anchor<profile_t, 0> profile_list_t;
+typedef list_element<profile_t> profile_element_t;
+typedef list_iter<profile_t, 0> profile_iter_t;
+
+class profile_t : public object_t
+{
+	friend class list_anchor<profile_t, 0>;
+	friend class list_element<profile_t>;
+	friend class list_iter<profile_t, 0>;
+	profile_element_t entry[1];
+	process_t *owner;
+	process_t *process;
+	ULONG base;
+	ULONG size;
+	ULONG bucket_shift;
+	ULONG *buffer;
+	ULONG buffer_length;
+	bool running;
+public:
+	profile_t( process_t *_owner, process_t *_process, ULONG _base, ULONG _size,
+		ULONG _bucket_shift, ULONG *_buffer, ULONG _buffer_length );
+	~profile_t();
+	NTSTATUS start();
+	NTSTATUS stop();
+	void sample( process_t *p, ULONG eip );
+};
+
+static profile_list_t running_profiles;
+
+// in 100ns units
+static ULONG profile_interval = 100000;
+
+profile_t::profile_t( process_t *_owner, process_t *_process, ULONG _base, ULONG _size,
+		ULONG _bucket_shift, ULONG *_buffer, ULONG _buffer_length ) :
+	owner( _owner ),
+	process( _process ),
+	base( _base ),
+	size( _size ),
+	bucket_shift( _bucket_shift ),
+	buffer( _buffer ),
+	buffer_length( _buffer_length ),
+	running( false )
+{
+	addref( owner );
+	if (process)
+		addref( process );
+}
+
+profile_t::~profile_t()
+{
+	if (running)
+		running_profiles.unlink( this );
+	if (process)
+		release( process );
+	release( owner );
+}
+
+NTSTATUS profile_t::start()
+{
+	if (running)
+		return STATUS_PROFILING_NOT_STOPPED;
+	running_profiles.append( this );
+	running = true;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS profile_t::stop()
+{
+	if (!running)
+		return STATUS_PROFILING_NOT_STARTED;
+	running_profiles.unlink( this );
+	running = false;
+	return STATUS_SUCCESS;
+}
+
+void profile_t::sample( process_t *p, ULONG eip )
+{
+	if (process && process != p)
+		return;
+	if (eip < base || (eip - base) >= size)
+		return;
+
+	// the owner's address space goes away when it exits
+	if (!owner->vm)
+		return;
+
+	ULONG *bucket = buffer + ((eip - base) >> bucket_shift);
+	ULONG count = 0;
+	if (owner->vm->copy_from_user( &count, bucket, sizeof count ) < STATUS_SUCCESS)
+		return;
+	count++;
+	owner->vm->copy_to_user( bucket, &count, sizeof count );
+}
+
+void profile_sample( process_t *process, ULONG eip )
+{
+	for (profile_iter_t i(running_profiles); i; i.next())
+		i.cur()->sample( process, eip );
+}
+
+// shorten a thread's time slice so the profiles get enough samples
+void profile_limit_slice( LARGE_INTEGER& timeout )
+{
+	if (running_profiles.empty())
+		return;
+	if (timeout.QuadPart > profile_interval)
+		timeout.QuadPart = profile_interval;
+}
 
 NTSTATUS NTAPI NtCreateProfile(
 	PHANDLE ProfileHandle,
@@ -39,6 +163,100 @@ NTSTATUS NTAPI NtCreateProfile(
 	KPROFILE_SOURCE Source,
 	ULONG ProcessorMask)
 {
-	dprintf("\n");
-	return STATUS_NOT_IMPLEMENTED;
+	NTSTATUS r;
+
+	dprintf("%p %p %p %08lx %ld %p %08lx %d %08lx\n", ProfileHandle, ProcessHandle,
+		Base, Size, BucketShift, Buffer, BufferLength, Source, ProcessorMask);
+
+	if (Source != ProfileTime)
+		return STATUS_INVALID_PARAMETER;
+
+	if (!Size || BucketShift < 2 || BucketShift > 31)
+		return STATUS_INVALID_PARAMETER;
+
+	if ((ULONG)Buffer & 3)
+		return STATUS_DATATYPE_MISALIGNMENT;
+
+	// one ULONG per bucket
+	ULONG buckets = ((Size - 1) >> BucketShift) + 1;
+	if (BufferLength / sizeof (ULONG) < buckets)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	r = verify_for_write( Buffer, buckets * sizeof (ULONG) );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	// no process means profile everything
+	process_t *process = 0;
+	if (ProcessHandle)
+	{
+		r = process_from_handle( ProcessHandle, &process );
+		if (r < STATUS_SUCCESS)
+			return r;
+	}
+
+	profile_t *profile = new profile_t( current->process, process, (ULONG) Base,
+		Size, BucketShift, Buffer, BufferLength );
+	if (!profile)
+		return STATUS_NO_MEMORY;
+
+	r = alloc_user_handle( profile, PROFILE_CONTROL, ProfileHandle );
+	release( profile );
+
+	return r;
+}
+
+NTSTATUS NTAPI NtStartProfile(
+	HANDLE ProfileHandle)
+{
+	dprintf("%p\n", ProfileHandle);
+
+	profile_t *profile = 0;
+	NTSTATUS r = object_from_handle( profile, ProfileHandle, PROFILE_CONTROL );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	return profile->start();
+}
+
+NTSTATUS NTAPI NtStopProfile(
+	HANDLE ProfileHandle)
+{
+	dprintf("%p\n", ProfileHandle);
+
+	profile_t *profile = 0;
+	NTSTATUS r = object_from_handle( profile, ProfileHandle, PROFILE_CONTROL );
+	if (r < STATUS_SUCCESS)
+		return r;
+
+	return profile->stop();
+}
+
+NTSTATUS NTAPI NtSetIntervalProfile(
+	ULONG Interval,
+	KPROFILE_SOURCE Source)
+{
+	dprintf("%ld %d\n", Interval, Source);
+
+	if (Source != ProfileTime)
+		return STATUS_INVALID_PARAMETER;
+
+	// don't let the slice get shorter than 1ms
+	if (Interval < 10000)
+		Interval = 10000;
+	profile_interval = Interval;
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS NTAPI NtQueryIntervalProfile(
+	KPROFILE_SOURCE Source,
+	PULONG Interval)
+{
+	dprintf("%d %p\n", Source, Interval);
+
+	if (Source != ProfileTime)
+		return STATUS_INVALID_PARAMETER;
+
+	return copy_to_user( Interval, &profile_interval, sizeof profile_interval );
 }
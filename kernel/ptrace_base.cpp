@@ -43,11 +43,13 @@
 #include "winnt.h"
 #include "mem.h"
 #include "thread.h"
+#include "ntcall.h"
 
 #include "ptrace_if.h"
 #include "debug.h"
 #include "platform.h"
 #include "ptrace_base.h"
+#include "event_loop.h"
 
 #define CTX_HAS_CONTROL(flags) ((flags)&1)
 #define CTX_HAS_INTEGER(flags) ((flags)&2)
@@ -57,11 +59,30 @@
 
 #define CTX_HAS_INTEGER_CONTROL_OR_SEGMENTS(flags) ((flags)&7)
 
+ptrace_address_space_impl::ptrace_address_space_impl() :
+	regs_cached( false ),
+	cached_teb( 0 ),
+	cached_fs( 0 )
+{
+}
+
+// call when something else has run in the child, or it's been switched
+void ptrace_address_space_impl::forget_cached_state()
+{
+	regs_cached = false;
+	cached_teb = 0;
+	cached_fs = 0;
+}
+
 int ptrace_address_space_impl::set_context( PCONTEXT ctx )
 {
 	long regs[FRAME_SIZE];
+	int r;
 
-	memset( regs, 0, sizeof regs );
+	if (regs_cached)
+		memcpy( regs, cached_regs, sizeof regs );
+	else
+		memset( regs, 0, sizeof regs );
 
 	regs[EBX] = ctx->Ebx;
 	regs[ECX] = ctx->Ecx;
@@ -91,17 +112,26 @@ int ptrace_address_space_impl::set_context( PCONTEXT ctx )
         regs[SS] = get_userspace_data_seg();
         regs[CS] = get_userspace_code_seg();
 
-	return ptrace_set_regs( get_child_pid(), regs );
+	// only write the registers back if the kernel changed them
+	if (regs_cached && !memcmp( regs, cached_regs, sizeof regs ))
+		return 0;
+
+	r = ptrace_set_regs( get_child_pid(), regs );
+	regs_cached = (r >= 0);
+	if (regs_cached)
+		memcpy( cached_regs, regs, sizeof regs );
+	return r;
 }
 
 int ptrace_address_space_impl::get_context( PCONTEXT ctx )
 {
-	long regs[FRAME_SIZE];
+	long *regs = cached_regs;
 	int r;
 
 	memset( ctx, 0, sizeof *ctx );
 
 	r = ptrace_get_regs( get_child_pid(), regs );
+	regs_cached = (r >= 0);
 	if (r < 0)
 		return r;
 
@@ -114,6 +144,7 @@ int ptrace_address_space_impl::get_context( PCONTEXT ctx )
 	ctx->Esi = regs[ESI];
 	ctx->Edi = regs[EDI];
 	ctx->Eax = regs[EAX];
+	orig_eax = regs[ORIG_EAX];
 
 	// CONTEXT_SEGMENTS
 	ctx->SegDs = regs[DS];
@@ -213,72 +244,53 @@ int ptrace_address_space_impl::ptrace_run( PCONTEXT ctx, int single_step, LARGE_
 {
 	int r, status = 0;
 
-	// set itimer (SIGALRM)
-	sig_target = this;
-	alarm_timeout( timeout );
-
 	/* set the current thread's context */
+	ULONGLONG t = stats_clock();
 	r = set_context( ctx );
 	if (r<0)
 		die("set_thread_context failed\n");
 
+	// timeout is in 100ns units
+	event_loop_start_slice( timeout.QuadPart );
+
 	/* run it */
-	r = ptrace( single_step ? PTRACE_SINGLESTEP : PTRACE_CONT, get_child_pid(), 0, 0 );
+	int op = single_step ? PTRACE_SINGLESTEP : PTRACE_CONT;
+#ifdef PTRACE_SYSEMU
+	if (use_sysemu)
+		op = single_step ? PTRACE_SYSEMU_SINGLESTEP : PTRACE_SYSEMU;
+#endif
+	r = ptrace( (__ptrace_request) op, get_child_pid(), 0, 0 );
 	if (r<0)
 		die("PTRACE_CONT failed (%d)\n", errno);
+	syscall_stats_resume( stats_clock() - t );
 
 	/* wait until it needs our attention */
 	while (1)
 	{
-		r = wait4( get_child_pid(), &status, WUNTRACED, NULL );
+		r = wait4( get_child_pid(), &status, WUNTRACED | WNOHANG, NULL );
 		if (r == -1 && errno == EINTR)
 			continue;
 		if (r < 0)
 			die("wait4 failed (%d)\n", errno);
-		if (r != get_child_pid())
-			continue;
-		break;
+		if (r == get_child_pid())
+			break;
+
+		// stop the child at the end of its time slice
+		if (event_loop_wait_child())
+			handle( SIGALRM );
 	}
 
+	event_loop_end_slice();
+
+	t = stats_clock();
 	r = get_context( ctx );
 	if (r < 0)
 		die("failed to get registers\n");
-
-	// cancel itimer (SIGALRM)
-	cancel_timer();
-	sig_target = 0;
+	syscall_stats_stop( stats_clock() - t );
 
 	return status;
 }
 
-void ptrace_address_space_impl::alarm_timeout(LARGE_INTEGER &timeout)
-{
-	/* set the timeout */
-	struct itimerval val;
-	val.it_value.tv_sec = timeout.QuadPart/1000LL;
-	val.it_value.tv_usec = (timeout.QuadPart%1000LL)*1000LL;
-	val.it_interval.tv_sec = 0;
-	val.it_interval.tv_usec = 0;
-	int r = setitimer(ITIMER_REAL, &val, NULL);
-	if (r < 0)
-		die("couldn't set itimer\n");
-}
-
-void ptrace_address_space_impl::cancel_timer()
-{
-	int r = setitimer(ITIMER_REAL, NULL, NULL);
-	if (r < 0)
-		die("couldn't cancel itimer\n");
-}
-
-ptrace_address_space_impl* ptrace_address_space_impl::sig_target;
-
-void ptrace_address_space_impl::sigitimer_handler(int signal)
-{
-	if (sig_target)
-		sig_target->handle( signal );
-}
-
 void ptrace_address_space_impl::handle( int signal )
 {
 	//dprintf("signal %d\n", signal);
@@ -287,24 +299,16 @@ void ptrace_address_space_impl::handle( int signal )
 #ifdef HAVE_SIGQUEUE
 	sigval val;
 	val.sival_int = 0;
-	sigqueue(pid, SIGALRM, val);
+	sigqueue(pid, signal, val);
 #else
-	kill(pid, SIGALRM);
+	kill(pid, signal);
 #endif
 }
 
 void ptrace_address_space_impl::set_signals()
 {
-	struct sigaction sa;
-
-	memset(&sa, 0, sizeof sa);
-	sa.sa_handler = ptrace_address_space_impl::sigitimer_handler;
-	sigemptyset(&sa.sa_mask);
-
-	if (0 > sigaction(SIGALRM, &sa, NULL))
-		die("unable to set action for SIGALRM\n");
-
-	// turn the signal on
+	// children inherit our signal mask, and must be able to
+	// receive the SIGALRM that ends their time slice
 	sigset_t sigset;
 	sigemptyset(&sigset);
 	sigaddset(&sigset, SIGALRM);
@@ -312,6 +316,40 @@ void ptrace_address_space_impl::set_signals()
 		die("unable to unblock SIGALRM\n");
 }
 
+// Check that PTRACE_SYSEMU works by tracing a child that makes a system call.
+// A system call stop is reported as SIGTRAP | 0x80 with PTRACE_O_TRACESYSGOOD.
+bool ptrace_address_space_impl::check_sysemu()
+{
+#ifdef PTRACE_SYSEMU
+	bool ok = false;
+	int status = 0;
+
+	pid_t pid = fork();
+	if (pid == -1)
+		return false;
+
+	if (pid == 0)
+	{
+		::ptrace( PTRACE_TRACEME, 0, 0, 0 );
+		kill( getpid(), SIGSTOP );
+		getppid();
+		_exit( 0 );
+	}
+
+	if (pid == waitpid( pid, &status, 0 ) && WIFSTOPPED(status) &&
+		0 == ::ptrace( PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD ) &&
+		0 == ::ptrace( PTRACE_SYSEMU, pid, 0, 0 ) &&
+		pid == waitpid( pid, &status, 0 ))
+		ok = WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80);
+
+	kill( pid, SIGKILL );
+	waitpid( pid, &status, 0 );
+	return ok;
+#else
+	return false;
+#endif
+}
+
 void ptrace_address_space_impl::run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec )
 {
 	set_userspace_fs(TebBaseAddress, ctx->SegFs);
@@ -342,7 +380,10 @@ void ptrace_address_space_impl::run( void *TebBaseAddress, PCONTEXT ctx, int sin
 		}
 
 		if (WIFSTOPPED(status) && WEXITSTATUS(status) == SIGALRM)
+		{
+			exec->handle_timeout();
 			break;
+		}
 
 		if (WIFSTOPPED(status) && WEXITSTATUS(status) == SIGWINCH)
 			break;
@@ -350,6 +391,14 @@ void ptrace_address_space_impl::run( void *TebBaseAddress, PCONTEXT ctx, int sin
 		if (WIFSTOPPED(status) && WEXITSTATUS(status) == SIGINT)
 			exit( 1 );
 
+		// a system call stopped by PTRACE_SYSEMU, before Linux ran it
+		if (WIFSTOPPED(status) && WEXITSTATUS(status) == (SIGTRAP | 0x80))
+		{
+			ctx->Eax = orig_eax;
+			exec->handle_syscall();
+			break;
+		}
+
 		if (WIFSTOPPED(status) && single_step)
 			break;
 
@@ -401,6 +450,10 @@ int ptrace_address_space_impl::set_userspace_fs(void *TebBaseAddress, ULONG fs)
 	struct user_desc ldt;
 	int r;
 
+	// the thread area stays set until another thread runs
+	if (cached_teb == TebBaseAddress && cached_fs == fs)
+		return 0;
+
 	memset( &ldt, 0, sizeof ldt );
 	ldt.entry_number = (fs >> 3);
 	ldt.base_addr = (unsigned long) TebBaseAddress;
@@ -410,5 +463,7 @@ int ptrace_address_space_impl::set_userspace_fs(void *TebBaseAddress, ULONG fs)
 	r = ptrace_set_thread_area( get_child_pid(), &ldt );
 	if (r<0)
 		die("set %%fs failed, fs = %ld errno = %d child = %d\n", fs, errno, get_child_pid());
+	cached_teb = TebBaseAddress;
+	cached_fs = fs;
 	return r;
 }
@@ -26,16 +26,20 @@
 class ptrace_address_space_impl: public address_space_impl
 {
 protected:
-	static ptrace_address_space_impl *sig_target;
-	static void cancel_timer();
-	static void sigitimer_handler(int signal);
+	long orig_eax;
+	// what the child's registers and %fs were last set to or read as
+	long cached_regs[FRAME_SIZE];
+	bool regs_cached;
+	void *cached_teb;
+	ULONG cached_fs;
+	ptrace_address_space_impl();
+	void forget_cached_state();
 	int get_context( PCONTEXT ctx );
 	int set_context( PCONTEXT ctx );
 	int ptrace_run( PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout );
 	virtual pid_t get_child_pid() = 0;
 	virtual void handle( int signal );
 	virtual void run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec );
-	virtual void alarm_timeout(LARGE_INTEGER& timeout);
 	virtual int set_userspace_fs(void *TebBaseAddress, ULONG fs);
 	virtual void init_context( CONTEXT& ctx );
 	virtual unsigned short get_userspace_fs() = 0;
@@ -45,6 +49,7 @@ protected:
 	void wait_for_signal( pid_t pid, int signal );
 public:
 	static void set_signals();
+	static bool check_sysemu();
 };
 
 
@@ -32,7 +32,7 @@
 #include "ptrace_if.h"
 
 int remote_mmap( int proc_fd, void *start, size_t length,
-				 int prot, int flags, int fd, off_t offset)
+				 int prot, int flags, int fd, unsigned long offset)
 {
 	struct proc_mm_op msg;
 
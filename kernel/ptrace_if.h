@@ -141,7 +141,7 @@ struct proc_mm_op {
 };
 
 int remote_mmap( int proc_fd, void *start, size_t length,
-				 int prot, int flags, int fd, off_t offset);
+				 int prot, int flags, int fd, unsigned long offset);
 int remote_munmap( int proc_fd, void *start, size_t length );
 int remote_mprotect( int proc_fd, void *start, size_t length, int prot );
 int ptrace_set_user_ldt( pid_t pid, struct user_desc *ldt );
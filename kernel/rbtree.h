@@ -0,0 +1,392 @@
+/*
+ * Lightweight red-black tree template
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+#include <assert.h>
+
+// An intrusive red-black tree, in the style of list.h.
+// The tree doesn't know how elements are ordered.  Callers walk down
+// from root() using get_left()/get_right() to find where an element
+// belongs, then call insert() to link it there and rebalance.
+//
+// A tree can carry a per-subtree summary (eg. the largest value in the
+// subtree) by passing a class whose static update() recalculates the
+// summary of one element from its children.  The tree calls it as the
+// shape changes, and update_path() must be called when an element's
+// own value changes.
+
+template<class T> class rbtree_no_summary
+{
+public:
+	static void update( T* ) {}
+};
+
+template<class T, const int X, class S = rbtree_no_summary<T> > class rbtree_iter;
+template<class T, const int X, class S = rbtree_no_summary<T> > class rbtree;
+template<class T> class rbtree_element_accessor;
+
+template<class T> class rbtree_element
+{
+	friend class rbtree_element_accessor<T>;
+protected:
+	T *parent;
+	T *left;
+	T *right;
+	bool red;
+public:
+	void init() { parent = (T*)-1; left = 0; right = 0; red = false; }
+	explicit rbtree_element() {init();}
+	~rbtree_element() {}
+	bool is_linked() { return parent != (T*)-1; }
+	T* get_parent() {return parent;}
+	T* get_left() {return left;}
+	T* get_right() {return right;}
+};
+
+template<class T> class rbtree_element_accessor
+{
+protected:
+	T*& parentptr(rbtree_element<T>& elem) {return elem.parent;}
+	T*& leftptr(rbtree_element<T>& elem) {return elem.left;}
+	T*& rightptr(rbtree_element<T>& elem) {return elem.right;}
+	bool& redflag(rbtree_element<T>& elem) {return elem.red;}
+};
+
+template<class T, const int X, class S> class rbtree : public rbtree_element_accessor<T>
+{
+	T *_root;
+
+	T*& parent(T* x) { return this->parentptr(x->entry[X]); }
+	T*& left(T* x) { return this->leftptr(x->entry[X]); }
+	T*& right(T* x) { return this->rightptr(x->entry[X]); }
+	bool is_red(T* x) { return x && this->redflag(x->entry[X]); }
+	void set_red(T* x, bool red) { this->redflag(x->entry[X]) = red; }
+
+	// replace the subtree at old with the subtree at x
+	void replace_child( T* old, T* x )
+	{
+		T *p = parent(old);
+		if (!p)
+			_root = x;
+		else if (left(p) == old)
+			left(p) = x;
+		else
+			right(p) = x;
+		if (x)
+			parent(x) = p;
+	}
+
+	void rotate_left( T* x )
+	{
+		T *y = right(x);
+		right(x) = left(y);
+		if (left(y))
+			parent(left(y)) = x;
+		replace_child( x, y );
+		left(y) = x;
+		parent(x) = y;
+		S::update( x );
+		S::update( y );
+	}
+
+	void rotate_right( T* x )
+	{
+		T *y = left(x);
+		left(x) = right(y);
+		if (right(y))
+			parent(right(y)) = x;
+		replace_child( x, y );
+		right(y) = x;
+		parent(x) = y;
+		S::update( x );
+		S::update( y );
+	}
+
+	void insert_fixup( T* x )
+	{
+		T *p, *g, *u;
+
+		while ((p = parent(x)) && is_red(p))
+		{
+			g = parent(p);
+			if (p == left(g))
+			{
+				u = right(g);
+				if (is_red(u))
+				{
+					set_red(p, false);
+					set_red(u, false);
+					set_red(g, true);
+					x = g;
+					continue;
+				}
+				if (x == right(p))
+				{
+					rotate_left(p);
+					x = p;
+					p = parent(x);
+				}
+				set_red(p, false);
+				set_red(g, true);
+				rotate_right(g);
+			}
+			else
+			{
+				u = left(g);
+				if (is_red(u))
+				{
+					set_red(p, false);
+					set_red(u, false);
+					set_red(g, true);
+					x = g;
+					continue;
+				}
+				if (x == left(p))
+				{
+					rotate_right(p);
+					x = p;
+					p = parent(x);
+				}
+				set_red(p, false);
+				set_red(g, true);
+				rotate_left(g);
+			}
+		}
+		set_red(_root, false);
+	}
+
+	// x (possibly null) is short one black node, p is its parent
+	void unlink_fixup( T* x, T* p )
+	{
+		T *w;
+
+		while (x != _root && !is_red(x))
+		{
+			if (x == left(p))
+			{
+				w = right(p);
+				if (is_red(w))
+				{
+					set_red(w, false);
+					set_red(p, true);
+					rotate_left(p);
+					w = right(p);
+				}
+				if (!is_red(left(w)) && !is_red(right(w)))
+				{
+					set_red(w, true);
+					x = p;
+					p = parent(x);
+					continue;
+				}
+				if (!is_red(right(w)))
+				{
+					set_red(left(w), false);
+					set_red(w, true);
+					rotate_right(w);
+					w = right(p);
+				}
+				set_red(w, is_red(p));
+				set_red(p, false);
+				set_red(right(w), false);
+				rotate_left(p);
+			}
+			else
+			{
+				w = left(p);
+				if (is_red(w))
+				{
+					set_red(w, false);
+					set_red(p, true);
+					rotate_right(p);
+					w = left(p);
+				}
+				if (!is_red(left(w)) && !is_red(right(w)))
+				{
+					set_red(w, true);
+					x = p;
+					p = parent(x);
+					continue;
+				}
+				if (!is_red(left(w)))
+				{
+					set_red(right(w), false);
+					set_red(w, true);
+					rotate_left(w);
+					w = left(p);
+				}
+				set_red(w, is_red(p));
+				set_red(p, false);
+				set_red(left(w), false);
+				rotate_right(p);
+			}
+			x = _root;
+		}
+		if (x)
+			set_red(x, false);
+	}
+
+public:
+	explicit rbtree() { _root = 0; }
+	~rbtree() {}
+	bool empty() { return !_root; }
+	T *root() { return _root; }
+
+	T *first()
+	{
+		T *x = _root;
+		if (x)
+			while (left(x))
+				x = left(x);
+		return x;
+	}
+
+	T *last()
+	{
+		T *x = _root;
+		if (x)
+			while (right(x))
+				x = right(x);
+		return x;
+	}
+
+	T *next( T* x )
+	{
+		if (right(x))
+		{
+			x = right(x);
+			while (left(x))
+				x = left(x);
+			return x;
+		}
+		while (parent(x) && x == right(parent(x)))
+			x = parent(x);
+		return parent(x);
+	}
+
+	T *prev( T* x )
+	{
+		if (left(x))
+		{
+			x = left(x);
+			while (right(x))
+				x = right(x);
+			return x;
+		}
+		while (parent(x) && x == left(parent(x)))
+			x = parent(x);
+		return parent(x);
+	}
+
+	// recalculate summaries from x up to the root
+	void update_path( T* x )
+	{
+		while (x)
+		{
+			S::update( x );
+			x = parent(x);
+		}
+	}
+
+	// link elem in as a child of point (0 if the tree is empty)
+	void insert( T* point, bool to_right, T* elem )
+	{
+		assert(!elem->entry[X].is_linked());
+		parent(elem) = point;
+		left(elem) = 0;
+		right(elem) = 0;
+		set_red(elem, true);
+		if (!point)
+		{
+			assert(!_root);
+			_root = elem;
+		}
+		else if (to_right)
+		{
+			assert(!right(point));
+			right(point) = elem;
+		}
+		else
+		{
+			assert(!left(point));
+			left(point) = elem;
+		}
+		update_path( elem );
+		insert_fixup( elem );
+	}
+
+	void unlink( T* elem )
+	{
+		T *x, *p;
+		bool was_red;
+
+		assert(elem->entry[X].is_linked());
+		if (!left(elem) || !right(elem))
+		{
+			x = left(elem) ? left(elem) : right(elem);
+			p = parent(elem);
+			was_red = is_red(elem);
+			replace_child( elem, x );
+		}
+		else
+		{
+			// swap in the next element, which has no left child
+			T *y = right(elem);
+			while (left(y))
+				y = left(y);
+			was_red = is_red(y);
+			x = right(y);
+			if (parent(y) == elem)
+				p = y;
+			else
+			{
+				p = parent(y);
+				replace_child( y, x );
+				right(y) = right(elem);
+				parent(right(y)) = y;
+			}
+			replace_child( elem, y );
+			left(y) = left(elem);
+			parent(left(y)) = y;
+			set_red(y, is_red(elem));
+		}
+		update_path( p );
+		if (!was_red)
+			unlink_fixup( x, p );
+		elem->entry[X].init();
+	}
+};
+
+template<class T, const int X, class S> class rbtree_iter
+{
+	rbtree<T,X,S>& tree;
+	T* i;
+public:
+	explicit rbtree_iter(rbtree<T,X,S>& t) : tree(t), i(t.first()) {}
+	T* next() { i = tree.next(i); return i; }
+	T* cur() { return i; }
+	operator bool() { return i != 0; }
+	operator T*() { return i; }
+	void reset() {i = tree.first();}
+};
+
+#endif // __RBTREE_H__
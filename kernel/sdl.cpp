@@ -39,6 +39,7 @@
 #include "win32mgr.h"
 #include "ntwin32.h"
 #include "sdl.h"
+#include "aio.h"
 
 // the freetype project certainly has their own way of doing things :/
 #include <ft2build.h>
@@ -87,6 +88,7 @@ public:
 	sdl_sleeper_t( win32k_manager_t* mgr );
 	virtual bool check_events( bool wait );
 	static Uint32 timeout_callback( Uint32 interval, void *arg );
+	static void aio_wakeup();
 	bool handle_sdl_event( SDL_Event& event );
 	WORD sdl_keysum_to_vkey( SDLKey sym );
 	ULONG get_mouse_button( Uint8 button, bool up );
@@ -356,6 +358,17 @@ Uint32 sdl_sleeper_t::timeout_callback( Uint32 interval, void *arg )
 	return 0;
 }
 
+// called on an I/O worker thread, SDL_PushEvent is thread safe
+void sdl_sleeper_t::aio_wakeup()
+{
+	SDL_Event event;
+	event.type = SDL_USEREVENT;
+	event.user.code = 1;
+	event.user.data1 = 0;
+	event.user.data2 = 0;
+	SDL_PushEvent( &event );
+}
+
 WORD sdl_sleeper_t::sdl_keysum_to_vkey( SDLKey sym )
 {
 	assert ( SDLK_a == 'a' );
@@ -464,8 +477,8 @@ bool sdl_sleeper_t::check_events( bool wait )
 
 	// Check for a deadlock and quit.
 	//  This happens if we're the only active thread,
-	//  there's no more timers, nobody listening for input and we're asked to wait.
-	if (!timers_left && !active_window && wait && fiber_t::last_fiber())
+	//  there's no more timers or I/O, nobody listening for input and we're asked to wait.
+	if (!timers_left && !async_io_pending() && !active_window && wait && fiber_t::last_fiber())
 		return true;
 
 	// only wait if asked to
@@ -488,6 +501,10 @@ bool sdl_sleeper_t::check_events( bool wait )
 			// timer has expired, no need to cancel it
 			id = NULL;
 		}
+		else if (event.type == SDL_USEREVENT && event.user.code == 1)
+		{
+			// file I/O finished, completed by the scheduler
+		}
 		else
 		{
 			quit = handle_sdl_event( event );
@@ -537,6 +554,7 @@ BOOL win32k_sdl_t::init()
 
 	sdl_bitmap = new sdl_16bpp_bitmap_t( screen );
 	::sleeper = &sdl_sleeper;
+	aio_set_wakeup( sdl_sleeper_t::aio_wakeup );
 
 	return TRUE;
 }
@@ -545,6 +563,7 @@ void win32k_sdl_t::fini()
 {
 	if ( !SDL_WasInit(SDL_INIT_VIDEO) )
 		return;
+	aio_set_wakeup( 0 );
 	FT_Done_FreeType( ftlib );
 	SDL_Quit();
 }
@@ -22,6 +22,8 @@
 #include "config.h"
 
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "ntstatus.h"
@@ -38,6 +40,37 @@
 #include "unicode.h"
 #include "file.h"
 
+class pe_image_t;
+
+typedef list_anchor<pe_image_t, 0> pe_image_list_t;
+typedef list_element<pe_image_t> pe_image_entry_t;
+typedef list_iter<pe_image_t, 0> pe_image_iter_t;
+
+// An image file laid out as it appears in memory.
+// Shared by all sections and processes that map the same file,
+//  so pages are only copied when a process writes to them.
+class pe_image_t : public backing_store_t {
+	friend class list_anchor<pe_image_t, 0>;
+	friend class list_iter<pe_image_t, 0>;
+	pe_image_entry_t entry[1];
+	static pe_image_list_t images;
+	int fd;
+	int refcount;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+protected:
+	pe_image_t( int _fd, const struct stat& st );
+	~pe_image_t();
+	bool is_file( const struct stat& st );
+public:
+	static pe_image_t* get( int file_fd, BYTE *file, size_t len, IMAGE_NT_HEADERS *nt );
+	virtual int get_fd() { return fd; }
+	virtual void addref() { refcount++; }
+	virtual void release() { if (!--refcount) delete this; }
+};
+
 struct pe_section_t : public section_t {
 public:
 	pe_section_t( int f, BYTE *a, size_t l, ULONG attr, ULONG prot );
@@ -48,14 +81,91 @@ public:
 	IMAGE_NT_HEADERS* get_nt_header();
 	DWORD get_proc_address( const char *name );
 	DWORD get_proc_address( ULONG ordinal );
+	void *get_proc_code( const char *name );
 	void add_relay( address_space *vm );
 	bool add_relay_stub( address_space *vm, BYTE *stub_addr, ULONG func, ULONG *user_addr, ULONG thunk_ofs );
 	const char *get_symbol( ULONG address );
 	const char *name_of_ordinal( ULONG ordinal );
 private:
 	void *virtual_addr_to_offset( DWORD virtual_ofs );
+	pe_image_t *image;
 };
 
+pe_image_list_t pe_image_t::images;
+
+pe_image_t::pe_image_t( int _fd, const struct stat& st ) :
+	fd( _fd ),
+	refcount( 1 ),
+	dev( st.st_dev ),
+	ino( st.st_ino ),
+	mtime( st.st_mtime ),
+	size( st.st_size )
+{
+	images.append( this );
+}
+
+pe_image_t::~pe_image_t()
+{
+	images.unlink( this );
+	close( fd );
+}
+
+bool pe_image_t::is_file( const struct stat& st )
+{
+	return dev == st.st_dev && ino == st.st_ino &&
+		mtime == st.st_mtime && size == st.st_size;
+}
+
+pe_image_t* pe_image_t::get( int file_fd, BYTE *file, size_t len, IMAGE_NT_HEADERS *nt )
+{
+	IMAGE_SECTION_HEADER *sections = (IMAGE_SECTION_HEADER*) &nt[1];
+	struct stat st;
+
+	if (0 > fstat( file_fd, &st ))
+		return NULL;
+
+	for ( pe_image_iter_t i(images); i; i.next() )
+	{
+		pe_image_t *image = i;
+		if (image->is_file( st ))
+		{
+			image->addref();
+			return image;
+		}
+	}
+
+	ULONG image_size = (nt->OptionalHeader.SizeOfImage + 0xfff) & ~0xfff;
+	int fd = create_mapping_fd( image_size );
+	if (fd < 0)
+		return NULL;
+
+	BYTE *p = (BYTE*) mmap( NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if (p == (BYTE*) -1)
+	{
+		close( fd );
+		return NULL;
+	}
+
+	// copy the headers and each section to where it will be mapped
+	memcpy( p, file, min( len, (size_t) 0x1000 ) );
+	for ( int i=0; i<nt->FileHeader.NumberOfSections; i++ )
+	{
+		ULONG ofs = sections[i].VirtualAddress;
+		ULONG sz = sections[i].SizeOfRawData;
+		ULONG raw = sections[i].PointerToRawData;
+		if (ofs >= image_size || raw >= len)
+			continue;
+		sz = min( sz, (sections[i].Misc.VirtualSize + 0xfff) & ~0xfff );
+		sz = min( sz, image_size - ofs );
+		sz = min( sz, len - raw );
+		memcpy( p + ofs, file + raw, sz );
+	}
+
+	munmap( p, image_size );
+
+	return new pe_image_t( fd, st );
+}
+
 section_t::~section_t()
 {
 	munmap( addr, len );
@@ -119,12 +229,15 @@ const char *section_t::get_symbol( ULONG address )
 }
 
 pe_section_t::pe_section_t( int fd, BYTE *a, size_t l, ULONG attr, ULONG prot ) :
-	section_t( fd, a, l, attr, prot )
+	section_t( fd, a, l, attr, prot ),
+	image( 0 )
 {
 }
 
 pe_section_t::~pe_section_t()
 {
+	if (image)
+		image->release();
 }
 
 NTSTATUS pe_section_t::query( SECTION_IMAGE_INFORMATION *image )
@@ -377,7 +490,6 @@ void pe_section_t::add_relay(address_space *vm)
 	}
 }
 
-// maybe create a temp file to remap?
 NTSTATUS pe_section_t::mapit( address_space *vm, BYTE *&base, ULONG ZeroBits, ULONG State, ULONG Protect )
 {
 	IMAGE_DOS_HEADER *dos;
@@ -393,9 +505,16 @@ NTSTATUS pe_section_t::mapit( address_space *vm, BYTE *&base, ULONG ZeroBits, UL
 	if (!nt)
 		return STATUS_UNSUCCESSFUL;
 
+	if (!image)
+	{
+		image = pe_image_t::get( fd, addr, len, nt );
+		if (!image)
+			return STATUS_NO_MEMORY;
+	}
+
 	p = (BYTE*) nt->OptionalHeader.ImageBase;
 	dprintf("image at %p\n", p);
-	r = vm->allocate_virtual_memory( &p, ZeroBits, 0x1000, MEM_COMMIT, PAGE_READONLY );
+	r = vm->map_image( &p, 0x1000, PAGE_READONLY, image, 0 );
 	if (r < STATUS_SUCCESS)
 	{
 		dprintf("map failed\n");
@@ -403,14 +522,9 @@ NTSTATUS pe_section_t::mapit( address_space *vm, BYTE *&base, ULONG ZeroBits, UL
 	}
 
 	// use of mblock here is a bit of a hack
-	// should convert this function to create a flat file to map
 	mb = vm->find_block( p );
 	mb->set_section( this );
 
-	r = vm->copy_to_user( p, addr, 0x1000 );
-	if (r < STATUS_SUCCESS)
-		dprintf("copy_to_user failed\n");
-
 	sections = (IMAGE_SECTION_HEADER*) (addr + dos->e_lfanew + sizeof (*nt));
 
 	if (option_trace)
@@ -436,18 +550,11 @@ NTSTATUS pe_section_t::mapit( address_space *vm, BYTE *&base, ULONG ZeroBits, UL
 
 		p = (BYTE*) (nt->OptionalHeader.ImageBase + sections[i].VirtualAddress);
 		// FIXME - map sections with correct permissions
-		r = vm->allocate_virtual_memory( &p, 0, sz, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+		r = vm->map_image( &p, sz, PAGE_EXECUTE_READWRITE, image, sections[i].VirtualAddress );
 		if (r < STATUS_SUCCESS)
-			die("anonymous map failed %08x\n", r);
+			die("image map failed %08x\n", r);
 		mb = vm->find_block( p );
 		mb->set_section( this );
-
-		if (sections[i].SizeOfRawData)
-		{
-			r = vm->copy_to_user( p, addr + sections[i].PointerToRawData, sections[i].SizeOfRawData);
-			if (r < STATUS_SUCCESS)
-				dprintf("copy_to_user failed\n");
-		}
 	}
 
 	//if (option_trace)
@@ -485,6 +592,23 @@ DWORD get_proc_address( object_t *obj, const char *name )
 	return sec->get_proc_address( name );
 }
 
+// the kernel's copy of an exported function, to look at its code
+void *get_proc_code( object_t *obj, const char *name )
+{
+	pe_section_t *sec = dynamic_cast<pe_section_t*>( obj );
+	if (!sec)
+		return 0;
+	return sec->get_proc_code( name );
+}
+
+void *pe_section_t::get_proc_code( const char *name )
+{
+	DWORD rva = get_proc_address( name );
+	if (!rva)
+		return 0;
+	return virtual_addr_to_offset( rva );
+}
+
 IMAGE_EXPORT_DIRECTORY* pe_section_t::get_exports_table()
 {
 	IMAGE_NT_HEADERS* nt = get_nt_header();
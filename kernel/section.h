@@ -45,6 +45,7 @@ NTSTATUS create_section( section_t **section, object_t *file, PLARGE_INTEGER psz
 NTSTATUS mapit( address_space *vm, object_t *obj, BYTE *&addr );
 void *virtual_addr_to_offset( IMAGE_NT_HEADERS *nt, void *base, DWORD virtual_ofs );
 DWORD get_proc_address(object_t *obj, const char *name);
+void *get_proc_code(object_t *obj, const char *name);
 void *get_entry_point( process_t *p );
 NTSTATUS section_from_handle( HANDLE, section_t*& section, ACCESS_MASK access );
 
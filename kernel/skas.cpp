@@ -59,7 +59,7 @@ public:
 	skas3_address_space_impl(int _fd);
 	virtual pid_t get_child_pid();
 	virtual ~skas3_address_space_impl();
-	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset );
+	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset );
 	virtual int munmap( BYTE *address, size_t length );
 	virtual void run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec );
 	static pid_t create_tracee(void);
@@ -182,6 +182,9 @@ void skas3_address_space_impl::run( void *TebBaseAddress, PCONTEXT ctx, int sing
 	if (r < 0)
 		die("ptrace_set_address_space failed %d (%d)\n", r, errno);
 
+	// the child is shared with other address spaces
+	forget_cached_state();
+
 	ptrace_address_space_impl::run( TebBaseAddress, ctx, single_step, timeout, exec );
 }
 
@@ -215,8 +218,11 @@ address_space_impl* create_skas3_address_space()
 	return new skas3_address_space_impl( fd );
 }
 
-int skas3_address_space_impl::mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset )
+int skas3_address_space_impl::mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset )
 {
+	// /proc/mm only takes a 32 bit offset
+	if (offset >> 32)
+		return -1;
 	return remote_mmap( fd, address, length, prot, flags, file, offset );
 }
 
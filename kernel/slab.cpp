@@ -0,0 +1,151 @@
+/*
+ * slab allocator for small kernel objects
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "slab.h"
+
+slab_t *slab_t::slab_list;
+
+// each block starts with a header giving its size class,
+// padded so the object after it stays 8 byte aligned
+struct slab_header_t {
+	unsigned int size_class;
+	unsigned int pad;
+};
+
+slab_t::slab_t( const char *_name ) :
+	name( _name ),
+	allocs( 0 ),
+	frees( 0 ),
+	in_use( 0 ),
+	peak( 0 ),
+	large( 0 ),
+	chunk_bytes( 0 )
+{
+	for (unsigned int i = 0; i < num_classes; i++)
+		free_list[i] = 0;
+	next_slab = slab_list;
+	slab_list = this;
+}
+
+size_t slab_t::class_size( unsigned int n )
+{
+	return min_block << n;
+}
+
+// returns num_classes if the block is too big for any class
+unsigned int slab_t::size_class( size_t size )
+{
+	unsigned int n = 0;
+	while (n < num_classes && class_size( n ) < size)
+		n++;
+	return n;
+}
+
+// carve a new chunk into blocks of class n
+bool slab_t::refill( unsigned int n )
+{
+	size_t sz = class_size( n );
+	size_t count = chunk_size / sz;
+	if (!count)
+		count = 1;
+
+	unsigned char *chunk = new unsigned char[count * sz];
+	if (!chunk)
+		return false;
+	chunk_bytes += count * sz;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		free_block_t *block = (free_block_t*) (chunk + i * sz);
+		block->next = free_list[n];
+		free_list[n] = block;
+	}
+	return true;
+}
+
+void *slab_t::alloc( size_t size )
+{
+	slab_header_t *hdr;
+
+	size += sizeof *hdr;
+	unsigned int n = size_class( size );
+	if (n == num_classes)
+	{
+		hdr = (slab_header_t*) new unsigned char[size];
+		if (!hdr)
+			return 0;
+		large++;
+	}
+	else
+	{
+		if (!free_list[n] && !refill( n ))
+			return 0;
+		hdr = (slab_header_t*) free_list[n];
+		free_list[n] = free_list[n]->next;
+	}
+
+	hdr->size_class = n;
+	allocs++;
+	in_use++;
+	if (in_use > peak)
+		peak = in_use;
+
+	return hdr + 1;
+}
+
+void slab_t::free( void *ptr )
+{
+	if (!ptr)
+		return;
+
+	slab_header_t *hdr = ((slab_header_t*) ptr) - 1;
+	unsigned int n = hdr->size_class;
+	assert( n <= num_classes );
+
+	frees++;
+	in_use--;
+
+	if (n == num_classes)
+	{
+		delete[] (unsigned char*) hdr;
+		return;
+	}
+
+	free_block_t *block = (free_block_t*) hdr;
+	block->next = free_list[n];
+	free_list[n] = block;
+}
+
+void slab_t::dump()
+{
+	fprintf(stderr, "%-24s %10lu %10lu %8lu %8lu %8lu %10lu\n", name,
+		allocs, frees, in_use, peak, large, (unsigned long) chunk_bytes);
+}
+
+void slab_t::dump_all()
+{
+	fprintf(stderr, "%-24s %10s %10s %8s %8s %8s %10s\n", "slab",
+		"allocs", "frees", "in use", "peak", "large", "bytes");
+	for (slab_t *slab = slab_list; slab; slab = slab->next_slab)
+		slab->dump();
+}
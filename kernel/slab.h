@@ -0,0 +1,69 @@
+/*
+ * slab allocator for small kernel objects
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stddef.h>
+
+// A slab_t keeps free lists of blocks in a few power of two size
+// classes for one type of object.  Blocks are carved from chunks
+// that are never returned to the heap, so a type that is allocated
+// and freed on every operation stops touching malloc once warm.
+// Requests bigger than the largest class go straight to the heap.
+class slab_t
+{
+	static const unsigned int num_classes = 8;
+	static const size_t min_block = 32;
+	static const size_t chunk_size = 0x4000;
+
+	struct free_block_t {
+		free_block_t *next;
+	};
+
+	const char *name;
+	slab_t *next_slab;
+	free_block_t *free_list[num_classes];
+
+	// statistics
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long in_use;
+	unsigned long peak;
+	unsigned long large;
+	size_t chunk_bytes;
+
+	static slab_t *slab_list;
+	static unsigned int size_class( size_t size );
+	static size_t class_size( unsigned int n );
+	bool refill( unsigned int n );
+public:
+	slab_t( const char *name );
+	void *alloc( size_t size );
+	void free( void *ptr );
+	void dump();
+	static void dump_all();
+};
+
+// for fixed size classes, add
+//   void *operator new(size_t sz) { return slab.alloc( sz ); }
+//   void operator delete(void *p) { slab.free( p ); }
+
+#endif // __SLAB_H__
@@ -22,6 +22,9 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -30,7 +33,12 @@
 
 #include "debug.h"
 #include "ntcall.h"
+#include "slab.h"
 #include "ntwin32.h"
+#include "object.h"
+#include "section.h"
+#include "trace_ring.h"
+#include "syscall_log.h"
 
 typedef struct _ntcalldesc {
 	const char *name;
@@ -74,6 +82,137 @@ ULONG number_of_uicalls;
 
 static ULONG uicall_offset = 0x1000;
 
+// Counters and log2 latency histograms (in nanoseconds) for each call.
+// Handler time runs from entering do_nt_syscall to returning from it,
+// including any time the thread spends blocked.  Ptrace time is what
+// the kernel spends reading the client's registers after it stops and
+// writing them back to resume it, charged to the call that was made.
+const int stats_buckets = 32;
+
+struct syscall_stats_t {
+	ULONG count;
+	ULONGLONG handler_ns;
+	ULONGLONG ptrace_ns;
+	ULONG handler_hist[stats_buckets];
+	ULONG ptrace_hist[stats_buckets];
+};
+
+static syscall_stats_t *ntcall_stats;
+static syscall_stats_t *uicall_stats;
+static syscall_stats_t *last_stats;
+static ULONGLONG stop_ns, last_stop_ns;
+static volatile sig_atomic_t stats_dump_requested;
+
+ULONGLONG stats_clock()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_bucket( ULONGLONG ns )
+{
+	int n = 0;
+	while (ns > 1 && n < (stats_buckets - 1))
+	{
+		ns >>= 1;
+		n++;
+	}
+	return n;
+}
+
+void syscall_stats_stop( ULONGLONG ns )
+{
+	stop_ns = ns;
+}
+
+void syscall_stats_resume( ULONGLONG ns )
+{
+	if (!last_stats)
+		return;
+	ns += last_stop_ns;
+	last_stats->ptrace_ns += ns;
+	last_stats->ptrace_hist[stats_bucket( ns )]++;
+	last_stats = 0;
+}
+
+static void dump_stats( ntcalldesc *calls, syscall_stats_t *stats, ULONG count )
+{
+	for (ULONG i=0; i<count; i++)
+	{
+		syscall_stats_t *s = &stats[i];
+		if (!s->count)
+			continue;
+		fprintf(stderr, "%-40s %8ld %10lld %10lld  handler",
+			calls[i].name, s->count, s->handler_ns/s->count/1000, s->ptrace_ns/s->count/1000 );
+		for (int j=0; j<stats_buckets; j++)
+			if (s->handler_hist[j])
+				fprintf(stderr, " %d:%ld", j, s->handler_hist[j]);
+		fprintf(stderr, "  ptrace");
+		for (int j=0; j<stats_buckets; j++)
+			if (s->ptrace_hist[j])
+				fprintf(stderr, " %d:%ld", j, s->ptrace_hist[j]);
+		fprintf(stderr, "\n");
+	}
+}
+
+void dump_syscall_stats()
+{
+	if (!ntcall_stats)
+		return;
+	fprintf(stderr, "%-40s %8s %10s %10s  log2(ns):count\n", "call", "count", "avg us", "ptrace us");
+	dump_stats( ntcalls, ntcall_stats, number_of_ntcalls );
+	dump_stats( ntuicalls, uicall_stats, number_of_uicalls );
+	slab_t::dump_all();
+}
+
+static void stats_signal_handler( int signal )
+{
+	stats_dump_requested = 1;
+}
+
+// called from the scheduler, as the signal handler can't print
+void check_syscall_stats()
+{
+	if (!stats_dump_requested)
+		return;
+	stats_dump_requested = 0;
+	dump_syscall_stats();
+}
+
+// Fill in argument counts the tables don't have from ntdll's stubs,
+// which look like "mov $n, %eax ... ret $args*4", so the count never
+// needs to be read from user memory while handling a call.
+static void count_syscall_args( ntcalldesc *calls, ULONG count )
+{
+	for (ULONG i=0; i<count; i++)
+	{
+		BYTE *code = (BYTE*) get_proc_code( ntdll_section, calls[i].name );
+		if (!code || code[0] != 0xb8 || *(ULONG*)(code+1) != i)
+			continue;
+
+		unsigned int numargs = ~0U;
+		for (int j=5; j<16; j++)
+		{
+			if (code[j] == 0xc3)
+				numargs = 0;
+			else if (code[j] == 0xc2 && code[j+2] == 0)
+				numargs = code[j+1]/4;
+			else
+				continue;
+			break;
+		}
+		if (numargs == ~0U)
+			continue;
+
+		if (!calls[i].numargs)
+			calls[i].numargs = numargs;
+		else if (calls[i].numargs != numargs)
+			dprintf("%s: table has %d args, ntdll has %d\n",
+				calls[i].name, calls[i].numargs, numargs);
+	}
+}
+
 void init_syscalls(bool xp)
 {
 	if (xp)
@@ -90,10 +229,30 @@ void init_syscalls(bool xp)
 		number_of_uicalls = sizeof win2k_uicalls/sizeof win2k_uicalls[0];
 		ntuicalls = win2k_uicalls;
 	}
+
+	count_syscall_args( ntcalls, number_of_ntcalls );
+
+	ntcall_stats = new syscall_stats_t[number_of_ntcalls];
+	memset( ntcall_stats, 0, number_of_ntcalls * sizeof (syscall_stats_t) );
+	uicall_stats = new syscall_stats_t[number_of_uicalls];
+	memset( uicall_stats, 0, number_of_uicalls * sizeof (syscall_stats_t) );
+
+	// kill -USR1 dumps the statistics
+	signal( SIGUSR1, stats_signal_handler );
 }
 
 void trace_syscall_enter(ULONG id, ntcalldesc *ntcall, ULONG *args, ULONG retaddr)
 {
+	if (trace_ring_enabled)
+	{
+		ULONG a[3] = {0, 0, 0};
+		for (ULONG i = 0; i < 3 && i < ntcall->numargs; i++)
+			a[i] = args[i];
+		trace_ring_event( trace_syscall_enter_event, id, trace_ring_string( ntcall->name ),
+			retaddr, a[0], a[1], a[2] );
+		return;
+	}
+
 	/* print a relay style trace line */
 	if (!option_trace)
 		return;
@@ -111,6 +270,13 @@ void trace_syscall_enter(ULONG id, ntcalldesc *ntcall, ULONG *args, ULONG retadd
 
 void trace_syscall_exit(ULONG id, ntcalldesc *ntcall, ULONG r, ULONG retaddr)
 {
+	if (trace_ring_enabled)
+	{
+		trace_ring_event( trace_syscall_exit_event, id, trace_ring_string( ntcall->name ),
+			r, retaddr, 0, 0 );
+		return;
+	}
+
 	if (!option_trace)
 		return;
 
@@ -122,6 +288,9 @@ NTSTATUS do_nt_syscall(ULONG id, ULONG func, ULONG *uargs, ULONG retaddr)
 {
 	NTSTATUS r = STATUS_INVALID_SYSTEM_SERVICE;
 	ntcalldesc *ntcall = 0;
+	syscall_stats_t *stats = 0;
+	syscall_record_t *record = 0;
+	ULONGLONG start = stats_clock();
 	ULONG args[16];
 	const int magic_val = 0xfedc1248;	// random unlikely value
 	int magic = magic_val;
@@ -129,11 +298,15 @@ NTSTATUS do_nt_syscall(ULONG id, ULONG func, ULONG *uargs, ULONG retaddr)
 
 	/* check the call number is in range */
 	if (func >= 0 && func < number_of_ntcalls)
+	{
 		ntcall = &ntcalls[func];
+		stats = &ntcall_stats[func];
+	}
 	else if (func >= uicall_offset && func < (uicall_offset + number_of_uicalls))
 	{
 		win32k_func = TRUE;
 		ntcall = &ntuicalls[func - uicall_offset];
+		stats = &uicall_stats[func - uicall_offset];
 	}
 	else
 	{
@@ -141,8 +314,16 @@ NTSTATUS do_nt_syscall(ULONG id, ULONG func, ULONG *uargs, ULONG retaddr)
 		return r;
 	}
 
+	record = syscall_log_enter( id, func, uargs, retaddr );
+
+	// The tables know the argument count of everything implemented,
+	// so only look at the stub's return instruction when they don't
+	// or when tracing wants the caller.
 	BYTE inst[4];
-	r = copy_from_user( inst, (const void*)retaddr, sizeof inst );
+	if ((!ntcall->func && !ntcall->numargs) || option_trace)
+		r = copy_from_user( inst, (const void*)retaddr, sizeof inst );
+	else
+		r = STATUS_UNSUCCESSFUL;
 	if (r == STATUS_SUCCESS && inst[0] == 0xc2)
 	{
 		// detect the number of args
@@ -206,6 +387,17 @@ NTSTATUS do_nt_syscall(ULONG id, ULONG func, ULONG *uargs, ULONG retaddr)
 
 end:
 	trace_syscall_exit(id, ntcall, r, retaddr);
+	syscall_log_exit( record, r );
+
+	ULONGLONG ns = stats_clock() - start;
+	stats->count++;
+	stats->handler_ns += ns;
+	stats->handler_hist[stats_bucket( ns )]++;
+
+	// the registers were read for this call, and will be written back for it
+	last_stats = stats;
+	last_stop_ns = stop_ns;
+	stop_ns = 0;
 
 	return r;
 }
@@ -0,0 +1,415 @@
+/*
+ * system call record and replay
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+
+#include "debug.h"
+#include "list.h"
+#include "mem.h"
+#include "object.h"
+#include "ntcall.h"
+#include "thread.h"
+#include "syscall_log.h"
+
+// The file starts with a syscall_log_header, then has one record per
+// completed call, in the order the calls completed.  Each record is
+// followed by its copies, each with its data padded to four bytes.
+// seq numbers calls in the order they started, which is the order
+// they're replayed in.  Calls that never returned have no record.
+
+#define SYSCALL_LOG_MAGIC 0x6c6b3372
+
+struct syscall_log_header {
+	ULONG magic;
+	ULONG size;
+};
+
+struct syscall_log_call {
+	ULONG seq;
+	ULONG id;
+	ULONG func;
+	ULONG uargs;
+	ULONG retaddr;
+	NTSTATUS status;
+	ULONG size;
+};
+
+struct syscall_log_copy_t {
+	ULONG type;
+	ULONG addr;
+	ULONG len;
+};
+
+static inline ULONG pad4( ULONG len )
+{
+	return (len + 3) & ~3;
+}
+
+bool syscall_recording;
+static FILE *record_file;
+static ULONG next_seq;
+
+// a call being recorded, with the copies it's made so far
+class syscall_record_t;
+typedef list_anchor<syscall_record_t, 0> syscall_record_list_t;
+typedef list_element<syscall_record_t> syscall_record_element_t;
+typedef list_iter<syscall_record_t, 0> syscall_record_iter_t;
+
+class syscall_record_t
+{
+public:
+	syscall_record_element_t entry[1];
+	thread_t *thread;
+	syscall_log_call call;
+	BYTE *buffer;
+	ULONG allocated;
+public:
+	syscall_record_t( thread_t *t ) : thread( t ), buffer( 0 ), allocated( 0 ) {}
+	~syscall_record_t() { delete[] buffer; }
+	void add( ULONG type, const void *user, const void *data, size_t len );
+};
+
+// calls that haven't returned yet, innermost last
+static syscall_record_list_t active_records;
+
+void syscall_record_t::add( ULONG type, const void *user, const void *data, size_t len )
+{
+	ULONG needed = call.size + sizeof (syscall_log_copy_t) + pad4( len );
+	if (needed > allocated)
+	{
+		ULONG n = allocated ? allocated * 2 : 0x100;
+		while (n < needed)
+			n *= 2;
+		BYTE *b = new BYTE[n];
+		memcpy( b, buffer, call.size );
+		delete[] buffer;
+		buffer = b;
+		allocated = n;
+	}
+
+	syscall_log_copy_t *copy = (syscall_log_copy_t*) (buffer + call.size);
+	copy->type = type;
+	copy->addr = (ULONG) user;
+	copy->len = len;
+	memcpy( &copy[1], data, len );
+	memset( (BYTE*) &copy[1] + len, 0, pad4( len ) - len );
+	call.size = needed;
+}
+
+void syscall_log_record( const char *filename )
+{
+	record_file = fopen( filename, "w" );
+	if (!record_file)
+		die("failed to create %s\n", filename);
+
+	syscall_log_header header;
+	header.magic = SYSCALL_LOG_MAGIC;
+	header.size = sizeof (syscall_log_call);
+	fwrite( &header, sizeof header, 1, record_file );
+	syscall_recording = true;
+}
+
+syscall_record_t *syscall_log_enter( ULONG id, ULONG func, ULONG *uargs, ULONG retaddr )
+{
+	if (!syscall_recording)
+		return 0;
+
+	syscall_record_t *rec = new syscall_record_t( current );
+	rec->call.seq = next_seq++;
+	rec->call.id = id;
+	rec->call.func = func;
+	rec->call.uargs = (ULONG) uargs;
+	rec->call.retaddr = retaddr;
+	rec->call.status = 0;
+	rec->call.size = 0;
+	active_records.append( rec );
+	return rec;
+}
+
+void syscall_log_exit( syscall_record_t *rec, NTSTATUS r )
+{
+	if (!rec)
+		return;
+
+	rec->call.status = r;
+	fwrite( &rec->call, sizeof rec->call, 1, record_file );
+	fwrite( rec->buffer, rec->call.size, 1, record_file );
+
+	active_records.unlink( rec );
+	delete rec;
+}
+
+void syscall_log_copy( ULONG type, const void *user, const void *data, size_t len )
+{
+	// the innermost call of the current thread made the copy
+	syscall_record_t *rec = active_records.tail();
+	while (rec && rec->thread != current)
+		rec = rec->entry[0].get_prev();
+	if (rec)
+		rec->add( type, user, data, len );
+}
+
+// replay
+
+static BYTE *replay_data;
+static syscall_log_call **replay_calls;	// sorted by seq
+static ULONG replay_count;
+
+static ULONG replayed, status_mismatches, output_mismatches;
+static ULONGLONG replay_ns;
+
+// where each thread is up to
+struct replay_cursor_t;
+typedef list_anchor<replay_cursor_t, 0> replay_cursor_list_t;
+typedef list_element<replay_cursor_t> replay_cursor_element_t;
+typedef list_iter<replay_cursor_t, 0> replay_cursor_iter_t;
+
+struct replay_cursor_t
+{
+	replay_cursor_element_t entry[1];
+	ULONG id;
+	ULONG next;		// index into replay_calls
+};
+
+static replay_cursor_list_t replay_cursors;
+
+// the copies of a call must exactly fill its size
+static bool copies_valid( BYTE *copies, ULONG size )
+{
+	ULONG ofs = 0;
+
+	while (ofs < size)
+	{
+		syscall_log_copy_t *copy = (syscall_log_copy_t*) (copies + ofs);
+		if (size - ofs < sizeof *copy)
+			return false;
+		ofs += sizeof *copy;
+		if (copy->len > size - ofs || pad4( copy->len ) > size - ofs)
+			return false;
+		ofs += pad4( copy->len );
+	}
+	return true;
+}
+
+static int compare_seq( const void *a, const void *b )
+{
+	const syscall_log_call *x = *(const syscall_log_call**) a;
+	const syscall_log_call *y = *(const syscall_log_call**) b;
+
+	if (x->seq < y->seq)
+		return -1;
+	return x->seq > y->seq;
+}
+
+void syscall_log_replay( const char *filename )
+{
+	struct stat st;
+	int fd = open( filename, O_RDONLY );
+	if (fd < 0 || fstat( fd, &st ) < 0)
+		die("failed to open %s\n", filename);
+
+	replay_data = new BYTE[st.st_size];
+	if (st.st_size != read( fd, replay_data, st.st_size ))
+		die("failed to read %s\n", filename);
+	close( fd );
+
+	syscall_log_header *header = (syscall_log_header*) replay_data;
+	if (st.st_size < (off_t) sizeof *header ||
+		header->magic != SYSCALL_LOG_MAGIC ||
+		header->size != sizeof (syscall_log_call))
+		die("%s is not a system call log\n", filename);
+
+	// check every length against the file while counting the calls,
+	// so nothing later needs to
+	BYTE *end = replay_data + st.st_size;
+	BYTE *p;
+	for (p = (BYTE*) &header[1]; p < end; replay_count++)
+	{
+		syscall_log_call *call = (syscall_log_call*) p;
+		ULONG left = end - p;
+		if (left < sizeof *call ||
+			call->size > left - sizeof *call ||
+			!copies_valid( (BYTE*) &call[1], call->size ))
+			die("%s is corrupt at offset %08x\n", filename, p - replay_data);
+		p += sizeof *call + call->size;
+	}
+
+	// put the calls in the order they started
+	replay_calls = new syscall_log_call*[replay_count];
+	ULONG n = 0;
+	for (p = (BYTE*) &header[1]; p < end; n++)
+	{
+		replay_calls[n] = (syscall_log_call*) p;
+		p += sizeof (syscall_log_call) + replay_calls[n]->size;
+	}
+	qsort( replay_calls, replay_count, sizeof replay_calls[0], compare_seq );
+	for (n = 1; n < replay_count; n++)
+		if (replay_calls[n]->seq == replay_calls[n - 1]->seq)
+			die("%s has two calls numbered %ld\n", filename, replay_calls[n]->seq);
+}
+
+bool syscall_log_replaying()
+{
+	return replay_calls != 0;
+}
+
+static replay_cursor_t *get_cursor( ULONG id )
+{
+	for (replay_cursor_iter_t i(replay_cursors); i; i.next())
+		if (i.cur()->id == id)
+			return i.cur();
+
+	replay_cursor_t *cursor = new replay_cursor_t;
+	cursor->id = id;
+	cursor->next = 0;
+	replay_cursors.append( cursor );
+	return cursor;
+}
+
+static void restore_user_memory( address_space *vm, syscall_log_copy_t *copy )
+{
+	BYTE *addr = (BYTE*) copy->addr;
+	if (vm->copy_to_user( addr, &copy[1], copy->len ) >= STATUS_SUCCESS)
+		return;
+
+	// memory the guest allocated itself, or a stack nobody made yet
+	BYTE *start = (BYTE*) (copy->addr & ~0xfff);
+	size_t len = ((copy->addr + copy->len + 0xfff) & ~0xfff) - (ULONG) start;
+	if (vm->allocate_virtual_memory( &start, 0, len, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE ) < STATUS_SUCCESS)
+		return;
+	vm->copy_to_user( addr, &copy[1], copy->len );
+}
+
+bool syscall_log_next( ULONG id, address_space *vm, syscall_replay_t& call )
+{
+	replay_cursor_t *cursor = get_cursor( id );
+	syscall_log_call *rec = 0;
+
+	while (cursor->next < replay_count)
+	{
+		rec = replay_calls[cursor->next++];
+		if (rec->id == id)
+			break;
+		rec = 0;
+	}
+	if (!rec)
+		return false;
+
+	call.func = rec->func;
+	call.uargs = (ULONG*) rec->uargs;
+	call.retaddr = rec->retaddr;
+	call.status = rec->status;
+	call.copies = (BYTE*) &rec[1];
+	call.size = rec->size;
+
+	// restore what was read, latest first, so that the first read of
+	// anything that was read twice is what's left in memory
+	ULONG count = 0, ofs;
+	for (ofs = 0; ofs < call.size; count++)
+		ofs += sizeof (syscall_log_copy_t) + pad4( ((syscall_log_copy_t*) (call.copies + ofs))->len );
+
+	syscall_log_copy_t **copies = new syscall_log_copy_t*[count];
+	count = 0;
+	for (ofs = 0; ofs < call.size; count++)
+	{
+		copies[count] = (syscall_log_copy_t*) (call.copies + ofs);
+		ofs += sizeof (syscall_log_copy_t) + pad4( copies[count]->len );
+	}
+	while (count--)
+		if (copies[count]->type == syscall_copy_read)
+			restore_user_memory( vm, copies[count] );
+	delete[] copies;
+
+	return true;
+}
+
+void syscall_log_check( syscall_replay_t& call, address_space *vm, NTSTATUS r, ULONGLONG ns )
+{
+	replayed++;
+	replay_ns += ns;
+
+	if (r != call.status)
+	{
+		dprintf("call %04lx returned %08lx, recorded %08lx\n", call.func, r, call.status);
+		status_mismatches++;
+	}
+
+	// compare what was written with what the recording wrote
+	for (ULONG ofs = 0; ofs < call.size; )
+	{
+		syscall_log_copy_t *copy = (syscall_log_copy_t*) (call.copies + ofs);
+		ofs += sizeof *copy + pad4( copy->len );
+		if (copy->type != syscall_copy_write)
+			continue;
+
+		// anything written again later only needs checking once
+		bool overwritten = false;
+		for (ULONG later = ofs; later < call.size && !overwritten; )
+		{
+			syscall_log_copy_t *c = (syscall_log_copy_t*) (call.copies + later);
+			later += sizeof *c + pad4( c->len );
+			overwritten = c->type == syscall_copy_write &&
+				c->addr < copy->addr + copy->len && copy->addr < c->addr + c->len;
+		}
+		if (overwritten)
+			continue;
+
+		BYTE *written = new BYTE[copy->len];
+		if (vm->copy_from_user( written, (void*) copy->addr, copy->len ) < STATUS_SUCCESS ||
+			memcmp( written, &copy[1], copy->len ))
+		{
+			dprintf("call %04lx wrote different data to %08lx\n", call.func, copy->addr);
+			output_mismatches++;
+		}
+		delete[] written;
+	}
+}
+
+void syscall_log_finish()
+{
+	if (record_file)
+	{
+		fclose( record_file );
+		record_file = 0;
+		syscall_recording = false;
+	}
+
+	if (replay_calls)
+	{
+		fprintf(stderr, "replayed %ld calls in %lld us, %ld status and %ld output mismatches\n",
+			replayed, replay_ns / 1000, status_mismatches, output_mismatches);
+		delete[] replay_calls;
+		delete[] replay_data;
+		replay_calls = 0;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * system call record and replay
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __RING3K_SYSCALL_LOG_H__
+#define __RING3K_SYSCALL_LOG_H__
+
+// --record=<file> writes each system call's number, arguments, status
+// and everything the handler copied from or to user memory to a file.
+// --replay=<file> starts the initial process as usual, but instead of
+// running its threads, feeds each thread its recorded calls in order.
+// User memory the call read is restored before the call, and the status
+// and memory written are compared afterwards.
+
+class syscall_record_t;
+
+extern bool syscall_recording;
+
+void syscall_log_record( const char *filename );
+void syscall_log_replay( const char *filename );
+bool syscall_log_replaying();
+void syscall_log_finish();
+
+syscall_record_t *syscall_log_enter( ULONG id, ULONG func, ULONG *uargs, ULONG retaddr );
+void syscall_log_exit( syscall_record_t *rec, NTSTATUS r );
+
+enum syscall_copy_type {
+	syscall_copy_read,
+	syscall_copy_write,
+};
+
+void syscall_log_copy( ULONG type, const void *user, const void *data, size_t len );
+
+struct syscall_replay_t {
+	ULONG func;
+	ULONG *uargs;
+	ULONG retaddr;
+	NTSTATUS status;
+	const BYTE *copies;
+	ULONG size;
+};
+
+// fill memory with what the next call of thread id read, and return the call
+bool syscall_log_next( ULONG id, address_space *vm, syscall_replay_t& call );
+void syscall_log_check( syscall_replay_t& call, address_space *vm, NTSTATUS r, ULONGLONG ns );
+
+#endif // __RING3K_SYSCALL_LOG_H__
@@ -24,6 +24,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -39,6 +40,9 @@
 #include "timer.h"
 #include "file.h"
 #include "queue.h"
+#include "trace_ring.h"
+#include "syscall_log.h"
+#include "slab.h"
 
 class thread_impl_t;
 
@@ -47,12 +51,16 @@ typedef list_anchor<thread_obj_wait_t, 0> thread_obj_wait_list_t;
 typedef list_element<thread_obj_wait_t> thread_obj_wait_element_t;
 typedef list_iter<thread_obj_wait_t, 0> thread_obj_wait_iter_t;
 
+static slab_t thread_obj_wait_slab( "thread_obj_wait_t" );
+
 struct thread_obj_wait_t : public watch_t
 {
 	thread_obj_wait_element_t entry[1];
 	sync_object_t *obj;
 	thread_impl_t *thread;
 public:
+	void *operator new(size_t sz) { return thread_obj_wait_slab.alloc( sz ); }
+	void operator delete(void *ptr) { thread_obj_wait_slab.free( ptr ); }
 	thread_obj_wait_t( thread_impl_t* t, sync_object_t* o);
 	virtual void notify();
 	virtual ~thread_obj_wait_t();
@@ -151,6 +159,7 @@ public:
 	BOOLEAN software_interrupt( BYTE number );
 	void handle_user_segv();
 	bool traced_access();
+	bool copy_on_write_fault();
 	void start_exception_handler(exception_stack_frame& frame);
 	NTSTATUS raise_exception( exception_stack_frame& info, BOOLEAN SearchFrames );
 	NTSTATUS do_user_callback( ULONG index, ULONG& length, PVOID& buffer);
@@ -190,10 +199,15 @@ public:
 
 	virtual void handle_fault();
 	virtual void handle_breakpoint();
+	virtual void handle_syscall();
+	virtual void handle_timeout();
+	bool replay_syscall();
 
 	virtual NTSTATUS copy_to_user( void *dest, const void *src, size_t count );
 	virtual NTSTATUS copy_from_user( void *dest, const void *src, size_t count );
 	virtual NTSTATUS verify_for_write( void *dest, size_t count );
+	virtual NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count );
+	virtual NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count );
 
 	virtual void* push( ULONG count );
 	virtual void pop( ULONG count );
@@ -411,6 +425,24 @@ bool thread_impl_t::traced_access()
 	return true;
 }
 
+// writing to a shared image page gives the process its own copy
+bool thread_impl_t::copy_on_write_fault()
+{
+	void* addr = 0;
+	if (0 != process->vm->get_fault_info( addr ))
+		return false;
+
+	if (trace_ring_enabled)
+		trace_ring_event( trace_fault_event, trace_id(), ctx.Eip, (ULONG) addr, 0, 0, 0 );
+
+	// only copy pages that are meant to be writeable
+	mblock* mb = process->vm->find_block( (BYTE*) addr );
+	if (!mb || !(mblock::mmap_flag_from_page_prot( mb->get_prot() ) & PROT_WRITE))
+		return false;
+
+	return mb->copy_on_write( process->vm );
+}
+
 void thread_impl_t::handle_user_segv()
 {
 	dprintf("%04lx: exception at %08lx\n", trace_id(), ctx.Eip);
@@ -661,12 +693,6 @@ BOOLEAN thread_impl_t::deliver_apc(NTSTATUS thread_return)
 	NTSTATUS r = STATUS_SUCCESS;
 	ULONG new_esp = ctx.Esp;
 
-	// push current context ... for NtContinue
-	new_esp -= sizeof ctx;
-	r = copy_to_user( (void*) new_esp, &ctx, sizeof ctx );
-	if (r < STATUS_SUCCESS)
-		goto end;
-
 	// setup APC
 	void *apc_stack[4];
 	apc_stack[0] = (void*) apc->proc;
@@ -674,8 +700,16 @@ BOOLEAN thread_impl_t::deliver_apc(NTSTATUS thread_return)
 	apc_stack[2] = apc->arg[1];
 	apc_stack[3] = apc->arg[2];
 
-	new_esp -= sizeof apc_stack;
-	r = copy_to_user( (void*) new_esp, apc_stack, sizeof apc_stack );
+	// push the APC args, then current context ... for NtContinue
+	new_esp -= sizeof ctx + sizeof apc_stack;
+	user_iovec_t iov[2];
+	iov[0].user = (void*) new_esp;
+	iov[0].kernel = apc_stack;
+	iov[0].len = sizeof apc_stack;
+	iov[1].user = (BYTE*) new_esp + sizeof apc_stack;
+	iov[1].kernel = &ctx;
+	iov[1].len = sizeof ctx;
+	r = copy_to_user_v( iov, 2 );
 	if (r < STATUS_SUCCESS)
 		goto end;
 
@@ -783,6 +817,22 @@ NTSTATUS thread_impl_t::verify_for_write( void *dest, size_t count )
 	return process->vm->verify_for_write( dest, count );
 }
 
+NTSTATUS thread_impl_t::copy_to_user_v( user_iovec_t *iov, ULONG count )
+{
+	assert( process->is_valid() );
+	if (is_terminated())
+		return STATUS_THREAD_IS_TERMINATING;
+	return process->vm->copy_to_user_v( iov, count );
+}
+
+NTSTATUS thread_impl_t::copy_from_user_v( user_iovec_t *iov, ULONG count )
+{
+	assert( process->is_valid() );
+	if (is_terminated())
+		return STATUS_THREAD_IS_TERMINATING;
+	return process->vm->copy_from_user_v( iov, count );
+}
+
 NTSTATUS thread_impl_t::zero_tls_cells( ULONG index )
 {
 	if (index >= (sizeof teb->TlsSlots/sizeof teb->TlsSlots[0]))
@@ -843,6 +893,8 @@ int thread_impl_t::run()
 	int i = 0;
 	while (1)
 	{
+		if (trace_ring_enabled && current != this)
+			trace_ring_event( trace_switch_event, trace_id(), current ? current->trace_id() : 0, 0, 0, 0, 0 );
 		current = this;
 
 		if (ThreadState == StateTerminated)
@@ -854,11 +906,32 @@ int thread_impl_t::run()
 			assert (0);
 		}
 
-		// run for 10ms
-		LARGE_INTEGER timeout;
-		timeout.QuadPart = 10L; // 10ms
+		// run for 10ms, or until the next timer is due (in 100ns units)
+		LARGE_INTEGER timeout, due;
+		timeout.QuadPart = 100000LL;
+		if (timeout_t::next_due( due ) && due.QuadPart < timeout.QuadPart)
+		{
+			// let the scheduler run timers that are already due
+			if (due.QuadPart <= 0LL)
+			{
+				i = 0;
+				fiber_t::yield();
+				continue;
+			}
+			timeout = due;
+		}
+		profile_limit_slice( timeout );
 
-		process->vm->run( TebBaseAddress, &ctx, false, timeout, this );
+		if (syscall_log_replaying())
+		{
+			if (!replay_syscall())
+			{
+				terminate( STATUS_SUCCESS );
+				return 0;
+			}
+		}
+		else
+			process->vm->run( TebBaseAddress, &ctx, false, timeout, this );
 
 		if (trace_step_access)
 		{
@@ -900,6 +973,8 @@ void thread_impl_t::handle_fault()
 		inst[0] != 0xcd ||
 		!software_interrupt( inst[1] ))
 	{
+		if (copy_on_write_fault())
+			return;
 		if (traced_access())
 			return;
 		if (option_debug)
@@ -908,6 +983,44 @@ void thread_impl_t::handle_fault()
 	}
 }
 
+// system call trapped directly (eg. by PTRACE_SYSEMU)
+// Eip is already past the trapping instruction
+void thread_impl_t::handle_syscall()
+{
+	assert( current == this );
+	context_changed = FALSE;
+	NTSTATUS r = do_nt_syscall( trace_id(), ctx.Eax, (ULONG*) ctx.Edx, ctx.Eip );
+	if (!context_changed)
+		ctx.Eax = r;
+}
+
+// make the thread's next recorded system call, instead of running it
+bool thread_impl_t::replay_syscall()
+{
+	syscall_replay_t call;
+
+	if (!syscall_log_next( trace_id(), process->vm, call ))
+		return false;
+
+	context_changed = FALSE;
+	ULONGLONG start = stats_clock();
+	NTSTATUS r = do_nt_syscall( trace_id(), call.func, call.uargs, call.retaddr );
+	ULONGLONG ns = stats_clock() - start;
+	if (!context_changed)
+		ctx.Eax = r;
+
+	// the process may have gone
+	if (process->vm)
+		syscall_log_check( call, process->vm, r, ns );
+	return true;
+}
+
+// the time slice ran out
+void thread_impl_t::handle_timeout()
+{
+	profile_sample( process, ctx.Eip );
+}
+
 void thread_impl_t::handle_breakpoint()
 {
 	fprintf(stderr,"stopped\n");
@@ -969,6 +1082,29 @@ bool thread_impl_t::win32k_init_complete()
 	return false;
 }
 
+// threads without an address space copy one buffer at a time
+NTSTATUS thread_t::copy_to_user_v( user_iovec_t *iov, ULONG count )
+{
+	for (ULONG i=0; i<count; i++)
+	{
+		NTSTATUS r = copy_to_user( iov[i].user, iov[i].kernel, iov[i].len );
+		if (r < STATUS_SUCCESS)
+			return r;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS thread_t::copy_from_user_v( user_iovec_t *iov, ULONG count )
+{
+	for (ULONG i=0; i<count; i++)
+	{
+		NTSTATUS r = copy_from_user( iov[i].kernel, iov[i].user, iov[i].len );
+		if (r < STATUS_SUCCESS)
+			return r;
+	}
+	return STATUS_SUCCESS;
+}
+
 void thread_t::get_client_id( CLIENT_ID *client_id )
 {
 	client_id->UniqueProcess = (HANDLE) (process->id);
@@ -1212,14 +1348,7 @@ NTSTATUS thread_impl_t::wait_on_handles(
 		}
 	}
 
-	// make sure we wait for a little bit every time
-	LARGE_INTEGER t;
-	if (timeout && timeout->QuadPart <= 0 && timeout->QuadPart> -100000LL)
-	{
-		t.QuadPart = -100000LL;
-		timeout = &t;
-	}
-
+	// timers and time slices are exact, so honour short timeouts as given
 	set_timeout( timeout );
 	while (1)
 	{
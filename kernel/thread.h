@@ -122,6 +122,8 @@ public:
 	virtual NTSTATUS copy_to_user( void *dest, const void *src, size_t count ) = 0;
 	virtual NTSTATUS copy_from_user( void *dest, const void *src, size_t count ) = 0;
 	virtual NTSTATUS verify_for_write( void *dest, size_t count ) = 0;
+	virtual NTSTATUS copy_to_user_v( user_iovec_t *iov, ULONG count );
+	virtual NTSTATUS copy_from_user_v( user_iovec_t *iov, ULONG count );
 	virtual void* push( ULONG count ) = 0;
 	virtual void pop( ULONG count ) = 0;
 	virtual PTEB get_teb() = 0;
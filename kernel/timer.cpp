@@ -33,7 +33,7 @@
 #include "debug.h"
 #include "object.inl"
 
-timeout_list_t timeout_t::g_timeouts;
+timeout_tree_t timeout_t::g_timeouts;
 static LARGE_INTEGER boot_time;
 static ULONG tick_count;
 
@@ -42,21 +42,15 @@ bool timeout_t::has_expired()
 	return !entry[0].is_linked();
 }
 
-bool timeout_t::queue_is_valid()
+// check a timeout against its neighbours, instead of the whole queue
+bool timeout_t::is_in_order()
 {
-	timeout_iter_t i(g_timeouts);
-	timeout_t *prev = 0;
-
-	i.reset();
-	while (i)
-	{
-		timeout_t* x = i;
-		if (prev && prev->expires.QuadPart > x->expires.QuadPart)
-			return false;
-		i.next();
-		prev = x;
-	}
-
+	timeout_t *prev = g_timeouts.prev( this );
+	timeout_t *next = g_timeouts.next( this );
+	if (prev && prev->expires.QuadPart > expires.QuadPart)
+		return false;
+	if (next && next->expires.QuadPart < expires.QuadPart)
+		return false;
 	return true;
 }
 
@@ -66,13 +60,14 @@ bool timeout_t::check_timers(LARGE_INTEGER& ret)
 	LARGE_INTEGER now = current_time();
 	timeout_t *t;
 
-	if (!g_timeouts.head())
+	if (g_timeouts.empty())
 		return false;
 
+	// only the timers that are due are looked at
 	ret.QuadPart = 0LL;
 	while (1)
 	{
-		t = g_timeouts.head();
+		t = g_timeouts.first();
 		if (!t)
 			return true;
 
@@ -88,6 +83,19 @@ bool timeout_t::check_timers(LARGE_INTEGER& ret)
 	return true;
 }
 
+// time until the first timer is due, without running any
+// returns false if there were no timers
+bool timeout_t::next_due(LARGE_INTEGER& ret)
+{
+	timeout_t *t = g_timeouts.first();
+	if (!t)
+		return false;
+
+	LARGE_INTEGER now = current_time();
+	ret.QuadPart = t->expires.QuadPart - now.QuadPart;
+	return true;
+}
+
 // FIXME: consider unifying this with logic in check_timers
 //        to avoid conflicting return values
 void timeout_t::time_remaining( LARGE_INTEGER& remaining )
@@ -122,26 +130,26 @@ void timeout_t::set_timeout(PLARGE_INTEGER t)
 
 	add();
 	assert(!g_timeouts.empty());
-	assert( queue_is_valid() );
+	assert( is_in_order() );
 }
 
 void timeout_t::add()
 {
-	timeout_iter_t i(g_timeouts);
-	timeout_t* x;
+	timeout_t *x, *point = 0;
+	bool to_right = false;
 
-	while ( (x = i) )
+	// take it out first, as unlinking can change the root
+	remove();
+	x = g_timeouts.root();
+
+	// timeouts with the same expiry time go after those already queued
+	while (x)
 	{
-		if (x->expires.QuadPart > expires.QuadPart)
-			break;
-		i.next();
+		point = x;
+		to_right = (x->expires.QuadPart <= expires.QuadPart);
+		x = to_right ? x->entry[0].get_right() : x->entry[0].get_left();
 	}
-
-	// if there's a timer before this one, no need to set the interval timer
-	if (x)
-		g_timeouts.insert_before(x, this);
-	else
-		g_timeouts.append(this);
+	g_timeouts.insert( point, to_right, this );
 }
 
 void timeout_t::remove()
@@ -21,25 +21,27 @@
 #ifndef __TIMER_H__
 #define __TIMER_H__
 
-#include "list.h"
+#include "rbtree.h"
 
 class timeout_t;
 
-typedef list_element<timeout_t> timeout_entry_t;
-typedef list_anchor<timeout_t,0> timeout_list_t;
-typedef list_iter<timeout_t,0> timeout_iter_t;
+// pending timeouts, ordered by expiry time then by when they were set
+typedef rbtree_element<timeout_t> timeout_entry_t;
+typedef rbtree<timeout_t,0> timeout_tree_t;
+typedef rbtree_iter<timeout_t,0> timeout_iter_t;
 
 class timeout_t
 {
-	friend class list_anchor<timeout_t,0> ;
-	friend class list_iter<timeout_t,0> ;
+	friend class rbtree<timeout_t,0>;
+	friend class rbtree_iter<timeout_t,0>;
 	timeout_entry_t entry[1];
 private:
-	static timeout_list_t g_timeouts;
+	static timeout_tree_t g_timeouts;
 	LARGE_INTEGER expires;
 protected:
 	void add();
 	void remove();
+	bool is_in_order();
 	//void set();
 public:
 	explicit timeout_t(PLARGE_INTEGER t = 0);
@@ -52,9 +54,9 @@ public:
 	virtual void signal_timeout() = 0;
 	//static bool timers_active();
 	static bool check_timers(LARGE_INTEGER& ret);
+	static bool next_due(LARGE_INTEGER& ret);
 	bool has_expired();
 	void time_remaining( LARGE_INTEGER& remaining );
-	static bool queue_is_valid();
 };
 
 void get_system_time_of_day( SYSTEM_TIME_OF_DAY_INFORMATION& time_of_day );
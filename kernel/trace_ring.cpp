@@ -0,0 +1,206 @@
+/*
+ * binary trace ring buffer
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+
+#include "debug.h"
+#include "trace_ring.h"
+
+bool trace_ring_enabled;
+
+static trace_ring_header *ring;
+static trace_record *records;
+static char *strings;
+
+// maps string pointers in the kernel to their offset in the string table
+// the strings interned are all constant, so the pointer is the key
+struct interned_string {
+	const char *str;
+	ULONG offset;
+};
+
+static const ULONG interned_size = 0x1000;
+static interned_string interned[interned_size];
+
+// strings passed as dprintf arguments change, so they're looked up by
+// their contents instead
+struct copied_string {
+	ULONG hash;
+	ULONG offset;
+};
+
+static const ULONG copied_size = 0x4000;
+static copied_string copied[copied_size];
+
+static inline ULONGLONG read_tsc()
+{
+	ULONG lo, hi;
+	__asm__ __volatile__( "rdtsc" : "=a"(lo), "=d"(hi) );
+	return ((ULONGLONG) hi << 32) | lo;
+}
+
+static ULONGLONG clock_ns()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// count cycles across a millisecond so the decoder can show real time
+static ULONGLONG calibrate_tsc()
+{
+	ULONGLONG start = clock_ns(), end;
+	ULONGLONG tsc = read_tsc();
+	do {
+		end = clock_ns();
+	} while (end - start < 1000000ULL);
+	return (read_tsc() - tsc) * 1000000ULL / (end - start);
+}
+
+void init_trace_ring()
+{
+	size_t size = sizeof (trace_ring_header) +
+		TRACE_RING_RECORDS * sizeof (trace_record) + TRACE_RING_STRINGS;
+
+	int fd = open( TRACE_RING_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if (fd < 0)
+		die("failed to create %s\n", TRACE_RING_FILE);
+
+	if (0 != ftruncate( fd, size ))
+		die("failed to size %s\n", TRACE_RING_FILE);
+
+	void *p = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if (p == MAP_FAILED)
+		die("failed to map %s\n", TRACE_RING_FILE);
+
+	ring = (trace_ring_header*) p;
+	records = (trace_record*) &ring[1];
+	strings = (char*) &records[TRACE_RING_RECORDS];
+
+	ring->records = TRACE_RING_RECORDS;
+	ring->strings = TRACE_RING_STRINGS;
+	ring->strings_used = 1;	// the empty string
+	ring->tsc_per_ms = calibrate_tsc();
+	ring->tsc_start = read_tsc();
+	ring->head = 0;
+	ring->magic = TRACE_RING_MAGIC;
+
+	trace_ring_enabled = true;
+}
+
+// returns 0 (the empty string) when the table is full
+static ULONG add_string( const char *str, ULONG len )
+{
+	if (ring->strings_used + len + 1 > ring->strings)
+		return 0;
+	ULONG offset = ring->strings_used;
+	memcpy( strings + offset, str, len );
+	strings[offset + len] = 0;
+	ring->strings_used += len + 1;
+	return offset;
+}
+
+ULONG trace_ring_string( const char *str )
+{
+	if (!str)
+		return 0;
+
+	ULONG n = ((ULONG) str >> 2) % interned_size;
+	for (ULONG i = 0; i < interned_size; i++)
+	{
+		interned_string *s = &interned[(n + i) % interned_size];
+		if (s->str == str)
+			return s->offset;
+		if (s->str)
+			continue;
+
+		// copy it to the table the first time it's seen
+		ULONG offset = add_string( str, strlen( str ) );
+		if (!offset)
+			return 0;
+		s->str = str;
+		s->offset = offset;
+		return offset;
+	}
+	return 0;
+}
+
+ULONG trace_ring_copy_string( const char *str )
+{
+	if (!str)
+		return 0;
+
+	ULONG len = strnlen( str, TRACE_RING_ARG_STRING );
+	ULONG hash = 5381;
+	for (ULONG i = 0; i < len; i++)
+		hash = hash * 33 + (unsigned char) str[i];
+
+	for (ULONG i = 0; i < copied_size; i++)
+	{
+		copied_string *s = &copied[(hash + i) % copied_size];
+		if (s->offset)
+		{
+			if (s->hash == hash &&
+				!strncmp( strings + s->offset, str, len ) &&
+				!strings[s->offset + len])
+				return s->offset;
+			continue;
+		}
+
+		ULONG offset = add_string( str, len );
+		if (!offset)
+			return 0;
+		s->hash = hash;
+		s->offset = offset;
+		return offset;
+	}
+	return 0;
+}
+
+// The kernel runs on one host thread, so there's a single writer and no
+// locking.  Bumping head last means a reader never sees a partial record,
+// except the oldest one, which may be in the middle of being overwritten.
+void trace_ring_event( int type, ULONG id, ULONG a0, ULONG a1, ULONG a2, ULONG a3, ULONG a4 )
+{
+	trace_record *rec = &records[(ULONG) ring->head & (TRACE_RING_RECORDS - 1)];
+	rec->tsc = read_tsc();
+	rec->type = type;
+	rec->id = id;
+	rec->arg[0] = a0;
+	rec->arg[1] = a1;
+	rec->arg[2] = a2;
+	rec->arg[3] = a3;
+	rec->arg[4] = a4;
+	ring->head++;
+}
@@ -0,0 +1,86 @@
+/*
+ * binary trace ring buffer
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __RING3K_TRACE_RING_H__
+#define __RING3K_TRACE_RING_H__
+
+// With --trace=ring, trace events are recorded as fixed size binary
+// records in a ring buffer mapped from a file, instead of formatted
+// to stderr.  The file survives a crash, and tracedump decodes it.
+//
+// The file holds a header, then the records, then a table of strings.
+// Strings (call names, dprintf formats and functions) are copied to
+// the table the first time they're seen, and records refer to them
+// by their offset into the table.  Offset 0 is the empty string.
+// String arguments to dprintf are stored the same way, cut to
+// TRACE_RING_ARG_STRING characters, and looked up by their contents.
+
+#define TRACE_RING_FILE "ring3k.trace"
+#define TRACE_RING_MAGIC 0x6b337274
+#define TRACE_RING_RECORDS 0x100000
+#define TRACE_RING_STRINGS 0x100000
+#define TRACE_RECORD_ARGS 5
+#define TRACE_RING_ARG_STRING 0x40
+
+enum trace_event_type {
+	trace_syscall_enter_event,
+	trace_syscall_exit_event,
+	trace_fault_event,
+	trace_switch_event,
+	trace_printf_event,
+};
+
+// syscall enter: name, retaddr, first three arguments
+// syscall exit:  name, status, retaddr
+// fault:         eip, fault address
+// switch:        id of the previous thread
+// printf:        format, function, line, first two arguments
+//                 (string arguments are string table offsets)
+struct trace_record {
+	unsigned long long tsc;
+	unsigned short type;
+	unsigned short id;
+	unsigned int arg[TRACE_RECORD_ARGS];
+};
+
+struct trace_ring_header {
+	unsigned int magic;
+	unsigned int records;
+	unsigned int strings;
+	unsigned int strings_used;
+	// timestamps are cpu cycles
+	unsigned long long tsc_per_ms;
+	unsigned long long tsc_start;
+	// number of records ever written, the next goes at head % records
+	unsigned long long head;
+};
+
+#ifdef __cplusplus
+
+extern bool trace_ring_enabled;
+
+void init_trace_ring();
+void trace_ring_event( int type, ULONG id, ULONG a0, ULONG a1, ULONG a2, ULONG a3, ULONG a4 );
+ULONG trace_ring_string( const char *str );
+ULONG trace_ring_copy_string( const char *str );
+
+#endif
+
+#endif // __RING3K_TRACE_RING_H__
@@ -0,0 +1,192 @@
+/*
+ * decode a binary trace written by --trace=ring
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace_ring.h"
+
+static struct trace_ring_header *ring;
+static struct trace_record *records;
+static const char *strings;
+
+static const char *get_string( unsigned int offset )
+{
+	if (offset >= ring->strings_used)
+		return "?";
+	return strings + offset;
+}
+
+// format with the arguments that were recorded, and show the rest as "?"
+static void print_format( const char *fmt, unsigned int *arg, int count )
+{
+	char fstr[16];
+	int n = 0, i;
+
+	while (*fmt)
+	{
+		if (fmt[0] != '%')
+		{
+			putchar( *fmt++ );
+			continue;
+		}
+		if (fmt[1] == '%')
+		{
+			putchar( '%' );
+			fmt += 2;
+			continue;
+		}
+
+		i = 0;
+		fstr[i++] = *fmt++;
+		while (*fmt == '-' || (*fmt >= '0' && *fmt <= '9'))
+			if (i < 8)
+				fstr[i++] = *fmt++;
+			else
+				fmt++;
+		while (*fmt == 'l')
+			fmt++;
+
+		if (n >= count)
+		{
+			fputs( "?", stdout );
+		}
+		else switch (*fmt)
+		{
+		case 'd':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+		case 'c':
+			fstr[i++] = *fmt;
+			fstr[i++] = 0;
+			printf( fstr, arg[n] );
+			break;
+		case 's':
+			fstr[i++] = 's';
+			fstr[i++] = 0;
+			printf( fstr, get_string( arg[n] ) );
+			break;
+		case 'S':
+			fputs( get_string( arg[n] ), stdout );
+			break;
+		case 'p':
+			// %pus and %pws strings were copied to the string table
+			if ((fmt[1] == 'u' || fmt[1] == 'w') && fmt[2] == 's')
+			{
+				fputs( get_string( arg[n] ), stdout );
+				fmt += 2;
+			}
+			else
+				printf( "%08x", arg[n] );
+			break;
+		default:
+			printf( "<%08x>", arg[n] );
+			break;
+		}
+		n++;
+		if (*fmt)
+			fmt++;
+	}
+}
+
+static void print_record( struct trace_record *rec )
+{
+	double ms = 0.0;
+	if (ring->tsc_per_ms)
+		ms = (double)(long long)(rec->tsc - ring->tsc_start) / ring->tsc_per_ms;
+
+	printf( "%12.3f %04x: ", ms, rec->id );
+	switch (rec->type)
+	{
+	case trace_syscall_enter_event:
+		printf( "%s(%08x,%08x,%08x...) ret=%08x\n", get_string( rec->arg[0] ),
+			rec->arg[2], rec->arg[3], rec->arg[4], rec->arg[1] );
+		break;
+	case trace_syscall_exit_event:
+		printf( "%s retval=%08x ret=%08x\n", get_string( rec->arg[0] ),
+			rec->arg[1], rec->arg[2] );
+		break;
+	case trace_fault_event:
+		printf( "fault at %08x address %08x\n", rec->arg[0], rec->arg[1] );
+		break;
+	case trace_switch_event:
+		printf( "switch from %04x\n", rec->arg[0] );
+		break;
+	case trace_printf_event:
+		printf( "%s:%d ", get_string( rec->arg[1] ), rec->arg[2] );
+		print_format( get_string( rec->arg[0] ), &rec->arg[3], 2 );
+		break;
+	default:
+		printf( "unknown event %d\n", rec->type );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	const char *name = TRACE_RING_FILE;
+	struct stat st;
+	unsigned long long i, start;
+	int fd;
+
+	if (argc > 2)
+	{
+		fprintf( stderr, "usage: %s [%s]\n", argv[0], TRACE_RING_FILE );
+		return 1;
+	}
+	if (argc == 2)
+		name = argv[1];
+
+	fd = open( name, O_RDONLY );
+	if (fd < 0 || fstat( fd, &st ) < 0)
+	{
+		fprintf( stderr, "can't open %s\n", name );
+		return 1;
+	}
+
+	ring = mmap( 0, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if (ring == MAP_FAILED || st.st_size < sizeof *ring ||
+		ring->magic != TRACE_RING_MAGIC ||
+		st.st_size < sizeof *ring + ring->records * sizeof *records + ring->strings)
+	{
+		fprintf( stderr, "%s is not a trace file\n", name );
+		return 1;
+	}
+
+	records = (struct trace_record*) &ring[1];
+	strings = (const char*) &records[ring->records];
+
+	// the oldest record may have been half overwritten, so skip it
+	start = 0;
+	if (ring->head > ring->records)
+		start = ring->head - ring->records + 1;
+
+	for (i = start; i < ring->head; i++)
+		print_record( &records[i % ring->records] );
+
+	return 0;
+}
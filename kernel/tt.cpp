@@ -43,6 +43,7 @@
 #include "winnt.h"
 #include "mem.h"
 #include "thread.h"
+#include "ntcall.h"
 
 #include "ptrace_if.h"
 #include "debug.h"
@@ -58,15 +59,22 @@ class tt_address_space_impl: public ptrace_address_space_impl
 {
 	long stub_regs[FRAME_SIZE];
 	pid_t child_pid;
+	struct tt_mailbox *mailbox;
+	int map_fd[TT_BATCH_MAX];	// our copy of each queued map's fd, or -1
 protected:
 	int userside_req( int type );
+	void init_mailbox();
+	struct tt_req *queue_req( int type );
+	void flush_reqs();
+	void discard_reqs();
 public:
 	tt_address_space_impl();
 	virtual pid_t get_child_pid();
 	virtual ~tt_address_space_impl();
-	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset );
+	virtual int mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset );
 	virtual int munmap( BYTE *address, size_t length );
 	virtual unsigned short get_userspace_fs();
+	virtual void run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec );
 };
 
 pid_t tt_address_space_impl::get_child_pid()
@@ -74,7 +82,8 @@ pid_t tt_address_space_impl::get_child_pid()
 	return child_pid;
 }
 
-tt_address_space_impl::tt_address_space_impl()
+tt_address_space_impl::tt_address_space_impl() :
+	mailbox( 0 )
 {
 	int r;
 	pid_t pid;
@@ -93,6 +102,12 @@ tt_address_space_impl::tt_address_space_impl()
 
 	// trace through exec after traceme
 	wait_for_signal( pid, SIGTRAP );
+	if (use_sysemu)
+	{
+		r = ::ptrace( PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD );
+		if (r < 0)
+			die("PTRACE_SETOPTIONS failed (%d)\n", errno);
+	}
 	r = ::ptrace( PTRACE_CONT, pid, 0, 0 );
 	if (r < 0)
 		die("PTRACE_CONT failed (%d)\n", errno);
@@ -104,13 +119,17 @@ tt_address_space_impl::tt_address_space_impl()
 		die("constructor: ptrace_get_regs failed (%d)\n", errno);
 
 	child_pid = pid;
+	init_mailbox();
 }
 
 tt_address_space_impl::~tt_address_space_impl()
 {
-	assert( sig_target == 0 );
 	//dprintf(stderr,"~tt_address_space_impl()\n");
 	destroy();
+	// the stub is about to die, so don't bother sending the last unmaps
+	discard_reqs();
+	::munmap( mailbox, TT_MAILBOX_SIZE );
+	mailbox = 0;
 	ptrace( PTRACE_KILL, child_pid, 0, 0 );
 	assert( child_pid != -1 );
 	kill( child_pid, SIGTERM );
@@ -130,8 +149,13 @@ int tt_address_space_impl::userside_req( int type )
 	struct tt_req *ureq = (struct tt_req *) stub_regs[EBX];
 	int r;
 
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->type, type );
+	if (mailbox)
+		mailbox->req.type = (enum tt_req_type) type;
+	else
+		ptrace( PTRACE_POKEDATA, child_pid, &ureq->type, type );
 
+	// the stub's registers replace the thread's, but %fs is untouched
+	regs_cached = false;
 	r = ptrace_set_regs( child_pid, stub_regs );
 	if (r < 0)
 		die("ptrace_set_regs failed\n");
@@ -147,28 +171,141 @@ int tt_address_space_impl::userside_req( int type )
 	return stub_regs[EAX];
 }
 
-int tt_address_space_impl::mmap( BYTE *address, size_t length, int prot, int flags, int file, off_t offset )
+// Share a page with the stub so requests can be written directly
+// rather than poked in a word at a time.
+void tt_address_space_impl::init_mailbox()
 {
-	//dprintf("tt_address_space_impl::mmap()\n");
+	int fd = create_mapping_fd( TT_MAILBOX_SIZE );
+	if (fd < 0)
+		die("couldn't create stub mailbox\n");
+
+	void *p = ::mmap( NULL, TT_MAILBOX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if (p == (void*) -1)
+		die("couldn't map stub mailbox (%d)\n", errno);
 
-	// send our pid to the stub
 	struct tt_req *ureq = (struct tt_req *) stub_regs[EBX];
 	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.pid, getpid() );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.fd, file );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.addr, (int) address );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.len, length );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.ofs, offset );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.prot, prot );
-	return userside_req( tt_req_map );
+	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.fd, fd );
+	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.addr, TT_MAILBOX_ADDRESS );
+	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.len, TT_MAILBOX_SIZE );
+	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.pgofs, 0 );
+	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.prot, PROT_READ | PROT_WRITE );
+	int r = userside_req( tt_req_mailbox );
+	close( fd );
+	if (r != 0 || stub_regs[EBX] != (long) &((struct tt_mailbox*) TT_MAILBOX_ADDRESS)->req)
+		die("stub failed to map mailbox\n");
+
+	mailbox = (struct tt_mailbox*) p;
+	mailbox->count = 0;
+}
+
+struct tt_req *tt_address_space_impl::queue_req( int type )
+{
+	if (mailbox->count == TT_BATCH_MAX)
+		flush_reqs();
+	map_fd[mailbox->count] = -1;
+	struct tt_req *req = &mailbox->batch[mailbox->count++];
+	req->type = (enum tt_req_type) type;
+	return req;
+}
+
+// forget the queued requests, closing the fds held for them
+void tt_address_space_impl::discard_reqs()
+{
+	for (unsigned int i=0; i<mailbox->count; i++)
+		if (map_fd[i] >= 0)
+			close( map_fd[i] );
+	mailbox->count = 0;
+}
+
+// send all the queued requests to the stub in a single round trip
+void tt_address_space_impl::flush_reqs()
+{
+	if (!mailbox->count)
+		return;
+
+	int failed = userside_req( tt_req_batch );
+	if (failed)
+	{
+		for (unsigned int i=0; i<mailbox->count; i++)
+		{
+			struct tt_req *req = &mailbox->batch[i];
+			if (mailbox->r[i] >= 0)
+				continue;
+			// the caller was told the map worked, and the client can't run without it
+			if (req->type == tt_req_map)
+				die("stub map failed (%d) addr %08x len %08x fd %d\n",
+					mailbox->r[i], req->u.map.addr, req->u.map.len, req->u.map.fd);
+			dprintf("stub unmap failed (%d) addr %08x len %08x\n",
+				mailbox->r[i], req->u.umap.addr, req->u.umap.len);
+		}
+	}
+	discard_reqs();
+}
+
+// Mappings are queued and applied before the client next runs.
+// The kernel accesses client memory through its own mappings,
+// so nothing else needs to wait for them.
+// The stub opens the fd through /proc, so a copy is held until the
+// flush, in case the caller closes the original and it is reused.
+int tt_address_space_impl::mmap( BYTE *address, size_t length, int prot, int flags, int file, LONGLONG offset )
+{
+	//dprintf("tt_address_space_impl::mmap()\n");
+	int fd = dup( file );
+	if (fd < 0)
+		return -1;
+
+	struct tt_req *req = queue_req( tt_req_map );
+	map_fd[mailbox->count - 1] = fd;
+	req->u.map.pid = getpid();
+	req->u.map.fd = fd;
+	req->u.map.addr = (unsigned int) address;
+	req->u.map.len = length;
+	req->u.map.pgofs = offset >> 12;
+	req->u.map.prot = prot;
+	return 0;
 }
 
 int tt_address_space_impl::munmap( BYTE *address, size_t length )
 {
 	//dprintf("tt_address_space_impl::munmap()\n");
-	struct tt_req *ureq = (struct tt_req *) stub_regs[EBX];
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.addr, (int) address );
-	ptrace( PTRACE_POKEDATA, child_pid, &ureq->u.map.len, length );
-	return userside_req( tt_req_umap );
+	unsigned int start = (unsigned int) address;
+	unsigned int end = start + length;
+	unsigned int i, n = 0;
+
+	// drop queued requests that this unmap would undo anyway
+	// partly covered ones stay, and are trimmed by the unmap in order
+	for (i=0; i<mailbox->count; i++)
+	{
+		struct tt_req *req = &mailbox->batch[i];
+		if (req->type == tt_req_map &&
+			req->u.map.addr >= start && (req->u.map.addr + req->u.map.len) <= end)
+		{
+			close( map_fd[i] );
+			continue;
+		}
+		if (req->type == tt_req_umap &&
+			req->u.umap.addr >= start && (req->u.umap.addr + req->u.umap.len) <= end)
+			continue;
+		if (n != i)
+		{
+			mailbox->batch[n] = *req;
+			map_fd[n] = map_fd[i];
+		}
+		n++;
+	}
+	mailbox->count = n;
+
+	struct tt_req *req = queue_req( tt_req_umap );
+	req->u.umap.addr = start;
+	req->u.umap.len = length;
+	return 0;
+}
+
+void tt_address_space_impl::run( void *TebBaseAddress, PCONTEXT ctx, int single_step, LARGE_INTEGER& timeout, execution_context_t *exec )
+{
+	flush_reqs();
+	ptrace_address_space_impl::run( TebBaseAddress, ctx, single_step, timeout, exec );
 }
 
 unsigned short tt_address_space_impl::get_userspace_fs()
@@ -214,6 +351,9 @@ bool init_tt( const char *kernel_path )
 	check_proc();
 	dprintf("using thread tracing, kernel %s, client %s\n", kernel_path, stub_path );
 	ptrace_address_space_impl::set_signals();
+	use_sysemu = ptrace_address_space_impl::check_sysemu();
+	if (use_sysemu)
+		dprintf("trapping system calls with PTRACE_SYSEMU\n");
 	pcreate_address_space = &create_tt_address_space;
 	return true;
 }
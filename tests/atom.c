@@ -106,6 +106,72 @@ static void test_atom(void)
 	ok(atom == nameatom, "atom value wrong\n");
 }
 
+static void test_integer_atom(void)
+{
+	NTSTATUS r;
+	WCHAR intname[] = L"#1234";
+	WCHAR zero[] = L"#0";
+	WCHAR toobig[] = L"#49152";
+	USHORT atom;
+
+	atom = magic;
+	r = NtAddAtom(intname, sizeof intname - 2, &atom);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok(atom == 1234, "atom value wrong %04x\n", atom);
+
+	atom = magic;
+	r = NtFindAtom(intname, sizeof intname - 2, &atom);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok(atom == 1234, "atom value wrong %04x\n", atom);
+
+	r = NtDeleteAtom(1234);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	atom = magic;
+	r = NtAddAtom(zero, sizeof zero - 2, &atom);
+	ok(r == STATUS_INVALID_PARAMETER, "return wrong %08lx\n", r);
+	ok(atom == magic, "atom value set\n");
+
+	atom = magic;
+	r = NtAddAtom(toobig, sizeof toobig - 2, &atom);
+	ok(r == STATUS_INVALID_PARAMETER, "return wrong %08lx\n", r);
+	ok(atom == magic, "atom value set\n");
+}
+
+static void test_delete_atom(void)
+{
+	NTSTATUS r;
+	WCHAR name[] = L"deleteme281470";
+	USHORT atom = 0, atom2 = 0;
+
+	r = NtFindAtom(name, sizeof name - 2, &atom);
+	ok(r == STATUS_OBJECT_NAME_NOT_FOUND, "return wrong %08lx\n", r);
+
+	// add twice, so it takes two deletes to remove
+	r = NtAddAtom(name, sizeof name - 2, &atom);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok(atom >= 0xc000, "atom value wrong %04x\n", atom);
+
+	r = NtAddAtom(name, sizeof name - 2, &atom2);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok(atom == atom2, "atom value wrong %04x %04x\n", atom, atom2);
+
+	r = NtDeleteAtom(atom);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtFindAtom(name, sizeof name - 2, &atom2);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtDeleteAtom(atom);
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtFindAtom(name, sizeof name - 2, &atom2);
+	ok(r == STATUS_OBJECT_NAME_NOT_FOUND, "return wrong %08lx\n", r);
+
+	r = NtDeleteAtom(atom);
+	ok(r == STATUS_INVALID_HANDLE, "return wrong %08lx\n", r);
+}
+
 // magic numbers for everybody
 void NTAPI init_callback(void *arg)
 {
@@ -148,5 +214,7 @@ void NtProcessStartup( void )
 	become_gui_thread();
 
 	test_atom();
+	test_integer_atom();
+	test_delete_atom();
 	log_fini();
 }
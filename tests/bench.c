@@ -0,0 +1,465 @@
+/*
+ * native benchmark suite
+ *
+ * Copyright 2009 Mike McCormack
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+// Each benchmark prints one line like:
+//   bench <name> ops=<count> usec=<elapsed> ops_per_sec=<rate>
+// so the results can be picked out of the log and compared between releases.
+
+#include <stdarg.h>
+#include "ntapi.h"
+#include "rtlapi.h"
+#include "ntwin32.h"
+#include "log.h"
+
+static LARGE_INTEGER bench_start;
+
+static void bench_begin( void )
+{
+	LARGE_INTEGER freq;
+	NtQueryPerformanceCounter( &bench_start, &freq );
+}
+
+static void bench_end( const char *name, ULONG ops )
+{
+	LARGE_INTEGER now, freq;
+	double secs;
+	LONG rate = 0;
+
+	NtQueryPerformanceCounter( &now, &freq );
+	secs = (double) (now.QuadPart - bench_start.QuadPart) / (double) freq.QuadPart;
+	if (secs > 0.0)
+		rate = (LONG) (ops / secs);
+	dprintf( "bench %s ops=%lu usec=%ld ops_per_sec=%ld\n",
+		name, ops, (LONG) (secs * 1000000.0), rate );
+}
+
+static HANDLE start_thread( void *func, void *arg )
+{
+	HANDLE thread = 0;
+	CLIENT_ID id;
+	NTSTATUS r;
+
+	r = RtlCreateUserThread( NtCurrentProcess(), NULL, FALSE,
+				 NULL, 0, 0, func, arg, &thread, &id );
+	ok( r == STATUS_SUCCESS, "failed to create thread %08lx\n", r );
+	return thread;
+}
+
+// null system call round trip
+
+#define NULL_SYSCALLS 10000
+
+void bench_null_syscall( void )
+{
+	ULONG i;
+
+	bench_begin();
+	for (i=0; i<NULL_SYSCALLS; i++)
+		NtTestAlert();
+	bench_end( "null_syscall", NULL_SYSCALLS );
+}
+
+// thread context switch, with two threads taking turns on a pair of events
+
+#define SWITCHES 1000
+
+HANDLE ping_event, pong_event;
+
+void switch_thread( void *param )
+{
+	ULONG i;
+
+	for (i=0; i<SWITCHES; i++)
+	{
+		NtWaitForSingleObject( ping_event, FALSE, NULL );
+		NtSetEvent( pong_event, NULL );
+	}
+	NtTerminateThread( NtCurrentThread(), STATUS_SUCCESS );
+}
+
+void bench_context_switch( void )
+{
+	HANDLE thread;
+	NTSTATUS r;
+	ULONG i;
+
+	r = NtCreateEvent( &ping_event, EVENT_ALL_ACCESS, NULL, SynchronizationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r );
+	r = NtCreateEvent( &pong_event, EVENT_ALL_ACCESS, NULL, SynchronizationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r );
+
+	thread = start_thread( switch_thread, NULL );
+
+	bench_begin();
+	for (i=0; i<SWITCHES; i++)
+	{
+		NtSetEvent( ping_event, NULL );
+		NtWaitForSingleObject( pong_event, FALSE, NULL );
+	}
+	bench_end( "context_switch", SWITCHES * 2 );
+
+	NtWaitForSingleObject( thread, FALSE, NULL );
+	NtClose( thread );
+	NtClose( ping_event );
+	NtClose( pong_event );
+}
+
+// LPC request and reply between two threads
+
+#define LPC_MESSAGES 1000
+
+WCHAR portname[] = L"\\BaseNamedObjects\\benchport";
+
+void lpc_client( void *param )
+{
+	SECURITY_QUALITY_OF_SERVICE qos;
+	BYTE req_buffer[0x100], reply_buffer[0x100];
+	LPC_MESSAGE *req = (void*) req_buffer, *reply = (void*) reply_buffer;
+	UNICODE_STRING us;
+	HANDLE port = 0;
+	NTSTATUS r;
+	ULONG i;
+
+	qos.Length = sizeof qos;
+	qos.ImpersonationLevel = SecurityAnonymous;
+	qos.ContextTrackingMode = SECURITY_DYNAMIC_TRACKING;
+	qos.EffectiveOnly = TRUE;
+
+	init_us( &us, portname );
+	r = NtConnectPort( &port, &us, &qos, 0, 0, 0, 0, 0 );
+	ok( r == STATUS_SUCCESS, "NtConnectPort failed %08lx\n", r );
+
+	memset( req_buffer, 0, sizeof req_buffer );
+	for (i=0; i<LPC_MESSAGES; i++)
+	{
+		req->MessageSize = FIELD_OFFSET(LPC_MESSAGE, Data) + 4;
+		req->DataSize = 4;
+		r = NtRequestWaitReplyPort( port, req, reply );
+		if (r != STATUS_SUCCESS)
+			break;
+	}
+	ok( r == STATUS_SUCCESS, "NtRequestWaitReplyPort failed %08lx\n", r );
+
+	NtClose( port );
+	NtTerminateThread( NtCurrentThread(), STATUS_SUCCESS );
+}
+
+void bench_lpc( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	HANDLE port = 0, con_port = 0, client_handle, thread;
+	BYTE buffer[0x100];
+	LPC_MESSAGE *req = (void*) buffer;
+	NTSTATUS r;
+	ULONG count = 0;
+
+	init_oa( &oa, &us, portname );
+	r = NtCreatePort( &port, &oa, 0x100, 0x100, 0 );
+	ok( r == STATUS_SUCCESS, "NtCreatePort failed %08lx\n", r );
+	if (r != STATUS_SUCCESS)
+		return;
+
+	thread = start_thread( lpc_client, NULL );
+
+	bench_begin();
+	while (count < LPC_MESSAGES)
+	{
+		r = NtReplyWaitReceivePort( port, &client_handle, 0, req );
+		if (r != STATUS_SUCCESS)
+			break;
+
+		if (req->MessageType == LPC_CONNECTION_REQUEST)
+		{
+			r = NtAcceptConnectPort( &con_port, 0, req, TRUE, NULL, NULL );
+			if (r == STATUS_SUCCESS)
+				r = NtCompleteConnectPort( con_port );
+		}
+		else if (req->MessageType == LPC_REQUEST)
+		{
+			r = NtReplyPort( port, req );
+			count++;
+		}
+		if (r != STATUS_SUCCESS)
+			break;
+	}
+	ok( r == STATUS_SUCCESS, "server failed %08lx\n", r );
+	bench_end( "lpc_round_trip", count );
+
+	NtWaitForSingleObject( thread, FALSE, NULL );
+	NtClose( thread );
+	NtClose( con_port );
+	NtClose( port );
+}
+
+// named pipe throughput, writing 4k blocks from one thread to another
+
+#define PIPE_BLOCKS 1000
+#define PIPE_BLOCK_SIZE 0x1000
+
+WCHAR pipename[] = L"\\??\\PIPE\\benchpipe";
+
+void pipe_writer( void *param )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	IO_STATUS_BLOCK iosb;
+	HANDLE client = 0, event = 0;
+	static BYTE block[PIPE_BLOCK_SIZE];
+	NTSTATUS r;
+	ULONG i;
+
+	r = NtCreateEvent( &event, EVENT_ALL_ACCESS, NULL, NotificationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r );
+
+	init_oa( &oa, &us, pipename );
+	r = NtOpenFile( &client, GENERIC_READ | GENERIC_WRITE, &oa, &iosb, FILE_SHARE_READ|FILE_SHARE_WRITE, 0 );
+	ok( r == STATUS_SUCCESS, "NtOpenFile failed %08lx\n", r );
+
+	for (i=0; r == STATUS_SUCCESS && i<PIPE_BLOCKS; i++)
+	{
+		r = NtWriteFile( client, event, 0, 0, &iosb, block, sizeof block, 0, 0 );
+		if (r == STATUS_PENDING)
+			r = NtWaitForSingleObject( event, TRUE, 0 );
+	}
+	ok( r == STATUS_SUCCESS, "write failed %08lx\n", r );
+
+	NtClose( client );
+	NtClose( event );
+	NtTerminateThread( NtCurrentThread(), STATUS_SUCCESS );
+}
+
+void bench_pipe( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us, target;
+	IO_STATUS_BLOCK iosb;
+	HANDLE pipe = 0, event = 0, thread, link;
+	LARGE_INTEGER timeout;
+	static BYTE block[PIPE_BLOCK_SIZE];
+	NTSTATUS r;
+	ULONG i;
+
+	init_oa( &oa, &us, L"\\??\\PIPE" );
+	init_us( &target, L"\\Device\\NamedPipe" );
+	target.MaximumLength = target.Length;
+	NtCreateSymbolicLinkObject( &link, DIRECTORY_ALL_ACCESS, &oa, &target );
+
+	init_oa( &oa, &us, pipename );
+	timeout.QuadPart = -10000LL;
+	r = NtCreateNamedPipeFile( &pipe, GENERIC_READ|GENERIC_WRITE|SYNCHRONIZE,
+				&oa, &iosb, FILE_SHARE_READ|FILE_SHARE_WRITE, FILE_OPEN_IF, 0, TRUE,
+				TRUE, FALSE, -1, 0, 0, &timeout );
+	ok( r == STATUS_SUCCESS, "NtCreateNamedPipeFile failed %08lx\n", r );
+	if (r != STATUS_SUCCESS)
+		return;
+
+	r = NtCreateEvent( &event, EVENT_ALL_ACCESS, NULL, NotificationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r );
+
+	thread = start_thread( pipe_writer, NULL );
+
+	r = NtFsControlFile( pipe, event, 0, 0, &iosb, FSCTL_PIPE_LISTEN, 0, 0, 0, 0 );
+	if (r == STATUS_PENDING)
+		r = NtWaitForSingleObject( event, TRUE, 0 );
+	ok( r == STATUS_SUCCESS, "failed to listen %08lx\n", r );
+
+	bench_begin();
+	for (i=0; r == STATUS_SUCCESS && i<PIPE_BLOCKS; i++)
+	{
+		r = NtReadFile( pipe, event, 0, 0, &iosb, block, sizeof block, 0, 0 );
+		if (r == STATUS_PENDING)
+			r = NtWaitForSingleObject( event, TRUE, 0 );
+	}
+	ok( r == STATUS_SUCCESS, "read failed %08lx\n", r );
+	bench_end( "pipe_4k_block", i );
+
+	NtWaitForSingleObject( thread, TRUE, 0 );
+	NtClose( thread );
+	NtClose( event );
+	NtClose( pipe );
+	NtClose( link );
+}
+
+// allocate, touch and free some virtual memory
+
+#define VM_ROUNDS 1000
+
+void bench_virtual_memory( void )
+{
+	NTSTATUS r = STATUS_SUCCESS;
+	ULONG i, size;
+	BYTE *p;
+
+	bench_begin();
+	for (i=0; r == STATUS_SUCCESS && i<VM_ROUNDS; i++)
+	{
+		p = 0;
+		size = 0x10000;
+		r = NtAllocateVirtualMemory( NtCurrentProcess(), (void**) &p, 0, &size, MEM_COMMIT, PAGE_READWRITE );
+		if (r != STATUS_SUCCESS)
+			break;
+		p[0] = 1;
+		p[size - 1] = 1;
+		size = 0;
+		r = NtFreeVirtualMemory( NtCurrentProcess(), (void**) &p, &size, MEM_RELEASE );
+	}
+	ok( r == STATUS_SUCCESS, "failed %08lx\n", r );
+	bench_end( "virtual_alloc_free", i );
+}
+
+// open an object by name
+
+#define OPENS 10000
+
+void bench_open_by_name( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	HANDLE event = 0, handle;
+	NTSTATUS r;
+	ULONG i;
+
+	init_oa( &oa, &us, L"\\BaseNamedObjects\\benchevent" );
+	r = NtCreateEvent( &event, EVENT_ALL_ACCESS, &oa, NotificationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r );
+
+	bench_begin();
+	for (i=0; r == STATUS_SUCCESS && i<OPENS; i++)
+	{
+		r = NtOpenEvent( &handle, EVENT_ALL_ACCESS, &oa );
+		if (r == STATUS_SUCCESS)
+			r = NtClose( handle );
+	}
+	ok( r == STATUS_SUCCESS, "failed %08lx\n", r );
+	bench_end( "open_by_name", i );
+
+	NtClose( event );
+}
+
+// open a registry key and read a value from it
+
+#define REG_LOOKUPS 5000
+
+void bench_registry( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us, value;
+	HANDLE key = 0;
+	BYTE buffer[0x100];
+	ULONG dispos, val = 1, sz, i;
+	NTSTATUS r;
+
+	init_oa( &oa, &us, L"\\REGISTRY\\Machine\\SOFTWARE\\ntbench" );
+	r = NtCreateKey( &key, KEY_ALL_ACCESS, &oa, 0, NULL, 0, &dispos );
+	ok( r == STATUS_SUCCESS, "NtCreateKey failed %08lx\n", r );
+	if (r != STATUS_SUCCESS)
+		return;
+
+	init_us( &value, L"benchvalue" );
+	r = NtSetValueKey( key, &value, 0, REG_DWORD, &val, sizeof val );
+	ok( r == STATUS_SUCCESS, "NtSetValueKey failed %08lx\n", r );
+	NtClose( key );
+
+	bench_begin();
+	for (i=0; r == STATUS_SUCCESS && i<REG_LOOKUPS; i++)
+	{
+		r = NtOpenKey( &key, KEY_READ, &oa );
+		if (r != STATUS_SUCCESS)
+			break;
+		r = NtQueryValueKey( key, &value, KeyValuePartialInformation, buffer, sizeof buffer, &sz );
+		NtClose( key );
+	}
+	ok( r == STATUS_SUCCESS, "lookup failed %08lx\n", r );
+	bench_end( "registry_lookup", i );
+}
+
+// blit between two memory device contexts
+
+#define BLITS 1000
+
+void NTAPI bench_callback( void *arg )
+{
+	NtCallbackReturn( 0, 0, 0 );
+}
+
+void *callback_table[90];
+
+void set_kernel_callback_table( void *table )
+{
+	void **peb;
+	__asm__ ( "movl %%fs:0x30, %%eax\n\t" : "=a" (peb) );
+	peb[0x2c/4] = table;
+}
+
+void bench_gdi_blit( void )
+{
+	USER_PROCESS_CONNECT_INFO info;
+	HANDLE screen, src, dst, src_bitmap, dst_bitmap;
+	BOOLEAN ret = TRUE;
+	ULONG i;
+
+	// win32k calls back into user space while starting up
+	for (i=0; i<sizeof callback_table/sizeof callback_table[0]; i++)
+		callback_table[i] = bench_callback;
+	set_kernel_callback_table( callback_table );
+
+	NtGdiInit();
+	memset( &info, 0, sizeof info );
+	info.Version = 0x00050000;
+	NtUserProcessConnect( NtCurrentProcess(), &info, sizeof info );
+
+	screen = NtUserGetDC( 0 );
+	ok( screen != 0, "no screen dc\n" );
+	if (!screen)
+		return;
+
+	src = NtGdiCreateCompatibleDC( screen );
+	dst = NtGdiCreateCompatibleDC( screen );
+	src_bitmap = NtGdiCreateCompatibleBitmap( screen, 64, 64 );
+	dst_bitmap = NtGdiCreateCompatibleBitmap( screen, 64, 64 );
+	NtGdiSelectBitmap( src, src_bitmap );
+	NtGdiSelectBitmap( dst, dst_bitmap );
+
+	bench_begin();
+	for (i=0; ret && i<BLITS; i++)
+		ret = NtGdiBitBlt( dst, 0, 0, 64, 64, src, 0, 0, SRCCOPY, 0, 0 );
+	ok( ret, "NtGdiBitBlt failed\n" );
+	bench_end( "gdi_blit_64x64", i );
+
+	NtGdiDeleteObjectApp( dst );
+	NtGdiDeleteObjectApp( src );
+	NtGdiDeleteObjectApp( dst_bitmap );
+	NtGdiDeleteObjectApp( src_bitmap );
+}
+
+void NtProcessStartup( void )
+{
+	log_init();
+	bench_null_syscall();
+	bench_context_switch();
+	bench_lpc();
+	bench_pipe();
+	bench_virtual_memory();
+	bench_open_by_name();
+	bench_registry();
+	bench_gdi_blit();
+	log_fini();
+}
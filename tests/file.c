@@ -332,6 +332,103 @@ void test_query_directory( void )
 	ok( r == STATUS_SUCCESS, "failed to delete directory %08lx\n", r);
 }
 
+void test_overlapped_read( void )
+{
+	WCHAR ntdll[] = L"\\??\\c:\\winnt\\system32\\NTDLL.DLL";
+	UNICODE_STRING path;
+	OBJECT_ATTRIBUTES oa;
+	HANDLE file = 0, event = 0;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER ofs;
+	BYTE buf[0x10];
+	NTSTATUS r;
+
+	init_oa( &oa, &path, ntdll );
+
+	// no FILE_SYNCHRONOUS_IO_* option, so reads can complete later
+	r = NtOpenFile( &file, GENERIC_READ, &oa, &iosb, FILE_SHARE_READ, 0 );
+	ok( r == STATUS_SUCCESS, "failed to open file %08lx\n", r);
+
+	r = NtCreateEvent( &event, EVENT_ALL_ACCESS, NULL, NotificationEvent, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	memset( buf, 0, sizeof buf );
+	iosb.Status = ~0;
+	iosb.Information = ~0;
+	ofs.QuadPart = 0;
+	r = NtReadFile( file, event, 0, 0, &iosb, buf, 2, &ofs, 0 );
+	ok( r == STATUS_PENDING, "read failed %08lx\n", r);
+	r = NtWaitForSingleObject( event, FALSE, 0 );
+	ok( r == STATUS_SUCCESS, "wait failed %08lx\n", r);
+	ok( iosb.Status == STATUS_SUCCESS, "status wrong %08lx\n", iosb.Status);
+	ok( iosb.Information == 2, "information wrong %08lx\n", iosb.Information);
+	ok( buf[0] == 'M' && buf[1] == 'Z', "data wrong\n");
+
+	// reading past the end of the file
+	ofs.QuadPart = 0x10000000;
+	iosb.Status = ~0;
+	r = NtReadFile( file, event, 0, 0, &iosb, buf, sizeof buf, &ofs, 0 );
+	ok( r == STATUS_PENDING, "read failed %08lx\n", r);
+	r = NtWaitForSingleObject( event, FALSE, 0 );
+	ok( r == STATUS_SUCCESS, "wait failed %08lx\n", r);
+	ok( iosb.Status == STATUS_END_OF_FILE, "status wrong %08lx\n", iosb.Status);
+
+	NtClose( event );
+	NtClose( file );
+}
+
+void test_file_position( void )
+{
+	WCHAR ntdll[] = L"\\??\\c:\\winnt\\system32\\NTDLL.DLL";
+	UNICODE_STRING path;
+	OBJECT_ATTRIBUTES oa;
+	FILE_POSITION_INFORMATION pos;
+	HANDLE file = 0;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER ofs;
+	BYTE buf[0x10];
+	NTSTATUS r;
+
+	init_oa( &oa, &path, ntdll );
+
+	r = NtOpenFile( &file, GENERIC_READ, &oa, &iosb, FILE_SHARE_READ, FILE_SYNCHRONOUS_IO_NONALERT );
+	ok( r == STATUS_SUCCESS, "failed to open file %08lx\n", r);
+
+	r = NtReadFile( file, 0, 0, 0, &iosb, buf, 2, 0, 0 );
+	ok( r == STATUS_SUCCESS, "read failed %08lx\n", r);
+	ok( buf[0] == 'M' && buf[1] == 'Z', "data wrong\n");
+
+	r = NtQueryInformationFile( file, &iosb, &pos, sizeof pos, FilePositionInformation );
+	ok( r == STATUS_SUCCESS, "query failed %08lx\n", r);
+	ok( pos.CurrentByteOffset.QuadPart == 2, "position wrong\n");
+
+	// an explicit offset moves the position
+	ofs.QuadPart = 0;
+	r = NtReadFile( file, 0, 0, 0, &iosb, buf, 1, &ofs, 0 );
+	ok( r == STATUS_SUCCESS, "read failed %08lx\n", r);
+	ok( buf[0] == 'M', "data wrong\n");
+
+	// FILE_USE_FILE_POINTER_POSITION
+	ofs.QuadPart = -2;
+	r = NtReadFile( file, 0, 0, 0, &iosb, buf, 1, &ofs, 0 );
+	ok( r == STATUS_SUCCESS, "read failed %08lx\n", r);
+	ok( buf[0] == 'Z', "data wrong\n");
+
+	r = NtQueryInformationFile( file, &iosb, &pos, sizeof pos, FilePositionInformation );
+	ok( r == STATUS_SUCCESS, "query failed %08lx\n", r);
+	ok( pos.CurrentByteOffset.QuadPart == 2, "position wrong\n");
+
+	pos.CurrentByteOffset.QuadPart = 1;
+	r = NtSetInformationFile( file, &iosb, &pos, sizeof pos, FilePositionInformation );
+	ok( r == STATUS_SUCCESS, "set failed %08lx\n", r);
+
+	r = NtReadFile( file, 0, 0, 0, &iosb, buf, 1, 0, 0 );
+	ok( r == STATUS_SUCCESS, "read failed %08lx\n", r);
+	ok( buf[0] == 'Z', "data wrong\n");
+
+	NtClose( file );
+}
+
 void NtProcessStartup( void )
 {
 	log_init();
@@ -339,6 +436,8 @@ void NtProcessStartup( void )
 	test_rtl_path();
 	test_file_open();
 	test_query_directory();
+	test_overlapped_read();
+	test_file_position();
 
 	log_fini();
 }
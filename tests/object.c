@@ -616,6 +616,95 @@ void test_symbolic_open_target( void )
 	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
 }
 
+void test_deleted_directory_path( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	HANDLE dir = 0, subdir = 0;
+	NTSTATUS r;
+
+	init_oa( &oa, &us, L"\\testdir" );
+	r = NtCreateDirectoryObject( &dir, GENERIC_READ, &oa );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	init_oa( &oa, &us, L"\\testdir\\foo" );
+	r = NtCreateDirectoryObject( &subdir, GENERIC_READ, &oa );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	// look up the same path repeatedly and in a different case
+	r = open_object_dir( FALSE, FALSE, 0, L"\\testdir\\foo" );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	r = open_object_dir( FALSE, FALSE, 0, L"\\testdir\\foo" );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	r = open_object_dir( FALSE, FALSE, 0, L"\\TESTDIR\\FOO" );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtClose( subdir );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	r = NtClose( dir );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	// the directories are gone, so the path must not resolve
+	r = open_object_dir( FALSE, FALSE, 0, L"\\testdir\\foo" );
+	ok( r == STATUS_OBJECT_PATH_NOT_FOUND, "return wrong %08lx\n", r);
+
+	// recreate the parent, but not the child
+	init_oa( &oa, &us, L"\\testdir" );
+	r = NtCreateDirectoryObject( &dir, GENERIC_READ, &oa );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = open_object_dir( FALSE, FALSE, 0, L"\\testdir\\foo" );
+	ok( r == STATUS_OBJECT_NAME_NOT_FOUND, "return wrong %08lx\n", r);
+
+	r = NtClose( dir );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+}
+
+#define MANY_HANDLES 0x400
+
+void test_many_handles( void )
+{
+	static HANDLE handle[MANY_HANDLES];
+	ULONG before = 0, after = 0;
+	HANDLE reused = 0;
+	NTSTATUS r;
+	int i;
+
+	r = NtQueryInformationProcess( NtCurrentProcess(), ProcessHandleCount, &before, sizeof before, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	for (i=0; i<MANY_HANDLES; i++)
+	{
+		r = NtCreateDirectoryObject( &handle[i], 0, 0 );
+		if (r != STATUS_SUCCESS)
+			break;
+		ok( ((ULONG)handle[i] & 3) == 0, "handle has tag bits set %p\n", handle[i]);
+	}
+	ok( i == MANY_HANDLES, "only created %d handles (%08lx)\n", i, r);
+
+	r = NtQueryInformationProcess( NtCurrentProcess(), ProcessHandleCount, &after, sizeof after, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok( after - before == MANY_HANDLES, "handle count wrong %ld %ld\n", before, after);
+
+	// a closed handle is reused by the next allocation
+	r = NtClose( handle[MANY_HANDLES/2] );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtCreateDirectoryObject( &reused, 0, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	ok( reused == handle[MANY_HANDLES/2], "handle not reused %p %p\n", reused, handle[MANY_HANDLES/2]);
+	handle[MANY_HANDLES/2] = reused;
+
+	for (i=0; i<MANY_HANDLES; i++)
+	{
+		r = NtClose( handle[i] );
+		ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+	}
+
+	r = NtClose( handle[0] );
+	ok( r == STATUS_INVALID_HANDLE, "return wrong %08lx\n", r);
+}
+
 void NtProcessStartup( void )
 {
 	log_init();
@@ -627,5 +716,7 @@ void NtProcessStartup( void )
 	test_symbolic_link();
 	test_symbolic_open_link();
 	test_symbolic_open_target();
+	test_deleted_directory_path();
+	test_many_handles();
 	log_fini();
 }
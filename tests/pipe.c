@@ -375,6 +375,89 @@ void test_pipe_server( void )
 	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
 }
 
+static WCHAR msgpipename[] = L"\\??\\PIPE\\msgtest";
+
+// writes one message four times the pipe's quota, then a short one
+void pipe_message_client( PVOID param )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	IO_STATUS_BLOCK iosb;
+	HANDLE client = 0;
+	static BYTE buf[0x400];
+	NTSTATUS r;
+	ULONG i;
+
+	for (i=0; i<sizeof buf; i++)
+		buf[i] = i;
+
+	init_oa( &oa, &us, msgpipename );
+	r = NtOpenFile( &client, GENERIC_READ | GENERIC_WRITE, &oa, &iosb, FILE_SHARE_READ|FILE_SHARE_WRITE, 0 );
+	ok(r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtWriteFile( client, 0, 0, 0, &iosb, buf, sizeof buf, 0, 0 );
+	ok( r == STATUS_SUCCESS, "write returned %08lx\n", r);
+	ok( iosb.Information == sizeof buf, "wrote %ld\n", iosb.Information);
+
+	r = NtWriteFile( client, 0, 0, 0, &iosb, buf, 3, 0, 0 );
+	ok( r == STATUS_SUCCESS, "write returned %08lx\n", r);
+
+	NtClose( client );
+	NtTerminateThread( NtCurrentThread(), 0 );
+}
+
+void test_pipe_message( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	IO_STATUS_BLOCK iosb;
+	HANDLE pipe = 0, thread = 0;
+	CLIENT_ID id;
+	LARGE_INTEGER timeout;
+	BYTE buf[0x100];
+	NTSTATUS r;
+	ULONG i;
+
+	init_oa( &oa, &us, msgpipename );
+	timeout.QuadPart = -10000LL;
+	r = NtCreateNamedPipeFile( &pipe, GENERIC_READ|GENERIC_WRITE|SYNCHRONIZE,
+				&oa, &iosb, FILE_SHARE_READ|FILE_SHARE_WRITE, FILE_OPEN_IF, 0, TRUE,
+				TRUE, FALSE, -1, 0x100, 0x100, &timeout );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = RtlCreateUserThread( NtCurrentProcess(), NULL, FALSE,
+				NULL, 0, 0, &pipe_message_client, NULL, &thread, &id );
+	ok( r == STATUS_SUCCESS, "failed to create thread\n" );
+
+	r = NtFsControlFile( pipe, 0, 0, 0, &iosb, FSCTL_PIPE_LISTEN, 0, 0, 0, 0 );
+	ok( r == STATUS_SUCCESS, "failed to listen %08lx\n", r );
+
+	// the first message is bigger than the quota and the read buffer
+	for (i=0; i<4; i++)
+	{
+		iosb.Information = 0;
+		r = NtReadFile( pipe, 0, 0, 0, &iosb, buf, sizeof buf, 0, 0 );
+		ok( r == (i == 3 ? STATUS_SUCCESS : STATUS_BUFFER_OVERFLOW), "read %ld returned %08lx\n", i, r);
+		ok( iosb.Information == sizeof buf, "read %ld got %ld\n", i, iosb.Information);
+		ok( buf[1] == 1, "data wrong\n");
+	}
+
+	// message boundaries are kept
+	r = NtReadFile( pipe, 0, 0, 0, &iosb, buf, sizeof buf, 0, 0 );
+	ok( r == STATUS_SUCCESS, "read returned %08lx\n", r);
+	ok( iosb.Information == 3, "read got %ld\n", iosb.Information);
+
+	// the client went away once the pipe was drained
+	r = NtWaitForSingleObject( thread, TRUE, 0 );
+	ok( r == STATUS_SUCCESS, "return wrong %08lx\n", r);
+
+	r = NtReadFile( pipe, 0, 0, 0, &iosb, buf, sizeof buf, 0, 0 );
+	ok( r == STATUS_PIPE_BROKEN, "read returned %08lx\n", r);
+
+	NtClose( thread );
+	NtClose( pipe );
+}
+
 void create_link( PWSTR linkname, PWSTR targetname )
 {
 	OBJECT_ATTRIBUTES oa;
@@ -395,5 +478,6 @@ void NtProcessStartup( void )
 	test_create_pipe();
 	test_create_pipe_names();
 	test_pipe_server();
+	test_pipe_message();
 	log_fini();
 }
@@ -1294,6 +1294,137 @@ void test_port_server_section(void)
 		"base mismatch %p %p\n", client_info.rd.ViewBase, wr.TargetViewBase );
 }
 
+#define SECTION_REQUEST_SIZE 0xc0
+
+LPC_MESSAGE *section_req;
+
+void thread_proc_section_request( void *param )
+{
+	NTSTATUS r;
+	HANDLE port = 0, section = 0;
+	UNICODE_STRING us;
+	OBJECT_ATTRIBUTES oa;
+	LARGE_INTEGER sz;
+	LPC_SECTION_READ rd;
+	LPC_SECTION_WRITE wr;
+	SECURITY_QUALITY_OF_SERVICE qos;
+	LPC_MESSAGE *req, *reply;
+	BYTE buffer[0x100];
+	ULONG i;
+
+	qos.Length = sizeof(qos);
+	qos.ImpersonationLevel = SecurityAnonymous;
+	qos.ContextTrackingMode = SECURITY_DYNAMIC_TRACKING;
+	qos.EffectiveOnly = TRUE;
+
+	set_portname( &us, &oa );
+
+	sz.QuadPart = TEST_SECTION_SIZE;
+	r = NtCreateSection( &section, SECTION_ALL_ACCESS, NULL, &sz, PAGE_EXECUTE_READWRITE, SEC_COMMIT, 0 );
+	ok( r == STATUS_SUCCESS, "return code wrong %08lx\n", r);
+
+	memset( &wr, 0, sizeof wr );
+	wr.Length = sizeof wr;
+	wr.SectionHandle = section;
+	wr.ViewSize = sz.QuadPart;
+
+	memset( &rd, 0, sizeof rd );
+	rd.Length = sizeof rd;
+
+	r = NtConnectPort( &port, &us, &qos, &wr, &rd, NULL, NULL, NULL );
+	ok( r == STATUS_SUCCESS, "NtConnectPort %08lx\n", r );
+
+	// build the request in our view of the section
+	req = wr.ViewBase;
+	memset( req, 0, sizeof *req );
+	req->DataSize = SECTION_REQUEST_SIZE;
+	req->MessageSize = FIELD_OFFSET(LPC_MESSAGE, Data) + SECTION_REQUEST_SIZE;
+	for (i=0; i<SECTION_REQUEST_SIZE; i++)
+		req->Data[i] = i;
+	section_req = req;
+
+	reply = (void*) buffer;
+	memset( buffer, 0, sizeof buffer );
+	r = NtRequestWaitReplyPort( port, req, reply );
+	ok( r == STATUS_SUCCESS, "NtRequestWaitReplyPort failed %08lx\n", r );
+	ok( reply->MessageType == LPC_REPLY, "message type wrong %d\n", reply->MessageType );
+	ok( reply->DataSize == 4, "data size wrong %d\n", reply->DataSize );
+	ok( reply->Data[0] == 'r', "reply data wrong\n" );
+
+	r = NtClose( port );
+	ok( r == STATUS_SUCCESS, "NtClose failed\n");
+
+	NtTerminateThread( NtCurrentThread(), STATUS_SUCCESS );
+}
+
+// a large request that sits in the client's port section
+void test_port_section_request( void )
+{
+	OBJECT_ATTRIBUTES oa;
+	UNICODE_STRING us;
+	CLIENT_ID id;
+	HANDLE thread = 0, port = 0, con_port = 0;
+	NTSTATUS r;
+	LPC_MESSAGE *req;
+	BYTE buffer[0x100];
+	ULONG i;
+
+	set_portname( &us, &oa );
+
+	r = NtCreatePort( &port, &oa, 0x100, 0x100, (void*) 0x4d4d );
+	ok( r == STATUS_SUCCESS, "wrong return %08lx\n", r );
+
+	r = RtlCreateUserThread( NtCurrentProcess(), NULL, FALSE,
+							 NULL, 0, 0, thread_proc_section_request, NULL, &thread, &id );
+	ok( r == STATUS_SUCCESS, "failed to create thread\n" );
+
+	req = (void*) buffer;
+	r = NtListenPort( port, req );
+	ok( r == STATUS_SUCCESS, "NtListenPort failed %08lx\n", r );
+	ok( req->MessageType == LPC_CONNECTION_REQUEST, "message type wrong\n");
+
+	r = NtAcceptConnectPort( &con_port, 0, req, TRUE, NULL, NULL );
+	ok( r == STATUS_SUCCESS, "NtAcceptConnectPort failed %08lx\n", r );
+
+	r = NtCompleteConnectPort( con_port );
+	ok( r == STATUS_SUCCESS, "NtCompleteConnectPort failed %08lx\n", r );
+
+	// let the client send, then change the request in its section
+	for (i=0; i<0x100; i++)
+		NtYieldExecution();
+
+	ok( section_req != NULL, "request not sent\n");
+	if (section_req)
+		section_req->Data[0] = '*';
+
+	memset( buffer, 0xff, sizeof buffer );
+	r = NtReplyWaitReceivePort( port, 0, 0, req );
+	ok( r == STATUS_SUCCESS, "NtReplyWaitReceivePort failed %08lx\n", r );
+	ok( req->MessageType == LPC_REQUEST, "message type wrong (%d)\n", req->MessageType);
+	ok( req->DataSize == SECTION_REQUEST_SIZE, "data size wrong (%d)\n", req->DataSize);
+	ok( req->ClientId.UniqueThread == id.UniqueThread, "thread id wrong\n");
+
+	// the payload was read from the section, not copied when it was sent
+	ok( req->Data[0] == '*', "data copied at send %02x\n", req->Data[0]);
+	for (i=1; i<SECTION_REQUEST_SIZE; i++)
+		if (req->Data[i] != (BYTE) i)
+			break;
+	ok( i == SECTION_REQUEST_SIZE, "data wrong at %ld\n", i);
+
+	req->DataSize = 4;
+	req->MessageSize = FIELD_OFFSET(LPC_MESSAGE, Data) + 4;
+	req->Data[0] = 'r';
+	r = NtReplyPort( con_port, req );
+	ok( r == STATUS_SUCCESS, "NtReplyPort failed %08lx\n", r );
+
+	r = NtWaitForSingleObject( thread, FALSE, NULL );
+	ok( r == STATUS_SUCCESS, "wait failed\n" );
+
+	NtClose( con_port );
+	NtClose( port );
+	NtClose( thread );
+}
+
 void thread_secure_proc_section( void *param )
 {
 	NTSTATUS r;
@@ -1829,6 +1960,7 @@ void NtProcessStartup( void )
 	test_port_bad_address();
 	test_port_connect_handle_output();
 	test_port_server_section();
+	test_port_section_request();
 	test_port_secure_connect();
 	test_port_connect_param();
 	test_port_loop();
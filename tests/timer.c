@@ -258,6 +258,67 @@ void test_timer_query(void)
 	ok( sz == sizeof info, "size wrong\n");
 }
 
+void test_timer_reset(void)
+{
+	LARGE_INTEGER timeout;
+	BOOLEAN prev = ~0;
+	HANDLE timer = 0, other = 0;
+	NTSTATUS r;
+	int i;
+
+	r = NtCreateTimer( &timer, TIMER_ALL_ACCESS, NULL, SynchronizationTimer );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	r = NtCreateTimer( &other, TIMER_ALL_ACCESS, NULL, SynchronizationTimer );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	// queue two timers, then move one while it is still active
+	timeout.QuadPart = -100000000LL; // 10s
+	r = NtSetTimer( other, &timeout, NULL, NULL, 0, 0, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	r = NtSetTimer( timer, &timeout, NULL, NULL, 0, 0, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+	ok( prev == 0, "timer signalled (%d)\n", prev);
+
+	timeout.QuadPart = -10000LL; // 1ms
+	r = NtSetTimer( timer, &timeout, NULL, NULL, 0, 0, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+	ok( prev == 0, "timer signalled (%d)\n", prev);
+
+	r = NtWaitForSingleObject( timer, FALSE, NULL );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	// the other timer should still be pending
+	timeout.QuadPart = 0LL;
+	r = NtWaitForSingleObject( other, FALSE, &timeout );
+	ok( r == STATUS_TIMEOUT, "return %08lx\n", r );
+
+	// a periodic timer is re-queued each time it fires
+	timeout.QuadPart = -10000LL;
+	r = NtSetTimer( timer, &timeout, NULL, NULL, 0, 1, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	for (i=0; i<3; i++)
+	{
+		r = NtWaitForSingleObject( timer, FALSE, NULL );
+		ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+	}
+
+	r = NtCancelTimer( timer, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	r = NtCancelTimer( other, &prev );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+	ok( prev == 0, "timer signalled (%d)\n", prev);
+
+	r = NtClose( other );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+
+	r = NtClose( timer );
+	ok( r == STATUS_SUCCESS, "return %08lx\n", r );
+}
+
 void NtProcessStartup( void )
 {
 	log_init();
@@ -265,5 +326,6 @@ void NtProcessStartup( void )
 	test_timer_apc();
 	test_delay();
 	test_timer_query();
+	test_timer_reset();
 	log_fini();
 }